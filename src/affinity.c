@@ -0,0 +1,148 @@
+#define _GNU_SOURCE // I need this for cpu_set_t and sched_setaffinity().
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "affinity.h"
+#include "config.h"
+
+// I need to access the global server configuration.
+extern server_config_t config;
+
+#define MAX_NUMA_NODES 64 // I only look for this many nodes (one unsigned long of node mask).
+
+// I turn a CPU list like "0-3,8,10-11" into a cpu_set_t.
+// I return the number of CPUs in the set, or -1 if the list doesn't parse.
+static int parse_cpu_list(const char *spec, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    const char *p = spec;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0 || first >= CPU_SETSIZE) return -1;
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first || last >= CPU_SETSIZE) return -1;
+            p = end;
+        }
+        for (long cpu = first; cpu <= last; cpu++) CPU_SET(cpu, set);
+        if (*p == ',') p++;
+        else if (*p) return -1;
+    }
+    return CPU_COUNT(set);
+}
+
+// I find the NUMA node a CPU belongs to by looking for its nodeN link in sysfs.
+static int cpu_node(int cpu)
+{
+    char path[128];
+    for (int node = 0; node < MAX_NUMA_NODES; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+        if (access(path, F_OK) == 0) return node;
+    }
+    return -1;
+}
+
+// I pick worker_id's share of the CPUs in 'all'. With at least as many CPUs as workers,
+// every worker gets its own contiguous slice; otherwise workers share CPUs in turn.
+static void worker_share(const cpu_set_t *all, int worker_id, cpu_set_t *mine)
+{
+    int cpus[CPU_SETSIZE];
+    int n = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, all)) cpus[n++] = cpu;
+    }
+
+    int workers = config.num_workers > 0 ? config.num_workers : 1;
+    CPU_ZERO(mine);
+    if (n >= workers) {
+        for (int i = worker_id * n / workers; i < (worker_id + 1) * n / workers; i++) CPU_SET(cpus[i], mine);
+    } else {
+        CPU_SET(cpus[worker_id % n], mine);
+    }
+}
+
+// I collect the NUMA nodes the CPUs in 'set' belong to into one node mask.
+// I return 0 if sysfs tells me nothing about nodes.
+static unsigned long cpu_nodes(const cpu_set_t *set)
+{
+    unsigned long nodes = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, set)) continue;
+        int node = cpu_node(cpu);
+        if (node >= 0) nodes |= 1UL << node;
+    }
+    return nodes;
+}
+
+// I ask the kernel to prefer the NUMA nodes of my CPUs for every page I touch from now on.
+// Anything allocated later (my queue, my cache entries, thread stacks) is then local.
+static void prefer_local_memory(const cpu_set_t *set)
+{
+    unsigned long nodes = cpu_nodes(set);
+    if (nodes == 0) return; // No NUMA information (or a single node): nothing to do.
+
+    // A worker whose CPUs span several nodes spreads its pages over them. I never bind,
+    // because a bound allocation fails outright once its node runs out of memory.
+    int mode = (__builtin_popcountl(nodes) == 1) ? MPOL_PREFERRED : MPOL_INTERLEAVE;
+    if (syscall(SYS_set_mempolicy, mode, &nodes, MAX_NUMA_NODES + 1) != 0) {
+        perror("set_mempolicy");
+    }
+}
+
+void apply_worker_affinity(int worker_id)
+{
+    if (config.worker_cpus[0] == '\0') return;
+
+    cpu_set_t all, mine;
+    if (parse_cpu_list(config.worker_cpus, &all) <= 0) {
+        fprintf(stderr, "[Worker %d] Invalid WORKER_CPUS '%s', not pinning.\n", getpid(), config.worker_cpus);
+        return;
+    }
+    worker_share(&all, worker_id, &mine);
+
+    // Threads inherit the mask, so my whole pool stays on these CPUs.
+    if (sched_setaffinity(0, sizeof(mine), &mine) != 0) {
+        perror("sched_setaffinity");
+        return;
+    }
+    prefer_local_memory(&mine);
+}
+
+void apply_accept_affinity()
+{
+    if (config.accept_cpus[0] == '\0') return;
+
+    cpu_set_t set;
+    if (parse_cpu_list(config.accept_cpus, &set) <= 0) {
+        fprintf(stderr, "Invalid ACCEPT_CPUS '%s', not pinning.\n", config.accept_cpus);
+        return;
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        perror("sched_setaffinity");
+    }
+}
+
+void interleave_shared_region(void *addr, size_t len)
+{
+    if (config.worker_cpus[0] == '\0' || !addr || len == 0) return;
+
+    cpu_set_t all;
+    if (parse_cpu_list(config.worker_cpus, &all) <= 0) return; // The workers report the bad list.
+    unsigned long nodes = cpu_nodes(&all);
+    if (__builtin_popcountl(nodes) < 2) return; // One node (or none): every read is local anyway.
+
+    // The policy belongs to the mapping, so it holds for the pages the workers fault in
+    // after the fork too. MPOL_MF_MOVE also spreads the few pages I've already touched.
+    if (syscall(SYS_mbind, addr, len, MPOL_INTERLEAVE, &nodes, MAX_NUMA_NODES + 1, MPOL_MF_MOVE) != 0) {
+        perror("mbind");
+    }
+}
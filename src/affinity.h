@@ -0,0 +1,21 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H // I'm using include guards to prevent multiple inclusion.
+
+#include <stddef.h>
+
+// I pin the calling worker process to its share of WORKER_CPUS and make it prefer
+// memory on the NUMA node(s) of those CPUs. Pool threads inherit both, and since the
+// worker calls this before it allocates its queue and cache, those land on the local node.
+// I do nothing if WORKER_CPUS is empty.
+void apply_worker_affinity(int worker_id);
+
+// I pin the calling process (the master's accept loop) to ACCEPT_CPUS,
+// typically the cores that take the NIC's interrupts. I do nothing if it's empty.
+void apply_accept_affinity();
+
+// I spread the pages of a region all workers share (the shared cache) evenly over the
+// NUMA nodes of WORKER_CPUS, so no node holds all of it and serves every other node's
+// reads remotely. I do nothing if WORKER_CPUS is empty or lies on a single node.
+void interleave_shared_region(void *addr, size_t len);
+
+#endif
@@ -0,0 +1,56 @@
+#include "arena.h"
+#include "buffer_pool.h"
+
+// A chunk is one buffer from the pool; this header sits at its start.
+struct arena_chunk {
+    arena_chunk_t *next;    // The chunk I filled before this one.
+    size_t used;            // How many bytes after the header are handed out.
+    size_t capacity;        // How many bytes after the header there are.
+    size_t pad;             // I keep the header 32 bytes so allocations stay 16-byte aligned.
+};
+
+#define ALIGN(n) (((n) + 15) & ~(size_t)15)
+
+void arena_init(arena_t *a)
+{
+    a->chunks = NULL;
+}
+
+void *arena_alloc(arena_t *a, size_t size)
+{
+    size = ALIGN(size > 0 ? size : 1);
+
+    arena_chunk_t *c = a->chunks;
+    if (!c || c->capacity - c->used < size) {
+        // I need a new chunk. Small requests share the smallest buffer,
+        // a big one gets a buffer of its own size.
+        size_t capacity;
+        c = buffer_pool_get(sizeof(arena_chunk_t) + size, &capacity);
+        if (!c) return NULL;
+        c->used = 0;
+        c->capacity = capacity - sizeof(arena_chunk_t);
+
+        // If the current chunk still has more room than the new one, I keep
+        // filling it and put the new chunk behind it.
+        if (a->chunks && a->chunks->capacity - a->chunks->used > c->capacity - size) {
+            c->next = a->chunks->next;
+            a->chunks->next = c;
+        } else {
+            c->next = a->chunks;
+            a->chunks = c;
+        }
+    }
+
+    void *p = (char *)(c + 1) + c->used;
+    c->used += size;
+    return p;
+}
+
+void arena_reset(arena_t *a)
+{
+    while (a->chunks) {
+        arena_chunk_t *c = a->chunks;
+        a->chunks = c->next;
+        buffer_pool_put(c);
+    }
+}
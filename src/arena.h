@@ -0,0 +1,26 @@
+#ifndef ARENA_H
+#define ARENA_H // I'm using include guards to prevent multiple inclusion.
+
+#include <stddef.h> // I need size_t.
+
+// This is a bump allocator for everything one request needs (the response body,
+// a copy of a cached file, generated JSON). Each connection owns one and resets it
+// once a response is out, so nothing is freed piece by piece. Its memory comes in
+// chunks from the buffer pool and goes back there on reset.
+typedef struct arena_chunk arena_chunk_t;
+
+typedef struct {
+    arena_chunk_t *chunks;  // The chunk I'm allocating from, followed by the older ones.
+} arena_t;
+
+// I start out empty; the first allocation takes a chunk.
+void arena_init(arena_t *a);
+
+// I return size bytes (16-byte aligned) that stay valid until the next reset.
+// I return NULL if memory ran out.
+void *arena_alloc(arena_t *a, size_t size);
+
+// I give all chunks back to the buffer pool. Everything allocated so far is gone.
+void arena_reset(arena_t *a);
+
+#endif
@@ -0,0 +1,172 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "buffer_pool.h"
+
+#define CLASS_COUNT 10      // 4KB, 8KB, ..., 2MB.
+#define OVERSIZE CLASS_COUNT // The class I record for buffers that came straight from malloc.
+
+typedef struct pool_owner pool_owner_t;
+
+// Every buffer starts with this header; the caller's bytes follow it.
+// I keep it 32 bytes so the payload stays as aligned as malloc's.
+typedef struct pool_buf {
+    struct pool_buf *next;  // My neighbour on a free list.
+    pool_owner_t *owner;    // The thread whose pool I came from, and go back to.
+    size_t size_class;      // Which list I go back to (OVERSIZE: free me).
+    size_t pad;
+} pool_buf_t;
+
+// A buffer is often returned by another thread than the one that got it: a pool thread
+// builds a response in its arena, and the event loop frees it once it's sent. Such a
+// buffer goes back to its owner through this stack, which any thread can push on and the
+// owner empties into its free lists when they run dry. Owners outlive their threads: when
+// a thread exits, its owner waits on the orphans list for the next new thread to adopt
+// it, so a late return never lands in freed memory.
+struct pool_owner {
+    pool_buf_t *returned;   // Buffers other threads gave back (pushed with a CAS).
+    size_t returned_bytes;  // How much they hold, so a thread that stops taking can't hoard.
+    pool_owner_t *next_orphan;
+};
+
+// This is one thread's stash of free buffers.
+typedef struct {
+    pool_buf_t *free[CLASS_COUNT];
+    size_t bytes;           // How much the free lists hold in total.
+    pool_owner_t *owner;    // Where other threads send my buffers back (NULL until my first get).
+} thread_pool_cache_t;
+
+static _Thread_local thread_pool_cache_t cache;
+static pthread_key_t exit_key;
+static pthread_once_t exit_key_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t orphans_lock = PTHREAD_MUTEX_INITIALIZER;
+static pool_owner_t *orphans;
+
+static size_t class_size(size_t size_class)
+{
+    return (size_t)BUFFER_POOL_MIN_SIZE << size_class;
+}
+
+// I take whatever other threads gave back to this thread's owner. A buffer joins its free
+// list while the thread stays under its budget; past that, or when keep is 0, it's freed.
+static void drain_returned(thread_pool_cache_t *c, int keep)
+{
+    pool_buf_t *b = __atomic_exchange_n(&c->owner->returned, NULL, __ATOMIC_ACQUIRE);
+    while (b) {
+        pool_buf_t *next = b->next;
+        size_t size = class_size(b->size_class);
+        __atomic_sub_fetch(&c->owner->returned_bytes, size, __ATOMIC_RELAXED);
+        if (keep && c->bytes + size <= BUFFER_POOL_THREAD_BYTES) {
+            b->next = c->free[b->size_class];
+            c->free[b->size_class] = b;
+            c->bytes += size;
+        } else {
+            free(b);
+        }
+        b = next;
+    }
+}
+
+// When a thread exits I give everything it kept back to malloc, and its owner to the
+// orphans list. Retired pool threads would leak their stash otherwise.
+static void release_thread_cache(void *arg)
+{
+    thread_pool_cache_t *c = arg;
+    for (int i = 0; i < CLASS_COUNT; i++) {
+        while (c->free[i]) {
+            pool_buf_t *b = c->free[i];
+            c->free[i] = b->next;
+            free(b);
+        }
+    }
+    c->bytes = 0;
+    drain_returned(c, 0);
+
+    pthread_mutex_lock(&orphans_lock);
+    c->owner->next_orphan = orphans;
+    orphans = c->owner;
+    pthread_mutex_unlock(&orphans_lock);
+    c->owner = NULL;
+}
+
+static void create_exit_key()
+{
+    pthread_key_create(&exit_key, release_thread_cache);
+}
+
+// The first time a thread gets a buffer, it adopts an orphaned owner (or makes a new one)
+// and I make sure its stash is freed on exit. Buffers still coming back to an adopted
+// owner are simply this thread's from then on.
+static int claim_owner()
+{
+    pthread_mutex_lock(&orphans_lock);
+    pool_owner_t *o = orphans;
+    if (o) orphans = o->next_orphan;
+    pthread_mutex_unlock(&orphans_lock);
+    if (!o && !(o = calloc(1, sizeof(*o)))) return -1;
+
+    pthread_once(&exit_key_once, create_exit_key);
+    pthread_setspecific(exit_key, &cache);
+    cache.owner = o;
+    return 0;
+}
+
+void *buffer_pool_get(size_t size, size_t *capacity)
+{
+    size_t size_class = 0;
+    while (size_class < CLASS_COUNT && class_size(size_class) < size) size_class++;
+
+    if (!cache.owner && claim_owner() != 0) return NULL;
+    if (size_class < CLASS_COUNT && !cache.free[size_class]) drain_returned(&cache, 1);
+
+    pool_buf_t *b = NULL;
+    if (size_class < CLASS_COUNT && cache.free[size_class]) {
+        b = cache.free[size_class];
+        cache.free[size_class] = b->next;
+        cache.bytes -= class_size(size_class);
+    } else {
+        size_t bytes = (size_class < CLASS_COUNT) ? class_size(size_class) : size;
+        b = malloc(sizeof(pool_buf_t) + bytes);
+        if (!b) return NULL;
+    }
+
+    b->size_class = size_class;
+    b->owner = cache.owner;
+    if (capacity) *capacity = (size_class < CLASS_COUNT) ? class_size(size_class) : size;
+    return b + 1;
+}
+
+void buffer_pool_put(void *buf)
+{
+    if (!buf) return;
+    pool_buf_t *b = (pool_buf_t *)buf - 1;
+
+    size_t size_class = b->size_class;
+    if (size_class == OVERSIZE) {
+        free(b);
+        return;
+    }
+
+    // Someone else's buffer goes back to them, unless they already have their fill.
+    if (b->owner != cache.owner) {
+        pool_owner_t *o = b->owner;
+        size_t size = class_size(size_class);
+        if (__atomic_add_fetch(&o->returned_bytes, size, __ATOMIC_RELAXED) > BUFFER_POOL_THREAD_BYTES) {
+            __atomic_sub_fetch(&o->returned_bytes, size, __ATOMIC_RELAXED);
+            free(b);
+            return;
+        }
+        b->next = __atomic_load_n(&o->returned, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&o->returned, &b->next, b, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        return;
+    }
+
+    if (cache.bytes + class_size(size_class) > BUFFER_POOL_THREAD_BYTES) {
+        free(b);
+        return;
+    }
+
+    b->next = cache.free[size_class];
+    cache.free[size_class] = b;
+    cache.bytes += class_size(size_class);
+}
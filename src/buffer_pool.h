@@ -0,0 +1,24 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H // I'm using include guards to prevent multiple inclusion.
+
+#include <stddef.h> // I need size_t.
+
+// These are recycled I/O buffers, so the request path doesn't go through malloc.
+// Buffers come in power-of-two size classes from 4KB to 2MB. Every thread keeps its
+// own free lists, so getting and returning a buffer never takes a lock; a thread
+// holds on to at most BUFFER_POOL_THREAD_BYTES of free buffers and gives the rest
+// back to malloc. Whatever a thread still holds is freed when it exits. A buffer always
+// returns to the pool of the thread that got it, whichever thread puts it back.
+#define BUFFER_POOL_MIN_SIZE 4096
+#define BUFFER_POOL_MAX_SIZE (2 * 1024 * 1024)
+#define BUFFER_POOL_THREAD_BYTES (4 * 1024 * 1024)
+
+// I hand out a buffer of at least size bytes (bigger requests go straight to malloc).
+// *capacity, if not NULL, gets the usable size. I return NULL if memory ran out.
+void *buffer_pool_get(size_t size, size_t *capacity);
+
+// I take back a buffer from buffer_pool_get(). Any thread may return it; if it isn't the
+// one that got it, the buffer is handed back to that thread's pool without a lock.
+void buffer_pool_put(void *buf);
+
+#endif
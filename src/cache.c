@@ -1,24 +1,112 @@
-#define _XOPEN_SOURCE 700 // I need this for POSIX extensions and thread-safe operations.
+#define _DEFAULT_SOURCE // I need this for POSIX extensions and MAP_ANONYMOUS.
 
 #include "cache.h"
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 #include <stdio.h>
-#include <bits/pthreadtypes.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+// * Memory Blocks
+// All entries live in one mmap'd region, so the workers can share it. I can't use malloc
+// in there, so I hand out blocks with a buddy allocator: every block is 256 bytes times
+// a power of two, up to 2MB, and a freed block merges with its free "buddy" (the other
+// half of the block it was split from) back into the bigger one.
+#define MIN_BLOCK_SHIFT 8      // The smallest block is 256 bytes...
+#define MAX_ORDER 13           // ...and the biggest 256 << 13 = 2MB (a cached file plus its header fits).
+#define BLOCK_SIZE(order) ((size_t)1 << (MIN_BLOCK_SHIFT + (order)))
+#define HASH_BUCKETS 1024      // Every shard gets a hash table with 1024 buckets.
+
+// * Pins
+// How many readers an entry has is kept outside the entry, in one counter per 256-byte
+// slot of the block area. A lookup that loses a race with a writer may pin a slot whose
+// entry is already gone; it only ever touches that counter (and takes the pin back),
+// never the memory that might belong to something else by now.
+// REF_DEAD is set in the counter once the entry has been dropped; whoever brings a
+// dead counter down to zero frees the block.
+#define REF_DEAD 0x40000000
+
+// A lookup retries this many times while writers keep changing the table, then it
+// takes the lock instead.
+#define OPTIMISTIC_TRIES 8
+
+// * Admission (W-TinyLFU)
+// Every shard counts how often each key is asked for in a count-min sketch: 4 rows of
+// counters, and a key bumps one counter per row. Its estimate is the smallest of its 4,
+// which can only be too high when every one of them is shared with hotter keys.
+// Counters stop at 15, and once the shard has counted SKETCH_SAMPLE lookups I halve them
+// all, so what was popular an hour ago fades out.
+// A new entry goes into a small window first (1% of the shard, oldest out first), where it
+// can prove itself. An entry bigger than that still gets to wait there, alone, until the
+// next one arrives, so the window is never held back for sizes that never come.
+// When the window is full, its oldest entry may only enter the CLOCK ring if it's been asked
+// for more often than the entry the hand would evict for it; otherwise it's dropped. A new
+// entry that needs a ring entry evicted to find a block faces the same contest. A crawler
+// that reads every file once never gets past the window.
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 4096      // Counters per row (a power of two).
+#define SKETCH_MAX 15
+#define SKETCH_SAMPLE (10 * SKETCH_WIDTH)
+#define WINDOW_PERCENT 1
+
+// A free block starts like a cache node (order, then the free flag) and links into
+// the free list of its order.
+typedef struct free_block {
+    unsigned char order;
+    unsigned char free;        // Always 1 here.
+    struct free_block *prev;
+    struct free_block *next;
+} free_block_t;
+
+// * Shards
+// The cache is split into shards by the hash of the key. Each shard is a complete cache of
+// its own: its lock, its sequence counter, its hash table, its CLOCK ring, and its share of
+// the blocks with their free lists and pin counters. Threads that want different files
+// mostly end up in different shards and never wait for each other.
+// Writers (cache_put() and eviction) take the shard's mutex, which is process-shared when the region is.
+// Readers take nothing: they walk the hash table under a sequence counter (a seqlock)
+// that writers make odd while they unlink an entry, and start over if it moved.
+// Instead of LRU I use CLOCK (second chance): a hit only sets the entry's referenced bit,
+// and the eviction hand goes round the ring, clearing bits, until it finds an entry
+// that hasn't been used since the last time it passed.
+typedef struct {
+    pthread_mutex_t lock;                  // Serializes this shard's writers.
+    unsigned seq __attribute__((aligned(64))); // Odd while a writer is unlinking an entry.
+    long hits __attribute__((aligned(64)));    // Lookups I answered (on a line of their own,
+    long misses;                               // so counting doesn't slow down reading 'seq').
+    long rejected;                             // Entries the admission filter dropped.
+    long additions;                            // Counter bumps since the sketch was last halved.
+    cache_node_t *htable[HASH_BUCKETS] __attribute__((aligned(64))); // I'll store pointers to hash table buckets here.
+    cache_node_t *hand;                    // The next entry the CLOCK hand looks at (NULL: no entries).
+    free_block_t *free_lists[MAX_ORDER + 1]; // The free blocks of each size.
+    int *refs;                             // One pin counter per 256-byte slot of my blocks.
+    char *blocks;                          // Where my first block starts.
+    size_t blocks_size;                    // How many bytes of blocks I have (a multiple of 2MB): my budget.
+    size_t used;                           // I'm tracking how many of them entries are using.
+    long entries;                          // How many entries I hold.
+    cache_node_t *window_head;             // The admission window, newest entry first...
+    cache_node_t *window_tail;             // ...and oldest last.
+    size_t window_used;                    // How many bytes of blocks the window's entries take...
+    size_t window_budget;                  // ...and may take before its oldest has to leave.
+    size_t main_used;                      // The same for the entries in the CLOCK ring.
+    size_t main_budget;
+    unsigned char sketch[SKETCH_DEPTH][SKETCH_WIDTH] __attribute__((aligned(64))); // Access frequencies.
+} cache_shard_t;
 
 // * Global Cache State
-// I'm keeping all cache data as static variables because I want a single, globally accessible cache.
-// My cache is thread-safe, protected by a read-write lock that allows multiple concurrent readers.
-// I implement an LRU (Least Recently Used) policy using a doubly-linked list for ordering
-// combined with a hash table for O(1) lookups.
-static cache_node_t **htable = NULL;    // I'll store pointers to hash table buckets here.
-static size_t hsize = 0;                // I need to remember how many buckets I have.
-static cache_node_t *head = NULL;       // This points to the MRU (Most Recently Used) end of my list.
-static cache_node_t *tail = NULL;       // This points to the LRU (Least Recently Used) end of my list.
-static size_t current_size = 0;         // I'm tracking the total size of cached data in bytes.
-static size_t max_size = 0;             // This is my limit - I can't exceed this many bytes.
-static pthread_rwlock_t cache_lock = PTHREAD_RWLOCK_INITIALIZER; // My read-write lock for thread safety.
+// Everything the cache needs sits at the start of its region: the shards, then the pin
+// counters of all of them. The blocks follow, each shard's share after the other.
+// The workers inherit the region from the master at the same address, so plain pointers
+// work in every process.
+typedef struct {
+    size_t map_size;                       // How big the whole mapping is, for munmap().
+    int shard_count;                       // How many of the shards below are in use.
+    int admission;                         // Which CACHE_ADMISSION_* policy cache_put() follows.
+    cache_shard_t shards[MAX_CACHE_SHARDS];
+} cache_region_t;
+
+static cache_region_t *cache = NULL;
 
 // I need a good hash function to distribute keys across my hash table.
 // I'm using the djb2 algorithm because it's simple and works well for strings.
@@ -27,7 +115,7 @@ static unsigned long hash_str(const char *s)
 {
     unsigned long h = 5381; // This is the magic seed value for djb2.
     int c;
-    
+
     // I'm iterating through each character of the string.
     // The formula is: hash * 33 + c, but I'm using bit shifting for efficiency.
     while ((c = *s++)) {
@@ -36,308 +124,646 @@ static unsigned long hash_str(const char *s)
     return h;
 }
 
-// I need to make sure my hash table is allocated before I use it.
-// This helper function checks if the table exists and creates it if it doesn't.
-static int ensure_table(size_t size)
+// The low part of the hash picks the shard, the rest picks the bucket inside it.
+static cache_shard_t *shard_for(unsigned long h)
+{
+    return &cache->shards[h % (unsigned long)cache->shard_count];
+}
+
+static unsigned long bucket_for(unsigned long h)
 {
-    if (htable) return 0; // If the table already exists, I'm good to go.
-    
-    hsize = size; // I'll remember the size I chose.
-    htable = calloc(hsize, sizeof(cache_node_t *)); // I'm using calloc to get zeroed memory.
-    return htable ? 0 : -1; // I return 0 on success, -1 if allocation failed.
+    return (h / (unsigned long)cache->shard_count) % HASH_BUCKETS;
+}
+
+// Each row of the sketch scrambles the hash with its own odd multiplier and takes the high bits.
+static size_t sketch_index(unsigned long h, int row)
+{
+    static const unsigned long seeds[SKETCH_DEPTH] = {
+        0x9e3779b97f4a7c15UL, 0xc2b2ae3d27d4eb4fUL, 0x165667b19e3779f9UL, 0xff51afd7ed558ccdUL
+    };
+    return (size_t)((h * seeds[row]) >> 40) & (SKETCH_WIDTH - 1);
+}
+
+// I count one more lookup of a key. Lookups don't hold the lock, so two of them may bump
+// the same counter at once and one bump gets lost; a sketch can live with that.
+static void sketch_record(cache_shard_t *s, unsigned long h)
+{
+    int grew = 0;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        unsigned char *c = &s->sketch[row][sketch_index(h, row)];
+        unsigned char v = __atomic_load_n(c, __ATOMIC_RELAXED);
+        if (v < SKETCH_MAX) {
+            __atomic_store_n(c, (unsigned char)(v + 1), __ATOMIC_RELAXED);
+            grew = 1;
+        }
+    }
+
+    // The lookup that completes the sample halves every counter; the others go on counting meanwhile.
+    if (grew && __atomic_add_fetch(&s->additions, 1, __ATOMIC_RELAXED) == SKETCH_SAMPLE) {
+        for (int row = 0; row < SKETCH_DEPTH; row++) {
+            for (size_t i = 0; i < SKETCH_WIDTH; i++) {
+                unsigned char v = __atomic_load_n(&s->sketch[row][i], __ATOMIC_RELAXED);
+                __atomic_store_n(&s->sketch[row][i], (unsigned char)(v >> 1), __ATOMIC_RELAXED);
+            }
+        }
+        __atomic_store_n(&s->additions, SKETCH_SAMPLE / 2, __ATOMIC_RELAXED);
+    }
+}
+
+// How often a key has been asked for lately, as far as the sketch can tell.
+static unsigned sketch_estimate(cache_shard_t *s, unsigned long h)
+{
+    unsigned freq = SKETCH_MAX;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        unsigned v = __atomic_load_n(&s->sketch[row][sketch_index(h, row)], __ATOMIC_RELAXED);
+        if (v < freq) freq = v;
+    }
+    return freq;
+}
+
+// The path follows the node, and the data follows the path.
+static char *node_key(cache_node_t *n)
+{
+    return (char *)(n + 1);
+}
+
+static char *node_data(cache_node_t *n)
+{
+    return node_key(n) + n->key_len + 1;
+}
+
+// This is the pin counter of the slot an entry starts at.
+static int *node_refs(cache_shard_t *s, cache_node_t *n)
+{
+    return &s->refs[(size_t)((char *)n - s->blocks) >> MIN_BLOCK_SHIFT];
+}
+
+// I put a free block at the front of the free list for its order.
+static void push_free(cache_shard_t *s, free_block_t *b, unsigned order)
+{
+    b->order = (unsigned char)order;
+    b->free = 1;
+    b->prev = NULL;
+    b->next = s->free_lists[order];
+    if (b->next) b->next->prev = b;
+    s->free_lists[order] = b;
+}
+
+// I take a free block out of its free list.
+static void unlink_free(cache_shard_t *s, free_block_t *b)
+{
+    if (b->prev) b->prev->next = b->next;
+    else s->free_lists[b->order] = b->next;
+    if (b->next) b->next->prev = b->prev;
+    b->free = 0;
+}
+
+// I return the smallest order whose blocks hold size bytes, or -1 if none does.
+static int order_for(size_t size)
+{
+    for (int order = 0; order <= MAX_ORDER; order++) {
+        if (BLOCK_SIZE(order) >= size) return order;
+    }
+    return -1;
+}
+
+// I hand out a block of the given order, splitting a bigger one if I have to.
+// I return NULL when no free block is big enough.
+static void *block_alloc(cache_shard_t *s, unsigned order)
+{
+    unsigned have = order;
+    while (have <= MAX_ORDER && !s->free_lists[have]) have++;
+    if (have > MAX_ORDER) return NULL;
+
+    free_block_t *b = s->free_lists[have];
+    unlink_free(s, b);
+
+    // I keep the front half and give the back half to the free list, until the block fits.
+    while (have > order) {
+        have--;
+        push_free(s, (free_block_t *)((char *)b + BLOCK_SIZE(have)), have);
+    }
+    b->order = (unsigned char)order;
+    s->used += BLOCK_SIZE(order);
+    return b;
+}
+
+// I give a block back and merge it with its buddy for as long as the buddy is free too.
+static void block_free(cache_shard_t *s, void *p, unsigned order)
+{
+    char *b = p;
+    s->used -= BLOCK_SIZE(order);
+
+    while (order < MAX_ORDER) {
+        // Blocks of one order are aligned to their size inside the shard's block area,
+        // so the buddy's offset differs from mine in exactly one bit.
+        size_t off = (size_t)(b - s->blocks);
+        free_block_t *buddy = (free_block_t *)(s->blocks + (off ^ BLOCK_SIZE(order)));
+        if (!buddy->free || buddy->order != order) break;
+        unlink_free(s, buddy);
+        if ((char *)buddy < b) b = (char *)buddy;
+        order++;
+    }
+    push_free(s, (free_block_t *)b, order);
+}
+
+// I drop one pin from a slot. If that was the last pin of an entry that has been
+// dropped meanwhile, the block is mine to free; I return 1 then.
+static int unpin(int *refs)
+{
+    int dead = REF_DEAD;
+    return __atomic_sub_fetch(refs, 1, __ATOMIC_SEQ_CST) == REF_DEAD &&
+           __atomic_compare_exchange_n(refs, &dead, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
 }
 
 // This is where I set up my cache system.
-// I need to initialize everything: the lock, the hash table, and set my size limits.
-int cache_init(size_t max_size_bytes)
-{
-    max_size = max_size_bytes; // I'm setting my maximum cache size.
-    current_size = 0; // Starting with an empty cache.
-    head = tail = NULL; // No nodes in my list yet.
-    
-    // I need to initialize the read-write lock for thread safety.
-    if (pthread_rwlock_init(&cache_lock, NULL) != 0) {
-        return -1; // If I can't create the lock, something's wrong.
+// I need to initialize everything: the region, and in every shard the lock, the hash
+// table and the free blocks.
+int cache_init(size_t max_size_bytes, int shared, int shards, int admission)
+{
+    // I'm rounding my maximum cache size up to whole 2MB blocks.
+    size_t big_blocks = (max_size_bytes + BLOCK_SIZE(MAX_ORDER) - 1) / BLOCK_SIZE(MAX_ORDER);
+    if (big_blocks == 0) return 0; // A cache of 0MB is no cache: every lookup misses.
+
+    // Every shard needs at least one 2MB block, or it couldn't hold the biggest entry.
+    if (shards < 1) shards = 1;
+    if (shards > MAX_CACHE_SHARDS) shards = MAX_CACHE_SHARDS;
+    if ((size_t)shards > big_blocks) shards = (int)big_blocks;
+
+    // The pin counters follow my bookkeeping, and the blocks start on a page boundary after them.
+    size_t blocks_size = big_blocks * BLOCK_SIZE(MAX_ORDER);
+    size_t slots = blocks_size >> MIN_BLOCK_SHIFT;
+    size_t ctl_size = (sizeof(cache_region_t) + slots * sizeof(int) + 4095) & ~(size_t)4095;
+    size_t map_size = ctl_size + blocks_size;
+    int flags = MAP_ANONYMOUS | (shared ? MAP_SHARED : MAP_PRIVATE);
+    void *mem_block = mmap(NULL, map_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (mem_block == MAP_FAILED) {
+        perror("mmap cache failed");
+        return -1;
+    }
+
+    // Anonymous mappings come back zeroed, so the tables, the rings, the lists and the
+    // counters already start out empty.
+    cache = (cache_region_t *)mem_block;
+    cache->map_size = map_size;
+    cache->shard_count = shards;
+    cache->admission = admission;
+
+    // I deal the 2MB blocks out as evenly as I can; the first shards may get one more.
+    int *refs = (int *)(cache + 1);
+    char *blocks = (char *)mem_block + ctl_size;
+    for (int i = 0; i < shards; i++) {
+        cache_shard_t *s = &cache->shards[i];
+        size_t share = big_blocks / (size_t)shards + ((size_t)i < big_blocks % (size_t)shards);
+        s->blocks = blocks;
+        s->blocks_size = share * BLOCK_SIZE(MAX_ORDER);
+        s->refs = refs;
+        blocks += s->blocks_size;
+        refs += s->blocks_size >> MIN_BLOCK_SHIFT;
+
+        // Without an admission filter there's no window: the ring may use everything.
+        // With one, the window gets its 1% and the ring the rest.
+        s->window_budget = 0;
+        if (admission == CACHE_ADMISSION_TINYLFU) s->window_budget = s->blocks_size * WINDOW_PERCENT / 100;
+        s->main_budget = s->blocks_size - s->window_budget;
+
+        // I need to initialize the writers' lock.
+        // In a shared region, threads of every worker process take it.
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        if (shared) pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        int rc = pthread_mutex_init(&s->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        if (rc != 0) {
+            while (i-- > 0) pthread_mutex_destroy(&cache->shards[i].lock);
+            munmap(mem_block, map_size);
+            cache = NULL;
+            return -1; // If I can't create the lock, something's wrong.
+        }
+
+        // Every 2MB of the block area starts out as one free block.
+        // I push them from the back so the free list hands out the front first.
+        for (size_t off = s->blocks_size; off > 0; off -= BLOCK_SIZE(MAX_ORDER)) {
+            push_free(s, (free_block_t *)(s->blocks + off - BLOCK_SIZE(MAX_ORDER)), MAX_ORDER);
+        }
     }
-    
-    // I'm creating a hash table with 4096 buckets. This is a good default size.
-    return ensure_table(4096);
+    return 0;
 }
 
 // When it's time to clean up, I need to free everything.
-// This function destroys the cache completely, freeing all memory.
+// The entries all live in the region, so unmapping it frees them at once.
 void cache_destroy()
 {
-    if (!htable) return; // If there's no cache, I have nothing to do.
-    
-    // I need exclusive access because I'm about to tear everything down.
-    pthread_rwlock_wrlock(&cache_lock);
-    
-    // I'm going through each bucket in my hash table.
-    for (size_t i = 0; i < hsize; i++) {
-        cache_node_t *n = htable[i];
-        
-        // For each bucket, I'm freeing all the nodes in the chain.
-        while (n) {
-            cache_node_t *next = n->hnext; // I save the next pointer before freeing.
-            
-            // I need to free all the dynamically allocated parts of the node.
-            free(n->path);  // The path string.
-            free(n->data);  // The cached data.
-            free(n);        // The node structure itself.
-            
-            n = next; // Move to the next node in the chain.
-        }
-        htable[i] = NULL; // This bucket is now empty.
+    if (!cache) return; // If there's no cache, I have nothing to do.
+
+    // I destroy the locks themselves since I won't need them anymore.
+    for (int i = 0; i < cache->shard_count; i++) {
+        pthread_mutex_destroy(&cache->shards[i].lock);
     }
-    
-    // Now I can free the hash table itself.
-    free(htable);
-    htable = NULL;
-    
-    // Reset all my global pointers.
-    head = tail = NULL;
-    current_size = 0;
-    
-    // I'm done modifying, so I can release the lock.
-    pthread_rwlock_unlock(&cache_lock);
-    
-    // Finally, I destroy the lock itself since I won't need it anymore.
-    pthread_rwlock_destroy(&cache_lock);
-}
-
-// This is an internal helper to remove a node from my doubly-linked list.
-// I'm not exposing this function because callers shouldn't mess with my list directly.
-static void remove_from_list(cache_node_t *n)
-{
-    if (!n) return; // If there's no node, I have nothing to do.
-    
-    // I need to update the node's neighbors to point to each other.
-    if (n->prev) {
-        n->prev->next = n->next; // The previous node now skips over me.
-    } else {
-        head = n->next; // If I was the head, the next node becomes the new head.
+    munmap(cache, cache->map_size);
+    cache = NULL;
+}
+
+void cache_region(void **addr, size_t *len)
+{
+    *addr = cache;
+    *len = cache ? cache->map_size : 0;
+}
+
+// A writer makes the sequence odd before it unlinks an entry and even again after,
+// so a lookup that overlapped it can tell and start over.
+static void write_begin(cache_shard_t *s)
+{
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_SEQ_CST);
+}
+
+static void write_end(cache_shard_t *s)
+{
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_SEQ_CST);
+}
+
+// This helper puts a node into my CLOCK ring right behind the hand,
+// so it's the last one the hand looks at.
+static void ring_insert(cache_shard_t *s, cache_node_t *n)
+{
+    if (!s->hand) {
+        n->prev = n->next = n;
+        s->hand = n;
+        return;
     }
-    
-    if (n->next) {
-        n->next->prev = n->prev; // The next node now points back to my previous.
+    n->next = s->hand;
+    n->prev = s->hand->prev;
+    n->prev->next = n;
+    s->hand->prev = n;
+}
+
+// This is an internal helper to take a node out of my ring.
+static void ring_remove(cache_shard_t *s, cache_node_t *n)
+{
+    if (n->next == n) {
+        s->hand = NULL; // It was the only one.
     } else {
-        tail = n->prev; // If I was the tail, the previous node becomes the new tail.
+        n->prev->next = n->next;
+        n->next->prev = n->prev;
+        if (s->hand == n) s->hand = n->next;
     }
-    
-    // I isolate the node completely.
     n->prev = n->next = NULL;
 }
 
-// This helper inserts a node at the front of my list, making it the Most Recently Used.
-static void insert_at_head(cache_node_t *n)
+// A new entry goes in at the front of the admission window.
+static void window_push(cache_shard_t *s, cache_node_t *n)
+{
+    n->in_window = 1;
+    n->prev = NULL;
+    n->next = s->window_head;
+    if (n->next) n->next->prev = n;
+    else s->window_tail = n;
+    s->window_head = n;
+    s->window_used += BLOCK_SIZE(n->order);
+}
+
+// This takes a node out of the window again.
+static void window_remove(cache_shard_t *s, cache_node_t *n)
+{
+    if (n->prev) n->prev->next = n->next;
+    else s->window_head = n->next;
+    if (n->next) n->next->prev = n->prev;
+    else s->window_tail = n->prev;
+    n->prev = n->next = NULL;
+    n->in_window = 0;
+    s->window_used -= BLOCK_SIZE(n->order);
+}
+
+// An entry joins the ring, and counts against the ring's budget.
+static void main_insert(cache_shard_t *s, cache_node_t *n)
+{
+    ring_insert(s, n);
+    s->main_used += BLOCK_SIZE(n->order);
+}
+
+// I drop an entry: out of its hash chain and out of the ring, so nobody finds it again.
+// Its block goes back to the allocator, unless a response is still being sent from it;
+// then the last cache_release() frees it. I hold the shard's lock.
+static void remove_node(cache_shard_t *s, cache_node_t *n)
 {
-    n->prev = NULL; // Nothing comes before the head.
-    n->next = head; // My current head becomes second in line.
-    
-    if (head) {
-        head->prev = n; // The old head now points back to me.
+    unsigned long h = bucket_for(hash_str(node_key(n))); // Find which bucket it's in.
+    cache_node_t **link = &s->htable[h];
+
+    // I'm searching through the hash chain to find this node.
+    while (*link && *link != n) link = &(*link)->hnext;
+    write_begin(s);
+    if (*link) __atomic_store_n(link, n->hnext, __ATOMIC_RELEASE); // Skip over it in the chain.
+    write_end(s);
+
+    if (n->in_window) {
+        window_remove(s, n);
     } else {
-        tail = n; // If the list was empty, I'm also the tail.
+        ring_remove(s, n);
+        s->main_used -= BLOCK_SIZE(n->order);
+    }
+    s->entries--;
+
+    // From here on a pin can only come from a lookup that's about to notice the sequence
+    // moved, and that lookup frees the block if it turns out to be the last one.
+    int dead = REF_DEAD;
+    int *refs = node_refs(s, n);
+    if (__atomic_or_fetch(refs, REF_DEAD, __ATOMIC_SEQ_CST) == REF_DEAD &&
+        __atomic_compare_exchange_n(refs, &dead, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        block_free(s, n, n->order);
     }
-    
-    head = n; // I'm the new head now!
-}
-
-// When my cache gets too big, I need to evict some items.
-// I always evict from the tail because that's where the Least Recently Used items are.
-static void evict_if_needed()
-{
-    // I keep removing tail nodes until my cache is within the size limit.
-    while (current_size > max_size && tail) {
-        cache_node_t *n = tail; // This is the item I'm going to evict.
-        
-        // First, I need to remove it from the hash table.
-        unsigned long h = hash_str(n->path) % hsize; // Find which bucket it's in.
-        cache_node_t *prev = NULL;
-        cache_node_t *iter = htable[h];
-        
-        // I'm searching through the hash chain to find this node.
-        while (iter) {
-            if (iter == n) { // Found it!
-                if (prev) {
-                    prev->hnext = iter->hnext; // Skip over me in the chain.
-                } else {
-                    htable[h] = iter->hnext; // I was the first in the bucket.
-                }
+}
+
+// I move the CLOCK hand until it finds a victim: an entry nobody has used since the hand
+// last passed it, and nobody is sending right now. I give every entry a second chance by
+// clearing its bit, so two trips round the ring are always enough.
+// I return the victim with the hand already past it, or NULL if every entry is pinned.
+static cache_node_t *clock_victim(cache_shard_t *s)
+{
+    cache_node_t *n = s->hand;
+    if (!n) return NULL;
+
+    long steps = 0;
+    long limit = 2 * s->entries + 1;
+    while (steps++ < limit) {
+        cache_node_t *next = n->next;
+        if ((__atomic_load_n(node_refs(s, n), __ATOMIC_SEQ_CST) & ~REF_DEAD) > 0) {
+            // Being sent right now: evicting it would free nothing yet.
+        } else if (__atomic_load_n(&n->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&n->referenced, 0, __ATOMIC_RELAXED); // Second chance.
+        } else {
+            s->hand = next;
+            return n;
+        }
+        n = next;
+        s->hand = n;
+    }
+    return NULL;
+}
+
+// When no block is free, I drop the window's oldest idle entry first (it hasn't been
+// admitted yet, after all), and only then let the CLOCK hand evict from the ring.
+// freq is how often the entry I'm making room for has been asked for: under TinyLFU a
+// ring entry asked for at least as often stays, and I return 1 so the newcomer is dropped.
+// I return -1 if every entry is pinned.
+static int evict_one(cache_shard_t *s, unsigned freq)
+{
+    for (cache_node_t *n = s->window_tail; n; n = n->prev) {
+        if ((__atomic_load_n(node_refs(s, n), __ATOMIC_SEQ_CST) & ~REF_DEAD) == 0) {
+            remove_node(s, n);
+            return 0;
+        }
+    }
+
+    cache_node_t *victim = clock_victim(s);
+    if (!victim) return -1;
+    if (cache->admission == CACHE_ADMISSION_TINYLFU && freq <= sketch_estimate(s, hash_str(node_key(victim)))) {
+        return 1;
+    }
+    remove_node(s, victim);
+    return 0;
+}
+
+// While the window is over its budget, its oldest entry has to move on. It joins the ring
+// if there's room; if not, it competes with the hand's victims: as long as it's been asked
+// for more often than the victim, the victim goes, and the first time it hasn't, it goes.
+// The newest entry always stays, even when it alone is over the budget.
+static void admit_from_window(cache_shard_t *s)
+{
+    while (s->window_used > s->window_budget && s->window_tail != s->window_head) {
+        cache_node_t *candidate = s->window_tail;
+        size_t size = BLOCK_SIZE(candidate->order);
+        unsigned freq = sketch_estimate(s, hash_str(node_key(candidate)));
+        int admit = 1;
+
+        while (s->main_used + size > s->main_budget) {
+            cache_node_t *victim = clock_victim(s);
+            if (!victim || freq <= sketch_estimate(s, hash_str(node_key(victim)))) {
+                admit = 0;
                 break;
             }
-            prev = iter;
-            iter = iter->hnext;
+            remove_node(s, victim);
+        }
+
+        if (admit) {
+            window_remove(s, candidate);
+            main_insert(s, candidate);
+        } else {
+            remove_node(s, candidate);
+            s->rejected++;
         }
-        
-        // Now remove it from the LRU list.
-        remove_from_list(n);
-        
-        // Update my size tracker.
-        current_size -= n->len;
-        
-        // Free all the memory associated with this node.
-        free(n->path);
-        free(n->data);
-        free(n);
     }
 }
 
+// Lookups that don't hold the lock may follow a pointer out of an entry that has just been
+// dropped and overwritten. I only look at a node if it lies inside the shard's blocks, starts
+// on a slot and has room for the key I'm after, so a bad pointer can't take me outside them.
+static int plausible_node(const cache_shard_t *s, const cache_node_t *n, size_t key_len)
+{
+    const char *p = (const char *)n;
+    if (p < s->blocks || p >= s->blocks + s->blocks_size) return 0;
+    if (((size_t)(p - s->blocks) & (BLOCK_SIZE(0) - 1)) != 0) return 0;
+    return sizeof(cache_node_t) + key_len + 1 <= (size_t)(s->blocks + s->blocks_size - p);
+}
+
+// I walk one hash chain looking for path. Without the lock, what I read may be torn by a
+// writer; the caller checks the sequence afterwards and throws the answer away if so.
+static cache_node_t *find_node(cache_shard_t *s, unsigned long h, const char *path, size_t key_len, int locked)
+{
+    size_t hops = s->blocks_size >> MIN_BLOCK_SHIFT; // A chain can't be longer than this.
+    cache_node_t *n = __atomic_load_n(&s->htable[h], __ATOMIC_ACQUIRE);
+    while (n && hops-- > 0) {
+        if (!locked && !plausible_node(s, n, key_len)) return NULL;
+        if (n->key_len == key_len && memcmp(node_key(n), path, key_len) == 0) return n; // Found it!
+        n = __atomic_load_n(&n->hnext, __ATOMIC_ACQUIRE);
+    }
+    return NULL;
+}
+
+// I look a key up in its shard and pin what I find, or return NULL.
+static cache_node_t *lookup(cache_shard_t *s, unsigned long h, const char *path, size_t key_len)
+{
+    // I look without the lock first. If the sequence was even when I started and still
+    // has the same value once I've pinned what I found, no writer got in the way: the node
+    // was in the table the whole time, and my pin now keeps it there.
+    for (int tries = 0; tries < OPTIMISTIC_TRIES; tries++) {
+        unsigned seq = __atomic_load_n(&s->seq, __ATOMIC_SEQ_CST);
+        if (seq & 1) continue; // A writer is in the middle of a change.
+
+        cache_node_t *n = find_node(s, h, path, key_len, 0);
+        if (!n) {
+            // A miss only counts if nothing changed while I was looking.
+            if (__atomic_load_n(&s->seq, __ATOMIC_SEQ_CST) == seq) return NULL;
+            continue;
+        }
+
+        int *refs = node_refs(s, n);
+        __atomic_add_fetch(refs, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&s->seq, __ATOMIC_SEQ_CST) == seq) return n;
+        if (unpin(refs)) {
+            // The entry was dropped while I held my pin, and I was the last one.
+            pthread_mutex_lock(&s->lock);
+            block_free(s, n, n->order);
+            pthread_mutex_unlock(&s->lock);
+        }
+    }
+
+    // Writers kept me from getting a clean look, so I wait my turn with them.
+    pthread_mutex_lock(&s->lock);
+    cache_node_t *n = find_node(s, h, path, key_len, 1);
+    if (n) __atomic_add_fetch(node_refs(s, n), 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&s->lock);
+    return n;
+}
+
 // This is the main function for getting data from the cache.
 // When someone asks for a file, I check if I have it cached.
-int cache_get(const char *path, char **out_buf, size_t *out_len)
-{
-    if (!htable) return -1; // If cache isn't initialized, I can't help.
-    
-    unsigned long h = hash_str(path) % hsize; // Figure out which bucket to check.
-    
-    // I start with a read lock because I'm just looking, not modifying.
-    if (pthread_rwlock_rdlock(&cache_lock) != 0) return -1;
-    
-    // I'm searching through the hash chain in this bucket.
-    cache_node_t *n = htable[h];
-    while (n) {
-        if (strcmp(n->path, path) == 0) break; // Found it!
-        n = n->hnext;
+int cache_get(const char *path, const cache_stamp_t *stamp, cache_node_t **out_ref, char **out_head,
+              size_t *out_head_len, char **out_buf, size_t *out_len)
+{
+    if (!cache) return -1; // If cache isn't initialized, I can't help.
+
+    unsigned long h = hash_str(path);
+    cache_shard_t *s = shard_for(h); // Figure out which shard, and which bucket in it, to check.
+    if (cache->admission == CACHE_ADMISSION_TINYLFU) sketch_record(s, h); // Hit or miss, it was asked for.
+    cache_node_t *n = lookup(s, bucket_for(h), path, strlen(path));
+
+    // An entry never changes once it's in, so with my pin I can read it at leisure.
+    if (n && stamp && memcmp(&n->stamp, stamp, sizeof(*stamp)) != 0) {
+        // The file changed since I read it. The caller reads it again and its
+        // cache_put() replaces the old entry.
+        cache_release(n);
+        n = NULL;
     }
-    
     if (!n) {
-        // Cache miss - the file isn't in my cache.
-        pthread_rwlock_unlock(&cache_lock);
-        return -1;
-    }
-    
-    // Cache hit! But now I have a problem...
-    // I found the item with a read lock, but I need to promote it to MRU,
-    // which requires modifying the list. So I need to upgrade to a write lock.
-    
-    pthread_rwlock_unlock(&cache_lock); // Release the read lock first.
-    
-    // Now I acquire a write lock.
-    if (pthread_rwlock_wrlock(&cache_lock) != 0) return -1;
-    
-    // IMPORTANT: Between releasing the read lock and getting the write lock,
-    // another thread might have modified the cache. So I need to search again.
-    cache_node_t *n2 = htable[h];
-    while (n2) {
-        if (strcmp(n2->path, path) == 0) break;
-        n2 = n2->hnext;
-    }
-    
-    if (!n2) {
-        // The item disappeared while I was switching locks!
-        pthread_rwlock_unlock(&cache_lock);
-        return -1;
+        __atomic_add_fetch(&s->misses, 1, __ATOMIC_RELAXED);
+        return -1; // Cache miss - the file isn't in my cache.
     }
-    
-    // Now I can safely promote this node to Most Recently Used.
-    remove_from_list(n2);    // Take it out of its current position.
-    insert_at_head(n2);      // Put it at the front of the list.
-    
-    // I need to return a copy of the data, not the original pointer.
-    // This way the caller can use it without worrying about thread safety.
-    char *buf = malloc(n2->len);
-    if (!buf) {
-        pthread_rwlock_unlock(&cache_lock);
-        return -1;
+    __atomic_add_fetch(&s->hits, 1, __ATOMIC_RELAXED);
+
+    // A hit is recorded by setting one bit; I skip the write if it's already set,
+    // so a popular file's cache line isn't bounced between cores on every request.
+    if (!__atomic_load_n(&n->referenced, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&n->referenced, 1, __ATOMIC_RELAXED);
     }
-    memcpy(buf, n2->data, n2->len);
-    
-    // Give the caller what they asked for.
-    *out_buf = buf;
-    *out_len = n2->len;
-    
-    pthread_rwlock_unlock(&cache_lock);
+
+    // I hand out the cached bytes themselves, not a copy: the pin keeps the block
+    // from being reused until the caller is done sending it.
+    *out_ref = n;
+    *out_head = node_data(n);
+    *out_head_len = n->head_len;
+    *out_buf = node_data(n) + n->head_len;
+    *out_len = n->len;
     return 0; // Success!
 }
 
+// A response sent from a cached entry is out, so I let go of the entry.
+void cache_release(cache_node_t *ref)
+{
+    if (!ref) return;
+
+    // The entry was dropped while I was sending it, and I was its last reader.
+    // Nobody can find it anymore, so only I can get here for it.
+    cache_shard_t *s = &cache->shards[ref->shard];
+    if (unpin(node_refs(s, ref))) {
+        pthread_mutex_lock(&s->lock);
+        block_free(s, ref, ref->order);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
 // This function adds or updates items in the cache.
-int cache_put(const char *path, const char *buf, size_t len)
+int cache_put(const char *path, const cache_stamp_t *stamp, const char *head, size_t head_len,
+              const char *buf, size_t len)
 {
-    if (!htable) return -1; // Cache not initialized.
+    if (!cache) return -1; // Cache not initialized.
     if (len == 0 || !buf) return -1; // Invalid parameters.
-    
+
     // I'm setting a hard limit: no single file larger than 1MB can be cached.
     // This prevents one large file from hogging all the cache space.
-    if (len > (1 * 1024 * 1024)) return -1;
-    
-    // I need a write lock immediately because I'm going to modify the cache.
-    if (pthread_rwlock_wrlock(&cache_lock) != 0) return -1;
-    
-    unsigned long h = hash_str(path) % hsize;
-    
+    if (len > MAX_CACHED_FILE_SIZE) return -1;
+    if (!head) head_len = 0;
+
+    // The node, the path and the data all go into one block.
+    size_t key_len = strlen(path);
+    int order = order_for(sizeof(cache_node_t) + key_len + 1 + head_len + len);
+    if (order < 0) return -1;
+
+    unsigned long hash = hash_str(path);
+    cache_shard_t *s = shard_for(hash);
+    unsigned long h = bucket_for(hash);
+
+    // I need the shard's lock because I'm going to modify it.
+    if (pthread_mutex_lock(&s->lock) != 0) return -1;
+
     // First, check if this path is already in the cache.
-    cache_node_t *n = htable[h];
-    while (n) {
-        if (strcmp(n->path, path) == 0) break;
-        n = n->hnext;
-    }
-    
-    if (n) {
-        // The item already exists - I need to update it.
-        current_size -= n->len; // Remove the old size from my total.
-        
-        // Free the old data and allocate space for the new data.
-        free(n->data);
-        n->data = malloc(len);
-        if (!n->data) {
-            pthread_rwlock_unlock(&cache_lock);
-            return -1;
-        }
-        
-        // Copy the new data in.
-        memcpy(n->data, buf, len);
-        n->len = len;
-        current_size += len; // Add the new size to my total.
-        
-        // Since this item was just used, I promote it to MRU.
-        remove_from_list(n);
-        insert_at_head(n);
-        
-        // The cache might now be too big, so I check if I need to evict anything.
-        evict_if_needed();
-        
-        pthread_rwlock_unlock(&cache_lock);
-        return 0; // Update successful.
+    // If it is, I drop the old entry; the new one replaces it.
+    cache_node_t *n = find_node(s, h, path, key_len, 1);
+    if (n) remove_node(s, n);
+
+    // When no block is free, the CLOCK hand evicts entries until their blocks merge into one that fits.
+    // Under TinyLFU every ring entry it picks has to lose to this one first.
+    unsigned freq = sketch_estimate(s, hash);
+    int evicted = 0;
+    cache_node_t *node = block_alloc(s, (unsigned)order);
+    while (!node && (evicted = evict_one(s, freq)) == 0) {
+        node = block_alloc(s, (unsigned)order);
     }
-    
-    // The item doesn't exist yet - I need to create a new cache entry.
-    cache_node_t *node = malloc(sizeof(cache_node_t));
     if (!node) {
-        pthread_rwlock_unlock(&cache_lock);
-        return -1;
+        if (evicted == 1) s->rejected++; // Everything it could replace is asked for more often.
+        pthread_mutex_unlock(&s->lock);
+        return -1; // The entry is bigger than everything I could free.
     }
-    
+
+    // I fill the entry in before it's linked, so no lookup can see it half-written.
     // I need to copy the path and data because the caller might free them later.
-    node->path = strdup(path);
-    node->data = malloc(len);
-    
-    // Check if both allocations succeeded.
-    if (!node->path || !node->data) {
-        free(node->path);
-        free(node->data);
-        free(node);
-        pthread_rwlock_unlock(&cache_lock);
-        return -1;
-    }
-    
-    // Copy the actual data.
-    memcpy(node->data, buf, len);
+    node->shard = (unsigned char)(s - cache->shards);
+    node->referenced = 0;
+    node->in_window = 0;
+    node->key_len = key_len;
+    memcpy(node_key(node), path, key_len + 1);
+
+    // Copy the actual data, behind its header.
+    if (head_len) memcpy(node_data(node), head, head_len);
+    memcpy(node_data(node) + head_len, buf, len);
+    node->head_len = head_len;
     node->len = len;
-    
-    // Set up the node's links.
-    node->prev = node->next = NULL;
-    node->hnext = htable[h]; // Insert at the beginning of the hash chain.
-    htable[h] = node;
-    
-    // Add to the front of the LRU list (it's now the Most Recently Used).
-    insert_at_head(node);
-    current_size += len; // Update my size counter.
-    
-    // Check if adding this item made the cache too big.
-    evict_if_needed();
-    
-    pthread_rwlock_unlock(&cache_lock);
+    if (stamp) node->stamp = *stamp;
+    else memset(&node->stamp, 0, sizeof(node->stamp));
+
+    // Insert at the beginning of the hash chain. A lookup sees the chain either with
+    // the complete new entry or without it, so this one needs no sequence change.
+    node->hnext = s->htable[h];
+    __atomic_store_n(&s->htable[h], node, __ATOMIC_RELEASE);
+
+    // Without an admission filter the hand reaches the new entry last. With one, it
+    // starts out in the window, and the window's oldest entry may have to leave for it.
+    s->entries++;
+    if (cache->admission == CACHE_ADMISSION_TINYLFU) {
+        window_push(s, node);
+        admit_from_window(s);
+    } else {
+        main_insert(s, node);
+    }
+
+    pthread_mutex_unlock(&s->lock);
     return 0; // Successfully added to cache.
-}
\ No newline at end of file
+}
+
+// I add up what every shard has. Each one is read without its lock, so the totals
+// are a moment's snapshot rather than an exact count.
+void cache_get_stats(cache_stats_t *out)
+{
+    memset(out, 0, sizeof(*out));
+    if (!cache) return;
+
+    out->shards = cache->shard_count;
+    for (int i = 0; i < cache->shard_count; i++) {
+        cache_shard_t *s = &cache->shards[i];
+        out->capacity += s->blocks_size;
+        out->used += __atomic_load_n(&s->used, __ATOMIC_RELAXED);
+        out->entries += __atomic_load_n(&s->entries, __ATOMIC_RELAXED);
+        out->hits += __atomic_load_n(&s->hits, __ATOMIC_RELAXED);
+        out->misses += __atomic_load_n(&s->misses, __ATOMIC_RELAXED);
+        out->rejected += __atomic_load_n(&s->rejected, __ATOMIC_RELAXED);
+    }
+}
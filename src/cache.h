@@ -3,34 +3,102 @@
 
 #include <stddef.h> // I need size_t from here.
 
+// I only cache files smaller than this, so one big file can't hog the cache.
+#define MAX_CACHED_FILE_SIZE (1 * 1024 * 1024)
+
+// This is the most shards the cache can be split into.
+#define MAX_CACHE_SHARDS 64
+
+// These are the ways cache_put() can decide whether a new file gets in.
+#define CACHE_ADMISSION_ALL 0     // Every file is admitted, and the CLOCK hand evicts to make room.
+#define CACHE_ADMISSION_TINYLFU 1 // New files wait in a small window; leaving it, a file only pushes
+                                  // an entry out if it's been asked for more often (W-TinyLFU).
+
+// This is what stat() said about a file when I cached it. An entry only counts as a hit
+// while the file still looks the same, so an edited file is never served stale.
+typedef struct {
+    long size;
+    long mtime_sec;
+    long mtime_nsec;
+    unsigned long ino;
+} cache_stamp_t;
+
 // This structure represents a single cache entry.
-// I'm designing it to work in both a doubly-linked list (for LRU ordering)
+// I'm designing it to work in both a ring (for CLOCK eviction)
 // and a hash table chain (for fast lookups).
+// A node sits at the start of the memory block that holds its entry, followed by the
+// path (key_len bytes and a '\0') and then the data, so one block allocation covers
+// the whole entry. Lookups find both from the node's address alone.
 typedef struct cache_node {
-    char *path;                // I store the file path as the lookup key.
-    char *data;                // I keep a pointer to the actual cached data.
-    size_t len;                // I need to know how many bytes are in 'data'.
-    struct cache_node *prev;   // This points to the previous node in my LRU list.
-    struct cache_node *next;   // This points to the next node in my LRU list.
+    unsigned char order;       // The size of my block (256 << order bytes). Free blocks start the same way.
+    unsigned char free;        // Always 0 here: the block is in use.
+    unsigned char referenced;  // The CLOCK bit: every hit sets it, the eviction hand clears it.
+    unsigned char shard;       // The shard whose blocks I live in.
+    unsigned char in_window;   // Set while I'm in the admission window rather than the CLOCK ring.
+    size_t key_len;            // How long the path I'm stored under is.
+    size_t head_len;           // How many bytes at the start of the data are the header.
+    size_t len;                // I need to know how many file bytes follow the header.
+    cache_stamp_t stamp;       // The file these bytes came from, as it was when I read it.
+    struct cache_node *prev;   // This points to the previous node in my CLOCK ring (or window).
+    struct cache_node *next;   // This points to the next node in my CLOCK ring (or window).
     struct cache_node *hnext;  // This is for the hash table - it points to the next node in the same bucket.
 } cache_node_t;
 
-// I need to initialize the cache system before using it.
-// This function sets up everything: the hash table, the lock, and the size limit.
-int cache_init(size_t max_size_bytes);
+// This is what cache_get_stats() adds up over all shards.
+typedef struct {
+    int shards;                // How many shards the cache is split into.
+    size_t capacity;           // How many bytes of blocks there are in total...
+    size_t used;               // ...and how many of them entries are using.
+    long entries;              // How many files are cached.
+    long hits;                 // How many lookups found their file...
+    long misses;               // ...and how many didn't.
+    long rejected;             // How many files the admission filter turned away.
+} cache_stats_t;
 
+// I need to initialize the cache system before using it.
+// This function maps one region of max_size_bytes (rounded up to whole 2MB blocks) and
+// splits it into shards, each with its own hash table, lock, CLOCK ring and share of the
+// blocks. A key always goes to the same shard, so lookups and writes for different files
+// rarely meet. I use fewer shards than asked if there aren't 2MB for each of them.
+// With shared set, the region and its locks are shared between processes: the master
+// calls this before it forks, and every worker inherits the same cache at the same address.
+// admission is one of the CACHE_ADMISSION_* policies.
+int cache_init(size_t max_size_bytes, int shared, int shards, int admission);
 // When the program is shutting down, I need to clean up all cache resources.
-// This function frees all memory and destroys the synchronization primitives.
+// This function unmaps the region and destroys the lock. A shared cache is destroyed
+// by the master once every worker has exited.
 void cache_destroy();
 
+// I report where the cache's region is mapped and how long it is (NULL and 0 without a
+// cache), so the master can give a shared cache its NUMA policy.
+void cache_region(void **addr, size_t *len);
+
 // This is how clients retrieve data from the cache.
-// If the data is found (a "hit"), I return 0 and provide the data.
-// If it's not found (a "miss"), I return -1.
-int cache_get(const char *path, char **out_buf, size_t *out_len);
+// If the data is found (a "hit"), I return 0 and point the caller straight at the cached
+// bytes: the stored header (out_head, out_head_len) directly followed by the file
+// (out_buf, out_len). Nothing is copied. The entry is pinned until the caller hands
+// *out_ref back to cache_release(), and the bytes must not be written to.
+// If it's not found (a "miss"), or stamp is given and the entry was read from a different
+// version of the file, I return -1.
+int cache_get(const char *path, const cache_stamp_t *stamp, cache_node_t **out_ref, char **out_head,
+              size_t *out_head_len, char **out_buf, size_t *out_len);
+
+// I drop a reference cache_get() gave out. Once an entry has no readers left, eviction
+// may reuse its memory; if it was evicted or replaced in the meantime, I free it now.
+void cache_release(cache_node_t *ref);
 
 // This is how clients store data in the cache.
-// I'll either create a new entry or update an existing one.
-// I also handle LRU eviction if the cache gets too full.
-int cache_put(const char *path, const char *buf, size_t len);
+// head is a response header serialized once for this file (it may be empty); I keep it
+// in front of the file's bytes so a hit doesn't have to build one. stamp (or NULL)
+// describes the file the bytes came from.
+// I'll either create a new entry or replace an existing one.
+// When no free block is big enough, I evict with the CLOCK hand until one is.
+// Under CACHE_ADMISSION_TINYLFU the entry starts out in the admission window, and
+// it (or whatever it pushes out of the window) may be dropped again right away.
+int cache_put(const char *path, const cache_stamp_t *stamp, const char *head, size_t head_len,
+              const char *buf, size_t len);
+
+// I fill out with the totals of every shard (all zeros when there's no cache).
+void cache_get_stats(cache_stats_t *out);
 
 #endif 
\ No newline at end of file
@@ -0,0 +1,30 @@
+#include <zlib.h>
+
+#include "compress.h"
+
+int gzip_compress(arena_t *arena, const char *in, size_t len, char **out, size_t *out_len)
+{
+    z_stream zs = {0};
+    // 15 window bits plus 16 asks zlib for a gzip header and trailer instead of the zlib ones.
+    if (deflateInit2(&zs, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+
+    // deflateBound() is the worst case, so one deflate() call always finishes.
+    size_t cap = deflateBound(&zs, (uLong)len);
+    char *buf = arena_alloc(arena, cap);
+    if (!buf) {
+        deflateEnd(&zs);
+        return -1;
+    }
+    zs.next_in = (Bytef *)in;
+    zs.avail_in = (uInt)len;
+    zs.next_out = (Bytef *)buf;
+    zs.avail_out = (uInt)cap;
+    int rc = deflate(&zs, Z_FINISH);
+    size_t produced = cap - zs.avail_out;
+    deflateEnd(&zs);
+
+    if (rc != Z_STREAM_END || produced >= len) return -1;
+    *out = buf;
+    *out_len = produced;
+    return 0;
+}
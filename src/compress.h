@@ -0,0 +1,15 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H // I'm using include guards to prevent multiple inclusion.
+
+#include <stddef.h> // I need size_t.
+#include "arena.h"  // The compressed bytes are allocated from the request's arena.
+
+// Files smaller than this aren't worth compressing on the fly: the gzip framing
+// alone is about 20 bytes, and they fit in one packet either way.
+#define GZIP_MIN_SIZE 256
+
+// I gzip len bytes of in into a buffer from 'arena' (level 6, the usual speed/size trade-off).
+// I return 0 and set *out/*out_len, or -1 if zlib failed or the result isn't smaller.
+int gzip_compress(arena_t *arena, const char *in, size_t len, char **out, size_t *out_len);
+
+#endif
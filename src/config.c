@@ -1,8 +1,61 @@
 #include "config.h"
+#include "cache.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
+// I understand "round_robin", "least_loaded" and "p2c" (power of two choices).
+// Anything else falls back to round robin, which is what the server always did.
+int parse_dispatch_policy(const char *value)
+{
+    if (strcmp(value, "least_loaded") == 0)
+        return DISPATCH_LEAST_LOADED;
+    if (strcmp(value, "p2c") == 0)
+        return DISPATCH_TWO_CHOICES;
+    return DISPATCH_ROUND_ROBIN;
+}
+
+// I translate an IO_MODEL name into one of the IO_MODEL_* constants.
+// Anything I don't recognise means the classic thread-per-connection model.
+int parse_io_model(const char *value)
+{
+    if (strcmp(value, "epoll") == 0)
+        return IO_MODEL_EPOLL;
+    if (strcmp(value, "io_uring") == 0)
+        return IO_MODEL_URING;
+    return IO_MODEL_THREADS;
+}
+
+// I translate a QUEUE_TYPE name into one of the QUEUE_* constants.
+int parse_queue_type(const char *value)
+{
+    if (strcmp(value, "stealing") == 0)
+        return QUEUE_STEALING;
+    if (strcmp(value, "mpmc") == 0)
+        return QUEUE_MPMC;
+    return QUEUE_MUTEX;
+}
+
+// I translate a COMPRESSION name into one of the COMPRESSION_* constants.
+// Anything I don't recognise means sidecars only, which never costs CPU.
+int parse_compression(const char *value)
+{
+    if (strcmp(value, "off") == 0)
+        return COMPRESSION_OFF;
+    if (strcmp(value, "dynamic") == 0)
+        return COMPRESSION_DYNAMIC;
+    return COMPRESSION_STATIC;
+}
+
+// I translate a CACHE_ADMISSION name into one of the CACHE_ADMISSION_* constants.
+// Anything I don't recognise means the scan-resistant filter.
+int parse_cache_admission(const char *value)
+{
+    if (strcmp(value, "all") == 0)
+        return CACHE_ADMISSION_ALL;
+    return CACHE_ADMISSION_TINYLFU;
+}
+
 // I'm loading server configuration from a file.
 // This function reads a simple key=value format and fills in the config structure.
 // I need to handle comments (lines starting with #) and ignore empty lines.
@@ -48,10 +101,42 @@ int load_config(const char *filename, server_config_t *config)
                 strncpy(config->log_file, value, sizeof(config->log_file));
             else if (strcmp(key, "CACHE_SIZE_MB") == 0)
                 config->cache_size_mb = atoi(value);
+            else if (strcmp(key, "CACHE_SHARED") == 0)
+                config->cache_shared = atoi(value);
+            else if (strcmp(key, "CACHE_SHARDS") == 0)
+                config->cache_shards = atoi(value);
+            else if (strcmp(key, "CACHE_ADMISSION") == 0)
+                // I accept "tinylfu" (the default) or "all".
+                config->cache_admission = parse_cache_admission(value);
             else if (strcmp(key, "TIMEOUT_SECONDS") == 0)
                 config->timeout_seconds = atoi(value);
             else if (strcmp(key, "KEEP_ALIVE_TIMEOUT") == 0)
                 config->keep_alive_timeout = atoi(value);
+            else if (strcmp(key, "LISTENER_MODE") == 0)
+                // I accept "master" (the default) or "reuseport".
+                config->listener_mode = (strcmp(value, "reuseport") == 0) ? LISTENER_REUSEPORT : LISTENER_MASTER;
+            else if (strcmp(key, "IO_MODEL") == 0)
+                // I accept "threads" (the default) or "epoll".
+                config->io_model = parse_io_model(value);
+            else if (strcmp(key, "ACCEPT_BATCH") == 0)
+                config->accept_batch = atoi(value);
+            else if (strcmp(key, "DISPATCH_POLICY") == 0)
+                config->dispatch_policy = parse_dispatch_policy(value);
+            else if (strcmp(key, "QUEUE_TYPE") == 0)
+                config->queue_type = parse_queue_type(value);
+            else if (strcmp(key, "MIN_THREADS") == 0)
+                config->min_threads = atoi(value);
+            else if (strcmp(key, "MAX_THREADS") == 0)
+                config->max_threads = atoi(value);
+            else if (strcmp(key, "THREAD_IDLE_TIMEOUT") == 0)
+                config->thread_idle_timeout = atoi(value);
+            else if (strcmp(key, "WORKER_CPUS") == 0)
+                strncpy(config->worker_cpus, value, sizeof(config->worker_cpus));
+            else if (strcmp(key, "ACCEPT_CPUS") == 0)
+                strncpy(config->accept_cpus, value, sizeof(config->accept_cpus));
+            else if (strcmp(key, "COMPRESSION") == 0)
+                // I accept "off", "static" (the default) or "dynamic".
+                config->compression = parse_compression(value);
             // If the key doesn't match any known setting, I just ignore it.
         }
     }
@@ -77,11 +162,31 @@ void parse_env_vars(server_config_t *config) {
     }
     if ((val = getenv("HTTP_QUEUE"))) config->max_queue_size = atoi(val);
     if ((val = getenv("HTTP_CACHE"))) config->cache_size_mb = atoi(val);
+    if ((val = getenv("HTTP_CACHE_SHARED"))) config->cache_shared = atoi(val);
+    if ((val = getenv("HTTP_CACHE_SHARDS"))) config->cache_shards = atoi(val);
+    if ((val = getenv("HTTP_CACHE_ADMISSION"))) config->cache_admission = parse_cache_admission(val);
     if ((val = getenv("HTTP_LOG"))) {
         strncpy(config->log_file, val, sizeof(config->log_file) - 1);
         config->log_file[sizeof(config->log_file) - 1] = '\0';
     }
     if ((val = getenv("HTTP_TIMEOUT"))) config->timeout_seconds = atoi(val);
+    if ((val = getenv("HTTP_LISTENER")))
+        config->listener_mode = (strcmp(val, "reuseport") == 0) ? LISTENER_REUSEPORT : LISTENER_MASTER;
+    if ((val = getenv("HTTP_IO_MODEL")))
+        config->io_model = parse_io_model(val);
+    if ((val = getenv("HTTP_DISPATCH"))) config->dispatch_policy = parse_dispatch_policy(val);
+    if ((val = getenv("HTTP_QUEUE_TYPE"))) config->queue_type = parse_queue_type(val);
+    if ((val = getenv("HTTP_MIN_THREADS"))) config->min_threads = atoi(val);
+    if ((val = getenv("HTTP_MAX_THREADS"))) config->max_threads = atoi(val);
+    if ((val = getenv("HTTP_WORKER_CPUS"))) {
+        strncpy(config->worker_cpus, val, sizeof(config->worker_cpus) - 1);
+        config->worker_cpus[sizeof(config->worker_cpus) - 1] = '\0';
+    }
+    if ((val = getenv("HTTP_ACCEPT_CPUS"))) {
+        strncpy(config->accept_cpus, val, sizeof(config->accept_cpus) - 1);
+        config->accept_cpus[sizeof(config->accept_cpus) - 1] = '\0';
+    }
+    if ((val = getenv("HTTP_COMPRESSION"))) config->compression = parse_compression(val);
     // I don't check every possible env var - just the most important ones.
     // Users can still use the config file for other settings.
 }
\ No newline at end of file
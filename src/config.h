@@ -2,6 +2,31 @@
 #define CONFIG_H // I'm using include guards to prevent this header from being included multiple times.
 
 #define MAX_PATH_LEN 256 // I'm defining a maximum path length that I'll use throughout my server.
+#define MAX_ACCEPT_BATCH 64 // This is the most connections I accept in one burst (and pass in one SCM_RIGHTS message).
+
+// These are the ways I can get connections into my workers.
+#define LISTENER_MASTER 0    // The master accepts and hands each fd to a worker over SCM_RIGHTS.
+#define LISTENER_REUSEPORT 1 // Every worker binds its own SO_REUSEPORT socket and accepts directly.
+
+// These are the ways a worker can serve its connections.
+#define IO_MODEL_THREADS 0 // Every connection blocks one pool thread for its whole keep-alive lifetime.
+#define IO_MODEL_EPOLL 1   // One epoll loop per worker; the pool only does blocking disk reads.
+#define IO_MODEL_URING 2   // One io_uring loop per worker; sockets and file reads all go through the ring.
+
+// These are the ways the master can choose a worker for a new connection.
+#define DISPATCH_ROUND_ROBIN 0 // I hand connections out in turn, ignoring load.
+#define DISPATCH_LEAST_LOADED 1 // I pick the worker with the smallest published load.
+#define DISPATCH_TWO_CHOICES 2  // I sample two random workers and pick the less loaded one.
+
+// These are the ways a worker's main thread can hand connections to its pool threads.
+#define QUEUE_MUTEX 0    // One shared ring behind a mutex and a condition variable.
+#define QUEUE_STEALING 1 // One lock-free ring per thread; idle threads steal from their siblings.
+#define QUEUE_MPMC 2     // One lock-free multi-producer/multi-consumer ring; threads sleep on a futex.
+
+// These are the ways I can send compressed versions of text files.
+#define COMPRESSION_OFF 0     // Every file goes out as it is on disk.
+#define COMPRESSION_STATIC 1  // I send a file's .br or .gz sidecar to clients that accept it.
+#define COMPRESSION_DYNAMIC 2 // Like STATIC, and without a sidecar I gzip cacheable files myself.
 
 // This structure holds all my server configuration settings.
 // I need to keep all these settings together so I can pass them around easily.
@@ -13,9 +38,23 @@ typedef struct
     int max_queue_size;         // I'm limiting how many pending connections I'll queue up.
     char document_root[MAX_PATH_LEN]; // This is where I'll look for files to serve.
     char log_file[MAX_PATH_LEN];      // I need to know where to write my log messages.
-    int cache_size_mb;          // I'm controlling how much memory the cache can use (in MB).
+    int cache_size_mb;          // I'm controlling how much memory the cache can use (in MB, per worker).
+    int cache_shared;           // I keep one cache for all workers in shared memory (1) or one per worker (0).
+    int cache_shards;           // I split the cache into this many independently locked shards.
+    int cache_admission;        // I pick which files the cache lets in (CACHE_ADMISSION_*).
     int timeout_seconds;        // I'm setting a timeout for idle connections.
     int keep_alive_timeout;     // This controls how long I keep HTTP keep-alive connections open.
+    int listener_mode;          // I pick who accepts connections: the master or each worker (LISTENER_*).
+    int dispatch_policy;        // I pick how the master chooses a worker for each connection (DISPATCH_*).
+    int accept_batch;           // I accept up to this many connections per burst before handing them out.
+    int io_model;               // I pick how workers serve connections (IO_MODEL_*).
+    int queue_type;             // I pick how a worker feeds its thread pool (QUEUE_*).
+    int min_threads;            // The smallest my elastic pool shrinks to (0 = THREADS_PER_WORKER).
+    int max_threads;            // The largest my elastic pool grows to (0 = THREADS_PER_WORKER).
+    int thread_idle_timeout;    // A spare pool thread retires after this many idle seconds.
+    char worker_cpus[MAX_PATH_LEN]; // The CPU list my workers are spread over ("" = no pinning).
+    char accept_cpus[MAX_PATH_LEN]; // The CPU list the master's accept loop runs on ("" = no pinning).
+    int compression;            // I pick which compressed versions of text files I send (COMPRESSION_*).
 } server_config_t;
 
 // Function prototypes - I'm declaring these here so other files know they exist.
@@ -28,6 +67,17 @@ int load_config(const char *filename, server_config_t *config);
 // This lets users override file settings with environment variables.
 void parse_env_vars(server_config_t *config);
 
+// I turn a dispatch policy name from the config into one of the DISPATCH_* values.
+int parse_dispatch_policy(const char *value);
+// I turn an IO_MODEL name into one of the IO_MODEL_* values.
+int parse_io_model(const char *value);
+// I turn a QUEUE_TYPE name into one of the QUEUE_* values.
+int parse_queue_type(const char *value);
+// I turn a COMPRESSION name into one of the COMPRESSION_* values.
+int parse_compression(const char *value);
+// I turn a CACHE_ADMISSION name into one of the CACHE_ADMISSION_* values (from cache.h).
+int parse_cache_admission(const char *value);
+
 // Finally, I want to support command-line arguments.
 // This gives users the most direct way to override settings.
 void parse_arguments(int argc, char *argv[], server_config_t *config);
@@ -0,0 +1,489 @@
+#define _GNU_SOURCE // I need this for accept4() and memmem().
+
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/sockios.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "event_loop.h"
+#include "thread_pool.h"
+#include "worker.h"
+#include "buffer_pool.h"
+
+// I need to access the global server configuration.
+extern server_config_t config;
+
+#define EVENT_BUFFER_SIZE 8192 // This is the most request header data I buffer per connection.
+#define MAX_EVENTS 256         // I handle up to this many ready sockets per epoll_wait().
+
+// These are the states a connection moves through.
+// READING -> (DISK) -> WRITING -> READING again for the next keep-alive request.
+enum { CONN_READING, CONN_DISK, CONN_WRITING };
+
+struct event_conn;
+
+// A list of connections ordered by last activity, oldest first, so expiring the quiet
+// ones only ever looks at the front.
+typedef struct {
+    struct event_conn *head;        // The connection that has been quiet the longest.
+    struct event_conn *tail;        // The one I heard from (or sent to) most recently.
+} conn_list_t;
+
+// This structure holds everything I know about one client connection.
+typedef struct event_conn {
+    int fd;                         // The client socket (non-blocking).
+    int state;                      // One of the CONN_* states above.
+    uint32_t events;                // What I'm currently registered for in epoll (0 = not registered).
+    int close_after;                // I close the connection once this response is out.
+    char client_ip[INET_ADDRSTRLEN];// I need this for the access log.
+    char *in;                       // Bytes received but not parsed yet (from the pool only while there are any).
+    size_t in_len;                  // How many bytes are in 'in'.
+    http_parser_t parser;           // How far I got parsing the request at the front of 'in'.
+    arena_t arena;                  // Where the current response is built (reset once it's out).
+    request_ctx_t ctx;              // The request I'm currently answering.
+    char header[2048];              // The response header for that request.
+    struct iovec out[2];            // What's left to write: header, then body.
+    time_t last_active;             // When I last heard from the client, or got bytes out to it.
+    int unsent;                     // While WRITING: how many bytes sat in the socket's send queue last I looked.
+    conn_list_t *list;              // The list I'm in: idle while READING, writing while WRITING (NULL in DISK).
+    struct event_conn *idle_prev;   // My neighbours in that list.
+    struct event_conn *idle_next;
+    struct event_conn *done_next;   // My link in the list of finished disk jobs.
+} event_conn_t;
+
+// * Loop State
+// There's exactly one loop per worker process, so I keep it in one static structure.
+static struct {
+    int epfd;                       // My epoll instance.
+    int wake_fd;                    // An eventfd the pool pokes when a disk job is done.
+    event_conn_t **conns;           // I find connections by fd here.
+    int max_conns;                  // How many slots 'conns' has (the fd limit).
+    local_queue_t *disk_queue;      // Where blocking file reads go.
+    int pool_threads;               // How many threads are serving disk_queue.
+    conn_list_t idle;               // READING connections (keep-alive clients between requests).
+    conn_list_t writing;            // WRITING connections, waiting for the client to take more bytes.
+    pthread_mutex_t done_lock;      // I protect the finished disk job list.
+    event_conn_t *done_head;        // Connections whose disk work is done.
+} loop = {.epfd = -1, .wake_fd = -1, .done_lock = PTHREAD_MUTEX_INITIALIZER};
+
+// I keep reading connections in one list and writing connections in another, each ordered
+// by last activity, so expiring the clients that went quiet only ever looks at the fronts.
+static void list_remove(event_conn_t *c)
+{
+    conn_list_t *list = c->list;
+    if (!list) return;
+    if (c->idle_prev) c->idle_prev->idle_next = c->idle_next;
+    else list->head = c->idle_next;
+    if (c->idle_next) c->idle_next->idle_prev = c->idle_prev;
+    else list->tail = c->idle_prev;
+    c->idle_prev = c->idle_next = NULL;
+    c->list = NULL;
+}
+
+// I (re)start a connection's clock and put it at the back of a list.
+static void list_append(conn_list_t *list, event_conn_t *c)
+{
+    list_remove(c);
+    c->last_active = time(NULL);
+    c->list = list;
+    c->idle_prev = list->tail;
+    c->idle_next = NULL;
+    if (list->tail) list->tail->idle_next = c;
+    else list->head = c;
+    list->tail = c;
+}
+
+// This is how many bytes of the current response are still to go (including the
+// boundary lines and slice of a multipart part being streamed).
+static size_t pending_bytes(const event_conn_t *c)
+{
+    return c->out[0].iov_len + c->out[1].iov_len + c->ctx.part_head.iov_len +
+           (c->ctx.file_fd >= 0 && c->ctx.body_len > 0 ? (size_t)c->ctx.body_len : 0);
+}
+
+// I change what epoll tells me about this connection.
+static void set_interest(event_conn_t *c, uint32_t events)
+{
+    if (c->events == events) return;
+
+    struct epoll_event ev = {.events = events, .data.fd = c->fd};
+    if (events == 0) epoll_ctl(loop.epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    else if (c->events == 0) epoll_ctl(loop.epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    else epoll_ctl(loop.epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->events = events;
+}
+
+// The connection is done (the client left, timed out, or broke the protocol).
+static void conn_close(event_conn_t *c)
+{
+    list_remove(c);
+    set_interest(c, 0);
+    close(c->fd);
+    track_connection(-1);
+
+    loop.conns[c->fd] = NULL;
+    request_release(&c->ctx);
+    arena_reset(&c->arena);
+    buffer_pool_put(c->in);
+    free(c);
+}
+
+// A new client arrived. I make its socket non-blocking and start waiting for its request.
+static void conn_open(int fd)
+{
+    if (fd >= loop.max_conns) {
+        long bytes_sent = 0;
+        send_error_page(fd, 503, "Service Unavailable", &bytes_sent);
+        close(fd);
+        return;
+    }
+
+    event_conn_t *c = calloc(1, sizeof(event_conn_t));
+    if (!c) {
+        close(fd);
+        return;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    prepare_client_socket(fd);
+    c->fd = fd;
+    c->state = CONN_READING;
+    http_parser_init(&c->parser);
+    arena_init(&c->arena);
+    request_begin(&c->ctx, &c->arena); // An empty request, so closing early releases nothing stale.
+    get_client_ip(fd, c->client_ip, sizeof(c->client_ip));
+    loop.conns[fd] = c;
+    track_connection(1);
+
+    set_interest(c, EPOLLIN);
+    list_append(&loop.idle, c);
+}
+
+// I write as much of the pending response as the socket takes.
+// I return 0 when it's all out, 1 if I have to wait for EPOLLOUT, and -1 if I closed the connection.
+// While I wait, the connection sits in the writing list; it moves to the back whenever
+// the client takes some bytes, so only a client that stopped reading times out.
+static int conn_write(event_conn_t *c)
+{
+    size_t before = pending_bytes(c);
+    int part = c->ctx.part;
+
+    // When a file follows, MSG_MORE lets the header share a segment with its first bytes.
+    int flags = MSG_NOSIGNAL | ((c->ctx.file_fd >= 0 && c->ctx.body_len > 0) ? MSG_MORE : 0);
+    while (c->out[0].iov_len + c->out[1].iov_len > 0) {
+        struct msghdr msg = {0};
+        msg.msg_iov = c->out;
+        msg.msg_iovlen = 2;
+        ssize_t n = sendmsg(c->fd, &msg, flags);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                goto wait_writable;
+            }
+            conn_close(c);
+            return -1;
+        }
+
+        // I advance through the header first, then the body.
+        for (int i = 0; i < 2 && n > 0; i++) {
+            size_t step = ((size_t)n < c->out[i].iov_len) ? (size_t)n : c->out[i].iov_len;
+            c->out[i].iov_base = (char *)c->out[i].iov_base + step;
+            c->out[i].iov_len -= step;
+            n -= step;
+        }
+    }
+
+    // A body that's streamed from its file follows the header.
+    if (c->ctx.file_fd >= 0) {
+        int rc = request_send_file(&c->ctx, c->fd);
+        if (rc > 0) goto wait_writable;
+        if (rc < 0) {
+            conn_close(c);
+            return -1;
+        }
+    }
+
+    // The response is out. I log it and get ready for the next request.
+    request_finish(&c->ctx, c->client_ip);
+    arena_reset(&c->arena);
+    if (c->close_after) {
+        conn_close(c);
+        return -1;
+    }
+    c->state = CONN_READING;
+    set_interest(c, EPOLLIN);
+    list_append(&loop.idle, c);
+    return 0;
+
+wait_writable:
+    if (c->list != &loop.writing || pending_bytes(c) != before || c->ctx.part != part) {
+        list_append(&loop.writing, c);
+        if (ioctl(c->fd, SIOCOUTQ, &c->unsent) < 0) c->unsent = 0;
+    }
+    set_interest(c, EPOLLOUT);
+    return 1;
+}
+
+// The response for the current request is complete, so I start sending it.
+static int conn_respond(event_conn_t *c)
+{
+    c->out[0].iov_base = (void *)request_header(&c->ctx, c->header, sizeof(c->header), &c->out[0].iov_len);
+    // A streamed body isn't in memory; conn_write() sends it from the file after the header.
+    // The boundary lines of its first part (for a multipart body) ride along with the header.
+    int in_memory = (c->ctx.file_fd < 0 && c->ctx.content);
+    if (in_memory) {
+        c->out[1].iov_base = c->ctx.content + c->ctx.body_offset;
+        c->out[1].iov_len = c->ctx.body_len;
+    } else {
+        c->out[1] = c->ctx.part_head;
+        c->ctx.part_head.iov_len = 0;
+    }
+    c->state = CONN_WRITING;
+    return conn_write(c);
+}
+
+// I look for complete requests in what the client sent and answer them in order.
+static void conn_process(event_conn_t *c)
+{
+    while (c->state == CONN_READING && c->in_len > 0) {
+        int taken = request_take(&c->ctx, &c->arena, &c->parser, c->in, &c->in_len, EVENT_BUFFER_SIZE);
+        if (taken == 0) return; // Still waiting for the rest of the headers.
+        // I hang up after a bad request, or when the client asked me to.
+        if (taken < 0 || !c->ctx.keep_alive) c->close_after = 1;
+        list_remove(c);
+
+        if (c->ctx.needs_disk) {
+            // The file isn't in memory. I let a pool thread do the blocking read
+            // and stop watching the socket until it's done.
+            if (loop.pool_threads > 0) {
+                c->state = CONN_DISK;
+                set_interest(c, 0);
+                if (local_queue_enqueue(loop.disk_queue, c->fd) == 0) return;
+                c->state = CONN_READING;
+            }
+            // Nobody can take it, so I read it myself.
+            request_load(&c->ctx);
+        }
+
+        if (conn_respond(c) < 0) return; // The connection is gone.
+    }
+
+    // Between requests a keep-alive connection holds nothing but its socket and this
+    // structure: the input buffer goes back to the pool, and conn_read() takes one again.
+    if (c->state == CONN_READING && c->in_len == 0 && c->in) {
+        buffer_pool_put(c->in);
+        c->in = NULL;
+    }
+}
+
+// The client socket is readable: I pull in everything that's there.
+static void conn_read(event_conn_t *c)
+{
+    if (!c->in) {
+        c->in = buffer_pool_get(EVENT_BUFFER_SIZE, NULL);
+        if (!c->in) {
+            conn_close(c);
+            return;
+        }
+    }
+
+    while (c->in_len < EVENT_BUFFER_SIZE - 1) {
+        ssize_t n = recv(c->fd, c->in + c->in_len, EVENT_BUFFER_SIZE - 1 - c->in_len, 0);
+        if (n > 0) {
+            c->in_len += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        // Connection closed or error.
+        conn_close(c);
+        return;
+    }
+
+    // I heard from the client, so it moves to the back of the idle line.
+    list_append(&loop.idle, c);
+    conn_process(c);
+}
+
+// Pool threads run this. The connection is parked in CONN_DISK, so the loop won't touch it.
+void event_loop_disk_job(int client_fd)
+{
+    event_conn_t *c = loop.conns[client_fd];
+    request_load(&c->ctx);
+
+    pthread_mutex_lock(&loop.done_lock);
+    c->done_next = loop.done_head;
+    loop.done_head = c;
+    pthread_mutex_unlock(&loop.done_lock);
+
+    // I wake the loop up so it can send the response.
+    uint64_t one = 1;
+    ssize_t w = write(loop.wake_fd, &one, sizeof(one));
+    (void)w; // If the counter is already non-zero the loop is awake anyway.
+}
+
+// The pool finished some disk jobs: I send their responses.
+static void drain_disk_completions()
+{
+    uint64_t value;
+    ssize_t r = read(loop.wake_fd, &value, sizeof(value));
+    (void)r;
+
+    pthread_mutex_lock(&loop.done_lock);
+    event_conn_t *c = loop.done_head;
+    loop.done_head = NULL;
+    pthread_mutex_unlock(&loop.done_lock);
+
+    while (c) {
+        event_conn_t *next = c->done_next;
+        c->state = CONN_WRITING;
+        // If the response went out right away, there may be another request waiting.
+        if (conn_respond(c) == 0) conn_process(c);
+        c = next;
+    }
+}
+
+// I close keep-alive connections that have been quiet for too long, and connections
+// whose client hasn't taken a byte of its response for TIMEOUT_SECONDS.
+static void expire_idle(time_t now)
+{
+    int timeout = config.keep_alive_timeout > 0 ? config.keep_alive_timeout : 5;
+    while (loop.idle.head && now - loop.idle.head->last_active >= timeout) {
+        conn_close(loop.idle.head);
+    }
+
+    // The kernel's send buffer can hold a lot, so a client that reads slowly may not let
+    // me write for a while. It only counts as stalled if the queue hasn't shrunk either.
+    int write_timeout = config.timeout_seconds > 0 ? config.timeout_seconds : 30;
+    while (loop.writing.head && now - loop.writing.head->last_active >= write_timeout) {
+        event_conn_t *c = loop.writing.head;
+        int unsent;
+        if (ioctl(c->fd, SIOCOUTQ, &unsent) == 0 && unsent < c->unsent) {
+            list_append(&loop.writing, c);
+            c->unsent = unsent;
+        } else {
+            conn_close(c);
+        }
+    }
+}
+
+// New connections are waiting on my listener (reuseport mode).
+static void accept_new(int listen_fd)
+{
+    for (int i = 0; i < MAX_ACCEPT_BATCH; i++) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+                perror("accept");
+            }
+            return;
+        }
+        conn_open(fd);
+    }
+}
+
+void event_loop_run(int ipc_socket, int listen_fd, local_queue_t *disk_queue, int pool_threads)
+{
+    // I size my connection table by the fd limit, so every fd has a slot.
+    struct rlimit rl;
+    loop.max_conns = 65536;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < (1 << 20)) {
+        loop.max_conns = (int)rl.rlim_cur;
+    }
+    loop.conns = calloc(loop.max_conns, sizeof(event_conn_t *));
+    loop.disk_queue = disk_queue;
+    loop.pool_threads = pool_threads;
+    loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+    loop.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!loop.conns || loop.epfd < 0 || loop.wake_fd < 0) {
+        perror("event loop init");
+        return;
+    }
+
+    // I watch the IPC socket (new fds, or the master hanging up), my listener and the wake-up eventfd.
+    struct epoll_event ev = {.events = EPOLLIN};
+    ev.data.fd = ipc_socket;
+    epoll_ctl(loop.epfd, EPOLL_CTL_ADD, ipc_socket, &ev);
+    ev.data.fd = loop.wake_fd;
+    epoll_ctl(loop.epfd, EPOLL_CTL_ADD, loop.wake_fd, &ev);
+    if (listen_fd >= 0) {
+        ev.data.fd = listen_fd;
+        epoll_ctl(loop.epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    int running = 1;
+    while (running) {
+        // I wake up at least once a second to expire idle connections.
+        int n = epoll_wait(loop.epfd, events, MAX_EVENTS, 1000);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+
+            if (fd == ipc_socket) {
+                if (listen_fd >= 0) {
+                    // In reuseport mode the IPC socket only ever tells me to stop.
+                    char c;
+                    if (recv(ipc_socket, &c, 1, MSG_DONTWAIT) <= 0) running = 0;
+                    continue;
+                }
+                int fds[MAX_ACCEPT_BATCH];
+                int count = receive_connections(ipc_socket, fds, MAX_ACCEPT_BATCH);
+                if (count < 0) {
+                    running = 0; // The master hung up - time to shut down.
+                    continue;
+                }
+                for (int k = 0; k < count; k++) conn_open(fds[k]);
+            } else if (fd == listen_fd) {
+                accept_new(listen_fd);
+            } else if (fd == loop.wake_fd) {
+                drain_disk_completions();
+            } else {
+                event_conn_t *c = loop.conns[fd];
+                if (!c) continue; // I closed it earlier in this batch.
+                if (c->state == CONN_WRITING) {
+                    if (conn_write(c) == 0) conn_process(c);
+                } else if (c->state == CONN_READING) {
+                    conn_read(c);
+                }
+            }
+        }
+
+        expire_idle(time(NULL));
+        // Disk jobs may be piling up behind threads stuck on a slow read.
+        if (loop.pool_threads > 0) local_queue_check_growth(loop.disk_queue);
+    }
+}
+
+void event_loop_cleanup()
+{
+    if (loop.conns) {
+        for (int fd = 0; fd < loop.max_conns; fd++) {
+            if (loop.conns[fd]) conn_close(loop.conns[fd]);
+        }
+        free(loop.conns);
+        loop.conns = NULL;
+    }
+    if (loop.wake_fd >= 0) close(loop.wake_fd);
+    if (loop.epfd >= 0) close(loop.epfd);
+    loop.wake_fd = loop.epfd = -1;
+}
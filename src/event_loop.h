@@ -0,0 +1,20 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H // I'm using include guards to prevent multiple inclusion.
+
+#include "thread_pool.h" // I need local_queue_t to hand disk work to the pool.
+
+// This runs the worker's epoll loop until the master hangs up.
+// I watch the IPC socket (or my own listener in reuseport mode) for new connections
+// and serve every client with non-blocking sockets from this one thread.
+// Requests that need a blocking file read go to disk_queue; pool_threads tells me
+// whether anyone is there to take them (if not, I read inline).
+void event_loop_run(int ipc_socket, int listen_fd, local_queue_t *disk_queue, int pool_threads);
+
+// Pool threads run this for every connection the loop hands them.
+// I do the blocking read for its pending request and give it back to the loop.
+void event_loop_disk_job(int client_fd);
+
+// Once the pool threads are gone, I close every remaining connection and free the loop.
+void event_loop_cleanup();
+
+#endif
@@ -1,80 +1,397 @@
+#define _DEFAULT_SOURCE // I need this for strncasecmp().
+
+#include <ctype.h>
+#include <errno.h>
 #include <stdio.h>      
 #include <string.h>     
+#include <strings.h>
 #include <sys/socket.h> 
+#include <sys/uio.h>
 #include <time.h>
 #include "http.h"
+#include "http_scan.h"
 
-// I'm parsing an HTTP request from a client.
-// This function takes the raw request buffer and extracts the important parts.
-int parse_http_request(const char *buffer, http_request_t *req)
-{
-    // First, I need to find where the first line of the request ends.
-    // HTTP uses \r\n (carriage return + line feed) to separate lines.
-    char *line_end = strstr(buffer, "\r\n");
-
-    if (!line_end)
-        return -1; // If there's no \r\n, the request is incomplete or malformed.
-
-    // I'll copy just the first line to a temporary buffer so I can work with it safely.
-    char first_line[1024];
-    size_t len = line_end - buffer; // This calculates how long the first line is.
-    
-    // I need to make sure I don't overflow my buffer.
-    if (len >= sizeof(first_line))
-        len = sizeof(first_line) - 1; // Leave room for the null terminator.
-        
-    strncpy(first_line, buffer, len);
-    first_line[len] = '\0'; // Always null-terminate!
-
-    // Now I need to extract the three parts of the request line:
-    // 1. Method (like GET, POST, HEAD)
-    // 2. Path (like /index.html or /images/photo.jpg)
-    // 3. HTTP Version (like HTTP/1.1)
-    // I use sscanf because it's perfect for this simple format.
-    if (sscanf(first_line, "%s %s %s", req->method, req->path, req->version) != 3)
-    {
-        return -1; // If I couldn't get all three parts, the request is malformed.
+// * Request Parsing
+// These are the states my parser moves through.
+enum { PARSE_REQUEST_LINE, PARSE_HEADERS, PARSE_DONE };
+
+void http_parser_init(http_parser_t *p)
+{
+    memset(p, 0, sizeof(*p));
+    p->state = PARSE_REQUEST_LINE;
+    p->content_length = -1;
+}
+
+static int parse_fail(http_parser_t *p, int status)
+{
+    p->error_status = status;
+    return HTTP_PARSE_ERROR;
+}
+
+// "GET /path HTTP/1.1": three parts separated by single spaces.
+static int parse_request_line(http_parser_t *p, const char *buf, size_t start, size_t end)
+{
+    size_t i = start + http_scan_token(buf + start, end - start);
+    if (i == start || i >= end || buf[i] != ' ') return parse_fail(p, 400);
+    p->method_off = start;
+    p->method_len = i - start;
+
+    size_t target = ++i;
+    i += http_scan_target(buf + i, end - i);
+    if (i == target || i >= end || buf[i] != ' ') return parse_fail(p, 400);
+    p->target_off = target;
+    p->target_len = i - target;
+
+    size_t version = ++i;
+    if (end - version != 8 || memcmp(buf + version, "HTTP/1.", 7) != 0 ||
+        (buf[version + 7] != '0' && buf[version + 7] != '1')) {
+        return parse_fail(p, 400);
     }
+    p->version_off = version;
+    p->version_len = 8;
+    // HTTP/1.1 keeps the connection open by default, HTTP/1.0 doesn't.
+    p->keep_alive = (buf[version + 7] == '1');
+    return HTTP_PARSE_INCOMPLETE;
+}
 
-    return 0; // Success!
+// I compare a slice of the buffer with a lower-case name, ignoring case.
+static int slice_equals(const char *buf, unsigned off, unsigned len, const char *lower)
+{
+    size_t n = strlen(lower);
+    if (len != n) return 0;
+    for (size_t i = 0; i < n; i++) {
+        if (tolower((unsigned char)buf[off + i]) != lower[i]) return 0;
+    }
+    return 1;
 }
 
-// I'm sending an HTTP response back to the client.
-// This function builds a proper HTTP response with headers and body.
-void send_http_response(int fd, int status, const char *status_msg, const char *content_type, const char *body, size_t body_len)
+// Connection is a comma separated list; "close" and "keep-alive" are the tokens I care about.
+static void parse_connection(http_parser_t *p, const char *buf, const http_header_t *h)
 {
-    // 1. First, I need to generate the current date in the format HTTP requires.
-    // HTTP responses must include a Date header in GMT timezone.
-    time_t now = time(NULL);
-    struct tm tm_data;
-    gmtime_r(&now, &tm_data); // I use gmtime_r because it's thread-safe.
+    unsigned i = h->value_off, end = h->value_off + h->value_len;
+    while (i < end) {
+        while (i < end && (buf[i] == ' ' || buf[i] == '\t' || buf[i] == ',')) i++;
+        unsigned tok = i;
+        while (i < end && buf[i] != ',' && buf[i] != ' ' && buf[i] != '\t') i++;
+        if (slice_equals(buf, tok, i - tok, "close")) p->keep_alive = 0;
+        else if (slice_equals(buf, tok, i - tok, "keep-alive")) p->keep_alive = 1;
+    }
+}
 
-    char date_str[128];
+// Transfer-Encoding lists the codings applied to the body, the outermost last. identity
+// changes nothing (older clients still send it), and chunked is flagged for the worker,
+// which can't decode it either but knows what to answer. Any other coding I can't undo,
+// so I refuse it with 501; chunked twice is malformed.
+static int parse_transfer_encoding(http_parser_t *p, const char *buf, const http_header_t *h)
+{
+    unsigned i = h->value_off, end = h->value_off + h->value_len;
+    while (i < end) {
+        while (i < end && (buf[i] == ' ' || buf[i] == '\t' || buf[i] == ',')) i++;
+        unsigned tok = i;
+        while (i < end && buf[i] != ',' && buf[i] != ' ' && buf[i] != '\t' && buf[i] != ';') i++;
+        unsigned tok_len = i - tok;
+        while (i < end && buf[i] != ',') i++; // Parameters don't matter to me.
+        if (tok_len == 0 || slice_equals(buf, tok, tok_len, "identity")) continue;
+        if (!slice_equals(buf, tok, tok_len, "chunked")) return parse_fail(p, 501);
+        if (p->chunked) return parse_fail(p, 400);
+        p->chunked = 1;
+    }
+    return HTTP_PARSE_INCOMPLETE;
+}
+
+// "Name: value". I trim the whitespace around the value and remember both slices.
+static int parse_header_line(http_parser_t *p, const char *buf, size_t start, size_t end)
+{
+    // A line starting with whitespace is obsolete line folding, which I refuse.
+    if (buf[start] == ' ' || buf[start] == '\t') return parse_fail(p, 400);
+
+    size_t i = start + http_scan_token(buf + start, end - start);
+    // No whitespace is allowed between the name and the colon.
+    if (i == start || i >= end || buf[i] != ':') return parse_fail(p, 400);
+    if (p->header_count >= HTTP_MAX_HEADERS) return parse_fail(p, 431);
+
+    http_header_t *h = &p->headers[p->header_count++];
+    h->name_off = start;
+    h->name_len = i - start;
+
+    i++;
+    while (i < end && (buf[i] == ' ' || buf[i] == '\t')) i++;
+    size_t value_end = end;
+    while (value_end > i && (buf[value_end - 1] == ' ' || buf[value_end - 1] == '\t')) value_end--;
+    h->value_off = i;
+    h->value_len = value_end - i;
+
+    // A few headers change how I frame the request, so I deal with them right here.
+    if (slice_equals(buf, h->name_off, h->name_len, "content-length")) {
+        if (h->value_len == 0 || h->value_len > 18) return parse_fail(p, 400);
+        long length = 0;
+        for (unsigned k = 0; k < h->value_len; k++) {
+            char c = buf[h->value_off + k];
+            if (c < '0' || c > '9') return parse_fail(p, 400);
+            length = length * 10 + (c - '0');
+        }
+        // Two different lengths mean I can't tell where the request ends.
+        if (p->content_length >= 0 && p->content_length != length) return parse_fail(p, 400);
+        p->content_length = length;
+    } else if (slice_equals(buf, h->name_off, h->name_len, "transfer-encoding")) {
+        if (parse_transfer_encoding(p, buf, h) == HTTP_PARSE_ERROR) return HTTP_PARSE_ERROR;
+    } else if (slice_equals(buf, h->name_off, h->name_len, "connection")) {
+        parse_connection(p, buf, h);
+    }
+    return HTTP_PARSE_INCOMPLETE;
+}
+
+int http_parse(http_parser_t *p, const char *buf, size_t len)
+{
+    while (p->state != PARSE_DONE) {
+        // I look for the end of the current line, starting where I stopped last time.
+        size_t nl = p->scan + http_scan_line(buf + p->scan, len - p->scan);
+        if (nl >= len) {
+            p->scan = len;
+            if (len >= HTTP_MAX_HEADER_BYTES) {
+                // A request line this long is a URI problem; otherwise the headers are too big.
+                return parse_fail(p, p->state == PARSE_REQUEST_LINE ? 414 : 431);
+            }
+            return HTTP_PARSE_INCOMPLETE;
+        }
+
+        size_t start = p->line_start;
+        size_t next = nl + 1;
+        size_t end = next - 1;
+        if (end > start && buf[end - 1] == '\r') end--; // I accept a bare LF as well as CRLF.
+        p->line_start = p->scan = next;
+        if (next > HTTP_MAX_HEADER_BYTES) {
+            return parse_fail(p, p->state == PARSE_REQUEST_LINE ? 414 : 431);
+        }
+
+        int rc;
+        if (p->state == PARSE_REQUEST_LINE) {
+            // Empty lines before the request line are allowed (and ignored).
+            if (end == start) continue;
+            rc = parse_request_line(p, buf, start, end);
+            p->state = PARSE_HEADERS;
+        } else if (end == start) {
+            // The empty line: the head is complete.
+            p->head_len = next;
+            p->state = PARSE_DONE;
+            rc = HTTP_PARSE_INCOMPLETE;
+        } else {
+            rc = parse_header_line(p, buf, start, end);
+        }
+        if (rc != HTTP_PARSE_INCOMPLETE) return rc;
+    }
+    return HTTP_PARSE_DONE;
+}
+
+const http_header_t *http_find_header(const http_parser_t *p, const char *buf, const char *name)
+{
+    size_t n = strlen(name);
+    for (int i = 0; i < p->header_count; i++) {
+        const http_header_t *h = &p->headers[i];
+        if (h->name_len == n && strncasecmp(buf + h->name_off, name, n) == 0) return h;
+    }
+    return NULL;
+}
+
+int http_request_line(const http_parser_t *p, const char *buf, http_request_t *req)
+{
+    if (p->method_len >= sizeof(req->method) || p->target_len >= sizeof(req->path)) return -1;
+    memcpy(req->method, buf + p->method_off, p->method_len);
+    req->method[p->method_len] = '\0';
+    memcpy(req->path, buf + p->target_off, p->target_len);
+    req->path[p->target_len] = '\0';
+    memcpy(req->version, buf + p->version_off, p->version_len);
+    req->version[p->version_len] = '\0';
+    return 0;
+}
+
+// I tell whether a q value ("1", "0.5", "0.000") is zero, which means "not acceptable".
+static int q_is_zero(const char *v, size_t len)
+{
+    if (len == 0 || v[0] != '0') return 0;
+    for (size_t i = 1; i < len; i++) {
+        if (v[i] != '.' && v[i] != '0') return 0;
+    }
+    return 1;
+}
+
+int http_accepts_encoding(const char *value, size_t len, const char *coding)
+{
+    size_t n = strlen(coding);
+    int named = -1;     // What the list says about the coding itself (-1: it isn't there).
+    int wildcard = 0;   // What "*" says about codings that aren't named.
+    const char *p = value;
+    const char *end = value + len;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        const char *tok = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+        size_t tok_len = (size_t)(p - tok);
+
+        // Parameters follow the coding; q is the only one that means anything here.
+        int acceptable = 1;
+        while (p < end && *p != ',') {
+            if (*p != ';') {
+                p++;
+                continue;
+            }
+            p++;
+            while (p < end && (*p == ' ' || *p == '\t')) p++;
+            if (end - p >= 2 && (p[0] == 'q' || p[0] == 'Q') && p[1] == '=') {
+                const char *v = p + 2;
+                p = v;
+                while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+                acceptable = !q_is_zero(v, (size_t)(p - v));
+            }
+        }
+
+        if (tok_len == n && strncasecmp(tok, coding, n) == 0) named = acceptable;
+        else if (tok_len == 1 && tok[0] == '*') wildcard = acceptable;
+    }
+    return (named >= 0) ? named : wildcard;
+}
+
+// * Response Headers
+// Every response carries a Date, but it only changes once a second. Each thread keeps
+// the last one it formatted and only calls gmtime_r() and strftime() when the second
+// has moved on, so most responses just compare two numbers.
+static _Thread_local time_t date_second = -1;
+static _Thread_local char date_value[HTTP_DATE_LEN + 1];
+
+void http_format_date(char *buf, size_t cap, time_t t)
+{
+    struct tm tm_data;
+    gmtime_r(&t, &tm_data); // I use gmtime_r because it's thread-safe.
     // I format the date according to RFC 1123, which is what HTTP expects.
-    strftime(date_str, sizeof(date_str), "%a, %d %b %Y %H:%M:%S GMT", &tm_data);
+    strftime(buf, cap, "%a, %d %b %Y %H:%M:%S GMT", &tm_data);
+}
+
+const char *http_date()
+{
+    time_t now = time(NULL);
+    if (now != date_second) {
+        http_format_date(date_value, sizeof(date_value), now);
+        date_second = now;
+    }
+    return date_value;
+}
+
+// I'm building the header block of an HTTP response into a buffer.
+// Both the blocking threads and the event loop use this, so every response looks the same.
+// extra_headers can hold additional "Name: value\r\n" lines (or be NULL).
+// I return the header length, clamped to the buffer size.
+size_t http_format_header(char *buf, size_t cap, int status, const char *status_msg,
+                          const char *content_type, size_t content_length, const char *extra_headers,
+                          int keep_alive)
+{
+    // A 304 has no body, and the Content-Length of the full response may not be known
+    // (a gzip I haven't made yet), so I leave it out.
+    char length_line[48] = "";
+    if (status != 304) snprintf(length_line, sizeof(length_line), "Content-Length: %zu\r\n", content_length);
 
-    // 2. Now I'll build the complete HTTP response header.
     // I'm using snprintf because it's safe - it won't overflow my buffer.
-    char header[2048];
-    int header_len = snprintf(header, sizeof(header),
+    // Date has to stay the line right after the status line: http_refresh_date() relies on it.
+    int header_len = snprintf(buf, cap,
                               "HTTP/1.1 %d %s\r\n"          // Status line
                               "Date: %s\r\n"               // Current date
                               "Content-Type: %s\r\n"       // What kind of data I'm sending
-                              "Content-Length: %zu\r\n"    // How many bytes are in the body
+                              "%s"                          // How many bytes are in the body
+                              "%s"                          // Anything extra, like Content-Range
                               "Server: ConcurrentHTTP/1.0\r\n" // My server name
-                              "Connection: keep-alive\r\n" // I'll keep the connection open for more requests
+                              "Connection: %s\r\n"         // Whether I'll keep the connection open for more requests
                               "\r\n",                      // Empty line marks end of headers
                               status, status_msg, 
-                              date_str,                     
-                              content_type, body_len);
+                              http_date(),
+                              content_type, length_line,
+                              extra_headers ? extra_headers : "",
+                              keep_alive ? "keep-alive" : "close");
+
+    if (header_len < 0) return 0;
+    return ((size_t)header_len < cap) ? (size_t)header_len : cap - 1;
+}
+
+time_t http_parse_date(const char *value, size_t len)
+{
+    // I only read the IMF-fixdate form ("Sun, 06 Nov 1994 08:49:37 GMT"), which is the one
+    // every client sends back. Anything else is invalid, and the condition is ignored.
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    if (len != HTTP_DATE_LEN || value[3] != ',' || value[4] != ' ' || memcmp(value + 25, " GMT", 4) != 0)
+        return -1;
+    char text[HTTP_DATE_LEN + 1];
+    memcpy(text, value, len);
+    text[len] = '\0';
+
+    struct tm tm_data = {0};
+    char month[4];
+    if (sscanf(text + 5, "%2d %3s %4d %2d:%2d:%2d", &tm_data.tm_mday, month, &tm_data.tm_year,
+               &tm_data.tm_hour, &tm_data.tm_min, &tm_data.tm_sec) != 6)
+        return -1;
+    const char *m = strstr(months, month);
+    if (!m || (m - months) % 3 != 0) return -1;
+    tm_data.tm_mon = (int)(m - months) / 3;
+    tm_data.tm_year -= 1900;
+    return timegm(&tm_data);
+}
+
+// The Date value always has the same length, so I can overwrite it where it stands.
+void http_refresh_date(char *header, size_t len)
+{
+    const char *eol = memchr(header, '\n', len);
+    if (!eol) return;
+    size_t off = (size_t)(eol - header) + 1;
+    if (off + 6 + HTTP_DATE_LEN > len || memcmp(header + off, "Date: ", 6) != 0) return;
+    memcpy(header + off + 6, http_date(), HTTP_DATE_LEN);
+}
 
-    // 3. Send the header to the client.
-    send(fd, header, header_len, MSG_NOSIGNAL);
+// I write a list of buffers to a socket with as few system calls as possible,
+// picking up where the kernel stopped after a partial write. I return -1 if the client is gone.
+int http_send_iov(int fd, struct iovec *iov, int count, int flags)
+{
+    while (count > 0) {
+        struct msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t n = sendmsg(fd, &msg, flags | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        // I skip what was written, then continue with the rest.
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
 
-    // 4. If there's a body (and it's not a HEAD request), send it too.
+// I'm sending an HTTP response back to the client.
+// This function builds a proper HTTP response with headers and body.
+void send_http_response(int fd, int status, const char *status_msg, const char *content_type, const char *body, size_t body_len)
+{
+    char header[2048];
+    // I only use this right before I hang up, so I say so.
+    size_t header_len = http_format_header(header, sizeof(header), status, status_msg,
+                                           content_type, body_len, NULL, 0);
+
+    // The header and the body leave together, so a small response is one segment.
+    struct iovec iov[2];
+    int count = 0;
+    iov[count].iov_base = header;
+    iov[count].iov_len = header_len;
+    count++;
     // The body_len check ensures I don't try to send empty data.
     if (body && body_len > 0)
     {
-        send(fd, body, body_len, MSG_NOSIGNAL);
+        iov[count].iov_base = (void *)body;
+        iov[count].iov_len = body_len;
+        count++;
     }
-}
\ No newline at end of file
+    http_send_iov(fd, iov, count, 0);
+}
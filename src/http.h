@@ -2,6 +2,8 @@
 #define HTTP_H // I'm using include guards to prevent multiple inclusions.
 
 #include <stddef.h> // I need size_t from here.
+#include <sys/uio.h> // I need struct iovec for http_send_iov().
+#include <time.h>    // I need time_t for HTTP dates.
 
 // This structure represents an HTTP request from a client.
 // I'm keeping it simple with just the essentials for my static file server.
@@ -12,9 +14,89 @@ typedef struct
     char version[16];  // I store the HTTP version like "HTTP/1.0" or "HTTP/1.1".
 } http_request_t;
 
-// I need a function to parse raw HTTP request data.
-// This takes the buffer received from the client socket and extracts the request details.
-int parse_http_request(const char *buffer, http_request_t *req);
+// These are the limits I put on a request head (request line plus headers).
+#define HTTP_MAX_HEADER_BYTES 8192 // Anything longer gets 431 Request Header Fields Too Large.
+#define HTTP_MAX_HEADERS 64        // So does a request with more header lines than this.
+
+// One header, as two slices of the receive buffer. I never copy header bytes.
+typedef struct
+{
+    unsigned name_off;    // Where the name starts in the buffer.
+    unsigned name_len;
+    unsigned value_off;   // Where the value starts (leading and trailing whitespace trimmed).
+    unsigned value_len;
+} http_header_t;
+
+// This is my resumable request parser. It lives as long as the connection's receive buffer:
+// every time more bytes arrive I continue from where I stopped, so nothing is scanned twice.
+typedef struct
+{
+    int state;            // Where I am: request line, headers, or done.
+    size_t line_start;    // The start of the line I'm working on.
+    size_t scan;          // How far I've already looked for the end of that line.
+    unsigned method_off, method_len;   // The request line, as slices too.
+    unsigned target_off, target_len;
+    unsigned version_off, version_len;
+    http_header_t headers[HTTP_MAX_HEADERS];
+    int header_count;
+    long content_length;  // The request body size (-1 when there's no Content-Length).
+    int chunked;          // Set when Transfer-Encoding includes chunked.
+    int keep_alive;       // What the version and Connection header ask for.
+    size_t head_len;      // How many bytes the request line and headers took (once done).
+    int error_status;     // The status I answer with when parsing fails (400, 414, 431, 501).
+} http_parser_t;
+
+// These are what http_parse() returns.
+#define HTTP_PARSE_INCOMPLETE 0 // I need more bytes.
+#define HTTP_PARSE_DONE 1       // The head is complete; p->head_len says where it ends.
+#define HTTP_PARSE_ERROR -1     // The request is malformed or too big; see p->error_status.
+
+// I reset the parser for the next request on the connection.
+void http_parser_init(http_parser_t *p);
+
+// I continue parsing buf (len bytes so far, the same buffer as last time with more data appended).
+int http_parse(http_parser_t *p, const char *buf, size_t len);
+
+// I look up a header by name, ignoring case. I return NULL if the request didn't have it.
+const http_header_t *http_find_header(const http_parser_t *p, const char *buf, const char *name);
+
+// I copy the method, target and version slices of a parsed request into req.
+// I return -1 if the target doesn't fit (the caller answers 414).
+int http_request_line(const http_parser_t *p, const char *buf, http_request_t *req);
+
+// I tell whether an Accept-Encoding value (len bytes, not NUL-terminated) lets me send
+// coding ("gzip", "br"). A coding the client gave q=0 is refused, and so is one it
+// didn't mention unless "*" covers it.
+int http_accepts_encoding(const char *value, size_t len, const char *coding);
+
+// This is how long a Date value is ("Sun, 06 Nov 1994 08:49:37 GMT").
+#define HTTP_DATE_LEN 29
+
+// I return the current time as a Date value. It's formatted at most once a second
+// per thread; the string stays valid until this thread calls me again.
+const char *http_date();
+
+// I write t as an HTTP date (for Last-Modified) into buf.
+void http_format_date(char *buf, size_t cap, time_t t);
+
+// I read an HTTP date (If-Modified-Since) and return it, or -1 if I can't make sense of it.
+time_t http_parse_date(const char *value, size_t len);
+
+// I bring the Date line of a header built by http_format_header() up to date, in place.
+// That's how a header serialized once (for the cache) can be sent again later.
+void http_refresh_date(char *header, size_t len);
+
+// I need a function to build the header block of a response into a buffer.
+// It returns how many bytes it wrote. keep_alive picks the Connection header.
+// A 304 gets no Content-Length.
+size_t http_format_header(char *buf, size_t cap, int status, const char *status_msg,
+                          const char *content_type, size_t content_length, const char *extra_headers,
+                          int keep_alive);
+
+// I write all of iov to a socket, resuming after partial writes, in as few sendmsg()
+// calls as the kernel allows. flags are added to MSG_NOSIGNAL (MSG_MORE when more of the
+// response follows). I return 0 when everything went out, -1 if the client is gone.
+int http_send_iov(int fd, struct iovec *iov, int count, int flags);
 
 // I need a function to send HTTP responses back to clients.
 // This builds proper HTTP headers and sends the response body.
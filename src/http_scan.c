@@ -0,0 +1,215 @@
+#include <stdint.h>
+#include <string.h>
+#include "http_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_SCAN_X86 1
+#endif
+
+// * Character Classes
+// I build the token table once, so the scalar scan is one lookup per byte
+// and the SIMD scans can derive their nibble tables from it.
+static uint8_t token_table[256];
+
+static void build_token_table()
+{
+    static const char extra[] = "!#$%&'*+-.^_`|~";
+    for (int c = '0'; c <= '9'; c++) token_table[c] = 1;
+    for (int c = 'A'; c <= 'Z'; c++) token_table[c] = 1;
+    for (int c = 'a'; c <= 'z'; c++) token_table[c] = 1;
+    for (const char *p = extra; *p; p++) token_table[(uint8_t)*p] = 1;
+}
+
+static int is_target_char(uint8_t c)
+{
+    return c > 0x20 && c != 0x7f;
+}
+
+// * Scalar Versions
+static size_t scan_line_scalar(const char *buf, size_t len)
+{
+    const char *nl = memchr(buf, '\n', len);
+    return nl ? (size_t)(nl - buf) : len;
+}
+
+static size_t scan_token_scalar(const char *buf, size_t len)
+{
+    size_t i = 0;
+    while (i < len && token_table[(uint8_t)buf[i]]) i++;
+    return i;
+}
+
+static size_t scan_target_scalar(const char *buf, size_t len)
+{
+    size_t i = 0;
+    while (i < len && is_target_char((uint8_t)buf[i])) i++;
+    return i;
+}
+
+#ifdef HTTP_SCAN_X86
+// * SIMD Versions
+// A byte is a token character when both of its nibbles agree: token_lo[low nibble]
+// has bit h set exactly when (h << 4 | low nibble) is a token character, and
+// token_hi[h] is that bit. Non-ASCII bytes get no bit, so they never match.
+// One shuffle per nibble classifies a whole vector at once.
+static uint8_t token_lo[16] __attribute__((aligned(16)));
+static uint8_t token_hi[16] __attribute__((aligned(16)));
+
+static void build_nibble_tables()
+{
+    for (int c = 0; c < 128; c++) {
+        if (token_table[c]) token_lo[c & 0x0f] |= (uint8_t)(1 << (c >> 4));
+    }
+    for (int h = 0; h < 8; h++) token_hi[h] = (uint8_t)(1 << h);
+}
+
+// I finish the last partial block with the scalar loop, so no load ever goes past len.
+__attribute__((target("sse4.2")))
+static size_t scan_line_sse42(const char *buf, size_t len)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        if (mask) return i + (size_t)__builtin_ctz((unsigned)mask);
+    }
+    return i + scan_line_scalar(buf + i, len - i);
+}
+
+__attribute__((target("sse4.2")))
+static size_t scan_token_sse42(const char *buf, size_t len)
+{
+    const __m128i lo_table = _mm_load_si128((const __m128i *)token_lo);
+    const __m128i hi_table = _mm_load_si128((const __m128i *)token_hi);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i lo = _mm_shuffle_epi8(lo_table, _mm_and_si128(v, nibble));
+        __m128i hi = _mm_shuffle_epi8(hi_table, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+        __m128i bad = _mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128());
+        int mask = _mm_movemask_epi8(bad);
+        if (mask) return i + (size_t)__builtin_ctz((unsigned)mask);
+    }
+    return i + scan_token_scalar(buf + i, len - i);
+}
+
+// PCMPESTRI does this one in a single instruction: it finds the first byte
+// outside the ranges 0x21-0x7e and 0x80-0xff.
+__attribute__((target("sse4.2")))
+static size_t scan_target_sse42(const char *buf, size_t len)
+{
+    const __m128i ranges = _mm_setr_epi8(0x21, 0x7e, (char)0x80, (char)0xff,
+                                         0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        int idx = _mm_cmpestri(ranges, 4, v, 16,
+                               _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_NEGATIVE_POLARITY);
+        if (idx < 16) return i + (size_t)idx;
+    }
+    return i + scan_target_scalar(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_line_avx2(const char *buf, size_t len)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        if (mask) return i + (size_t)__builtin_ctz(mask);
+    }
+    return i + scan_line_scalar(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_token_avx2(const char *buf, size_t len)
+{
+    // The shuffle works within each 128-bit lane, so I repeat the tables in both.
+    const __m256i lo_table = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)token_lo));
+    const __m256i hi_table = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)token_hi));
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i lo = _mm256_shuffle_epi8(lo_table, _mm256_and_si256(v, nibble));
+        __m256i hi = _mm256_shuffle_epi8(hi_table, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+        __m256i bad = _mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256());
+        unsigned mask = (unsigned)_mm256_movemask_epi8(bad);
+        if (mask) return i + (size_t)__builtin_ctz(mask);
+    }
+    return i + scan_token_scalar(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_target_avx2(const char *buf, size_t len)
+{
+    // Signed compares: bytes 0x80-0xff are negative, so "greater than 0x20" alone
+    // would refuse them. I only flag bytes that are (signed) -1 < b <= 0x20, or 0x7f.
+    const __m256i space = _mm256_set1_epi8(0x20);
+    const __m256i minus_one = _mm256_set1_epi8(-1);
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i ctl = _mm256_andnot_si256(_mm256_cmpgt_epi8(v, space), _mm256_cmpgt_epi8(v, minus_one));
+        __m256i bad = _mm256_or_si256(ctl, _mm256_cmpeq_epi8(v, del));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(bad);
+        if (mask) return i + (size_t)__builtin_ctz(mask);
+    }
+    return i + scan_target_scalar(buf + i, len - i);
+}
+#endif
+
+// * Dispatch
+// These point at the versions I picked. They start out scalar, which is what
+// CPUs without SSE4.2 (and non-x86 builds) keep.
+static size_t (*scan_line)(const char *, size_t) = scan_line_scalar;
+static size_t (*scan_token)(const char *, size_t) = scan_token_scalar;
+static size_t (*scan_target)(const char *, size_t) = scan_target_scalar;
+static const char *kernel_name = "scalar";
+
+// main() calls this once before forking, so every worker inherits the tables and the choice.
+void http_scan_init()
+{
+    build_token_table();
+#ifdef HTTP_SCAN_X86
+    build_nibble_tables();
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_line = scan_line_avx2;
+        scan_token = scan_token_avx2;
+        scan_target = scan_target_avx2;
+        kernel_name = "avx2";
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        scan_line = scan_line_sse42;
+        scan_token = scan_token_sse42;
+        scan_target = scan_target_sse42;
+        kernel_name = "sse4.2";
+    }
+#endif
+}
+
+const char *http_scan_kernel()
+{
+    return kernel_name;
+}
+
+size_t http_scan_line(const char *buf, size_t len)
+{
+    return scan_line(buf, len);
+}
+
+size_t http_scan_token(const char *buf, size_t len)
+{
+    return scan_token(buf, len);
+}
+
+size_t http_scan_target(const char *buf, size_t len)
+{
+    return scan_target(buf, len);
+}
@@ -0,0 +1,26 @@
+#ifndef HTTP_SCAN_H
+#define HTTP_SCAN_H // I'm using include guards to prevent multiple inclusion.
+
+#include <stddef.h> // I need size_t for buffer lengths.
+
+// These are the byte scans the request parser spends its time in.
+// Each one has a scalar version and, on x86, SSE4.2 and AVX2 versions that look at
+// 16 or 32 bytes per step. http_scan_init() builds the character tables and picks
+// the best version the CPU supports, so it has to run before any request is parsed.
+void http_scan_init();
+
+// I tell which version http_scan_init() picked ("avx2", "sse4.2" or "scalar").
+const char *http_scan_kernel();
+
+// I return the offset of the first '\n' in buf, or len if there isn't one.
+size_t http_scan_line(const char *buf, size_t len);
+
+// I return how many bytes at the start of buf are token characters (RFC 9110),
+// so a method ends at its space and a header name at its ':'.
+size_t http_scan_token(const char *buf, size_t len);
+
+// I return how many bytes at the start of buf may appear in a request target
+// (anything but spaces and control characters).
+size_t http_scan_target(const char *buf, size_t len);
+
+#endif
@@ -0,0 +1,205 @@
+#define _GNU_SOURCE // I need this for EPOLLRDHUP.
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "idle_poller.h"
+#include "worker.h"
+
+// I need to access the global server configuration.
+extern server_config_t config;
+
+// These are the states a client fd can be in, as far as I'm concerned.
+enum { FD_ACTIVE, FD_PARKED, FD_RESUMED };
+
+// I keep one of these per fd number. Parked fds are linked in the order they were
+// parked, so expiring idle clients only ever looks at the front of the list.
+typedef struct {
+    int state;      // One of the FD_* states above.
+    time_t since;   // When the fd was parked.
+    int prev;       // My neighbours in the parked list (-1 = none).
+    int next;
+} parked_fd_t;
+
+// * Poller State
+// There's one poller per worker process. Pool threads park sockets while the
+// dispatcher wakes and expires them, so the table and list sit behind one mutex.
+static struct {
+    int epfd;
+    int ipc_socket;
+    int listen_fd;
+    parked_fd_t *fds;       // Indexed by fd number.
+    int max_fds;            // How many slots 'fds' has (the fd limit).
+    int head;               // The fd that has been parked the longest.
+    int tail;
+    pthread_mutex_t lock;
+} poller = {.epfd = -1, .head = -1, .tail = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void list_remove(int fd)
+{
+    parked_fd_t *p = &poller.fds[fd];
+    if (p->prev >= 0) poller.fds[p->prev].next = p->next;
+    else poller.head = p->next;
+    if (p->next >= 0) poller.fds[p->next].prev = p->prev;
+    else poller.tail = p->prev;
+    p->prev = p->next = -1;
+}
+
+static void list_append(int fd)
+{
+    parked_fd_t *p = &poller.fds[fd];
+    p->prev = poller.tail;
+    p->next = -1;
+    if (poller.tail >= 0) poller.fds[poller.tail].next = fd;
+    else poller.head = fd;
+    poller.tail = fd;
+}
+
+int idle_poller_init(int ipc_socket, int listen_fd)
+{
+    // I size my table by the fd limit, so every fd has a slot.
+    struct rlimit rl;
+    poller.max_fds = 65536;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < (1 << 20)) {
+        poller.max_fds = (int)rl.rlim_cur;
+    }
+    poller.fds = calloc(poller.max_fds, sizeof(parked_fd_t));
+    poller.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (!poller.fds || poller.epfd < 0) {
+        perror("idle poller init");
+        idle_poller_cleanup();
+        return -1;
+    }
+    for (int i = 0; i < poller.max_fds; i++) {
+        poller.fds[i].prev = poller.fds[i].next = -1;
+    }
+
+    poller.ipc_socket = ipc_socket;
+    poller.listen_fd = listen_fd;
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = ipc_socket};
+    if (epoll_ctl(poller.epfd, EPOLL_CTL_ADD, ipc_socket, &ev) < 0) {
+        perror("epoll_ctl ipc");
+        idle_poller_cleanup();
+        return -1;
+    }
+    if (listen_fd >= 0) {
+        ev.data.fd = listen_fd;
+        if (epoll_ctl(poller.epfd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+            perror("epoll_ctl listen");
+            idle_poller_cleanup();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int idle_poller_park(int client_fd)
+{
+    if (poller.epfd < 0 || client_fd >= poller.max_fds) return -1;
+
+    // I mark it parked before arming it, so a request that is already on its way
+    // finds it in the table when the dispatcher sees the event.
+    pthread_mutex_lock(&poller.lock);
+    poller.fds[client_fd].state = FD_PARKED;
+    poller.fds[client_fd].since = time(NULL);
+    list_append(client_fd);
+    pthread_mutex_unlock(&poller.lock);
+
+    // One-shot: the socket fires once, then stays quiet until it's parked again.
+    // It stays registered between parks, so after the first time a MOD is enough.
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.fd = client_fd};
+    if (epoll_ctl(poller.epfd, EPOLL_CTL_MOD, client_fd, &ev) == 0 ||
+        (errno == ENOENT && epoll_ctl(poller.epfd, EPOLL_CTL_ADD, client_fd, &ev) == 0)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&poller.lock);
+    list_remove(client_fd);
+    poller.fds[client_fd].state = FD_ACTIVE;
+    pthread_mutex_unlock(&poller.lock);
+    return -1;
+}
+
+int idle_poller_resumed(int client_fd)
+{
+    if (poller.epfd < 0 || client_fd >= poller.max_fds) return 0;
+
+    pthread_mutex_lock(&poller.lock);
+    int resumed = (poller.fds[client_fd].state == FD_RESUMED);
+    poller.fds[client_fd].state = FD_ACTIVE;
+    pthread_mutex_unlock(&poller.lock);
+    return resumed;
+}
+
+int idle_poller_wait(int *ready, int *ipc_ready, int *listen_ready)
+{
+    struct epoll_event events[IDLE_POLLER_MAX_READY];
+    int count = 0;
+    *ipc_ready = 0;
+    *listen_ready = 0;
+
+    // I wake up at least once a second to expire idle connections.
+    int n = epoll_wait(poller.epfd, events, IDLE_POLLER_MAX_READY, 1000);
+    if (n < 0 && errno != EINTR) {
+        perror("epoll_wait");
+        return -1;
+    }
+
+    pthread_mutex_lock(&poller.lock);
+    for (int i = 0; i < n; i++) {
+        int fd = events[i].data.fd;
+        if (fd == poller.ipc_socket) {
+            *ipc_ready = 1;
+        } else if (fd == poller.listen_fd) {
+            *listen_ready = 1;
+        } else if (poller.fds[fd].state == FD_PARKED) {
+            // The next request (or a hang-up) arrived, so it goes back to the pool.
+            list_remove(fd);
+            poller.fds[fd].state = FD_RESUMED;
+            ready[count++] = fd;
+        }
+    }
+
+    // Parked clients that have been silent for too long get closed.
+    int timeout = config.keep_alive_timeout > 0 ? config.keep_alive_timeout : 5;
+    time_t now = time(NULL);
+    int expired[IDLE_POLLER_MAX_READY];
+    int expired_count = 0;
+    while (poller.head >= 0 && now - poller.fds[poller.head].since >= timeout &&
+           expired_count < IDLE_POLLER_MAX_READY) {
+        int fd = poller.head;
+        list_remove(fd);
+        poller.fds[fd].state = FD_ACTIVE;
+        expired[expired_count++] = fd;
+    }
+    pthread_mutex_unlock(&poller.lock);
+
+    for (int i = 0; i < expired_count; i++) {
+        close(expired[i]);
+        track_connection(-1);
+    }
+    return count;
+}
+
+void idle_poller_cleanup()
+{
+    if (poller.fds) {
+        while (poller.head >= 0) {
+            int fd = poller.head;
+            list_remove(fd);
+            close(fd);
+            track_connection(-1);
+        }
+        free(poller.fds);
+        poller.fds = NULL;
+    }
+    if (poller.epfd >= 0) close(poller.epfd);
+    poller.epfd = -1;
+}
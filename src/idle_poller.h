@@ -0,0 +1,34 @@
+#ifndef IDLE_POLLER_H
+#define IDLE_POLLER_H // I'm using include guards to prevent multiple inclusion.
+
+// In the thread-per-connection model a keep-alive client that goes quiet used to
+// hold a pool thread hostage until it spoke again or timed out.
+// Now the thread parks the socket here and goes back to the pool. The worker's
+// dispatcher thread watches parked sockets in epoll alongside its IPC socket
+// (and listener), and puts a socket back on the local queue once its next request arrives.
+
+// The most fds one idle_poller_wait() can hand back.
+#define IDLE_POLLER_MAX_READY 256
+
+// I set up the epoll instance and register the IPC socket (and my listener in reuseport mode).
+// I return -1 if that fails; handle_client then just keeps blocking like before.
+int idle_poller_init(int ipc_socket, int listen_fd);
+
+// The dispatcher calls this instead of blocking on the IPC socket.
+// I wait up to a second, put parked sockets whose next request arrived into 'ready',
+// and tell the caller whether the IPC socket or the listener need attention.
+// Along the way I close parked sockets that stayed silent past KEEP_ALIVE_TIMEOUT.
+int idle_poller_wait(int *ready, int *ipc_ready, int *listen_ready);
+
+// A pool thread hands me a keep-alive socket with no request pending.
+// I return -1 if I can't take it, and the thread keeps serving it itself.
+int idle_poller_park(int client_fd);
+
+// I tell handle_client whether this fd is a parked connection coming back
+// (already counted and set up) rather than a brand new one.
+int idle_poller_resumed(int client_fd);
+
+// When the worker stops I close whatever is still parked.
+void idle_poller_cleanup();
+
+#endif
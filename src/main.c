@@ -10,6 +10,8 @@
 #include "config.h" // I need to know how to handle configuration.
 #include <signal.h> // I need this for signal handling (SIGPIPE).
 #include "shared_mem.h" // I need to set up shared memory for statistics.
+#include "http_scan.h" // I pick the request scanning code for this CPU.
+#include "cache.h" // I need the CACHE_ADMISSION_* policies for the default.
 
 // I'm declaring the configuration structure globally so I can access it from anywhere.
 server_config_t config;
@@ -86,8 +88,22 @@ int main(int argc, char *argv[]) {
     config.threads_per_worker = 10; // Each worker will have 10 threads.
     config.max_queue_size = 100; // I can hold 100 pending connections.
     config.cache_size_mb = 10; // I'll give each worker 10MB of cache.
+    config.cache_shared = 1; // ...and pool it into one cache all workers share.
+    config.cache_shards = 8; // The cache is split into 8 shards with a lock each.
+    config.cache_admission = CACHE_ADMISSION_TINYLFU; // One-off files don't push popular ones out.
     config.timeout_seconds = 30; // Connections will time out after 30 seconds of silence.
     config.keep_alive_timeout = 5; // Keep-alive connections get 5 seconds.
+    config.listener_mode = LISTENER_MASTER; // The master accepts and hands connections out.
+    config.dispatch_policy = DISPATCH_ROUND_ROBIN; // Connections go to workers in turn.
+    config.accept_batch = 16; // I drain up to 16 pending connections per burst.
+    config.io_model = IO_MODEL_THREADS; // Each connection gets a pool thread.
+    config.queue_type = QUEUE_MUTEX; // One shared queue per worker.
+    config.min_threads = 0; // The pool starts with THREADS_PER_WORKER threads...
+    config.max_threads = 0; // ...and stays at that size unless MAX_THREADS says otherwise.
+    config.thread_idle_timeout = 30; // Spare threads retire after 30 idle seconds.
+    config.worker_cpus[0] = '\0'; // I let the scheduler place workers...
+    config.accept_cpus[0] = '\0'; // ...and the master, unless told otherwise.
+    config.compression = COMPRESSION_STATIC; // I send .br/.gz sidecars when they exist.
     strncpy(config.document_root, "./www", sizeof(config.document_root)); // I'll serve files from ./www.
     strncpy(config.log_file, "access.log", sizeof(config.log_file)); // I'll log everything to access.log.
 
@@ -179,6 +195,11 @@ int main(int argc, char *argv[]) {
     // I'm initializing the shared memory for statistics.
     init_shared_stats();
 
+    // I pick the fastest header scanning code this CPU supports before the workers fork.
+    http_scan_init();
+    printf("Header scanning: %s\n", http_scan_kernel());
+    fflush(stdout); // Otherwise every forked worker would print this line again.
+
     // Everything is set up! I'm handing control over to the master server logic.
     return start_master_server();
 }
\ No newline at end of file
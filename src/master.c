@@ -1,4 +1,4 @@
-#define _XOPEN_SOURCE 700 // I need this for some advanced POSIX features.
+#define _GNU_SOURCE // I need this for SO_REUSEPORT and accept4().
 
 #include "master.h"    
 #include "shared_mem.h" 
@@ -8,6 +8,9 @@
 #include "worker.h"     
 #include "stats.h"      
 #include "thread_pool.h" 
+#include "uring.h"
+#include "affinity.h"
+#include "cache.h"
 #include <sys/socket.h> 
 #include <netinet/in.h> 
 #include <unistd.h>     
@@ -17,6 +20,9 @@
 #include <pthread.h>    
 #include <signal.h>     
 #include <errno.h>      
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
 
 // I'm grabbing the global config that was loaded in main.c.
 extern server_config_t config;
@@ -33,12 +39,13 @@ void handle_sigint(int sig) {
     server_running = 0; 
 }
 
-// I'm sending a file descriptor to another process.
+// I'm sending file descriptors to another process.
 // You see, file descriptors are just numbers local to my process.
 // If I just send the number "5", it means nothing to the worker.
 // So I use a special UNIX socket message (SCM_RIGHTS) to tell the kernel:
-// "Hey, please copy this file descriptor into the worker's process table!"
-static int send_fd(int socket, int fd_to_send)
+// "Hey, please copy these file descriptors into the worker's process table!"
+// One message can carry a whole burst of fds, so a reconnect wave costs one sendmsg per worker.
+static int send_fds(int socket, const int *fds, int count)
 {
     struct msghdr msg = {0};
 
@@ -47,11 +54,11 @@ static int send_fd(int socket, int fd_to_send)
     char buf[1] = {0}; 
     struct iovec io = {.iov_base = buf, .iov_len = 1};
 
-    // I need a buffer for the control message (the FD).
+    // I need a buffer for the control message (the FDs).
     // I use a union to make sure it's properly aligned in memory.
     union
     {
-        char buf[CMSG_SPACE(sizeof(int))]; // Enough space for one integer.
+        char buf[CMSG_SPACE(sizeof(int) * MAX_ACCEPT_BATCH)]; // Enough space for a full batch.
         struct cmsghdr align;              // Force alignment.
     } u;
     
@@ -62,50 +69,266 @@ static int send_fd(int socket, int fd_to_send)
     msg.msg_iov = &io;          // Here's my dummy data.
     msg.msg_iovlen = 1;         // Just one chunk.
     msg.msg_control = u.buf;    // Here's my control buffer.
-    msg.msg_controllen = sizeof(u.buf); // This is how big it is.
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count); // I only use as much as this batch needs.
 
     // I'm filling in the control message header.
     struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
     cmsg->cmsg_level = SOL_SOCKET;  // It's a socket-level message.
-    cmsg->cmsg_type = SCM_RIGHTS;   // I'm sending rights (a file descriptor).
-    cmsg->cmsg_len = CMSG_LEN(sizeof(int)); // It's the size of an int.
+    cmsg->cmsg_type = SCM_RIGHTS;   // I'm sending rights (file descriptors).
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count); // It's the size of the whole fd array.
 
-    // Finally, I put the file descriptor into the data part of the message.
-    *((int *)CMSG_DATA(cmsg)) = fd_to_send;
+    // Finally, I put the file descriptors into the data part of the message.
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
 
     return sendmsg(socket, &msg, MSG_NOSIGNAL);
 }
 
-// This is the main event! I'm starting the master server.
-// I'll set up everything, spawn the workers, and then just sit there accepting connections.
-int start_master_server()
+// I'm choosing which worker gets the next connection.
+// Round robin is blind to load, so a worker stuck on a slow client keeps getting its share.
+// The other policies read the load every worker publishes in shared memory.
+static int pick_worker(int *current_worker)
 {
-    // 1. First, I need to handle signals.
-    struct sigaction sa;
-    sa.sa_handler = handle_sigint; // Call this function when SIGINT happens.
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0; // I don't want SA_RESTART because I want accept() to fail when interrupted.
-    sigaction(SIGINT, &sa, NULL);
+    int n = config.num_workers;
 
-    // 2. Now I'm creating the server socket.
+    if (config.dispatch_policy == DISPATCH_LEAST_LOADED) {
+        // I scan everyone, starting after the last pick so ties still rotate.
+        int best = *current_worker;
+        int best_load = worker_load(&worker_loads[best]);
+        for (int k = 1; k < n && best_load > 0; k++) {
+            int i = (*current_worker + k) % n;
+            int load = worker_load(&worker_loads[i]);
+            if (load < best_load) {
+                best = i;
+                best_load = load;
+            }
+        }
+        *current_worker = (best + 1) % n;
+        return best;
+    }
+
+    if (config.dispatch_policy == DISPATCH_TWO_CHOICES && n > 1) {
+        // I only look at two random workers, which is almost as good as scanning them all.
+        int a = rand() % n;
+        int b = rand() % (n - 1);
+        if (b >= a) b++; // I make sure the two choices are different.
+        return (worker_load(&worker_loads[b]) < worker_load(&worker_loads[a])) ? b : a;
+    }
+
+    int chosen = *current_worker;
+    *current_worker = (*current_worker + 1) % n;
+    return chosen;
+}
+
+// I'm handing off a burst of accepted connections, one message per worker.
+// targets[i] is the worker that fds[i] was assigned to.
+static void hand_off(int *worker_pipes, int *fds, int *targets, int count)
+{
+    int group[MAX_ACCEPT_BATCH];
+    for (int w = 0; w < config.num_workers; w++) {
+        int n = 0;
+        for (int i = 0; i < count; i++) {
+            if (targets[i] == w) group[n++] = fds[i];
+        }
+        if (n == 0) continue;
+        if (send_fds(worker_pipes[w], group, n) < 0) {
+            __atomic_sub_fetch(&worker_loads[w].in_transit, n, __ATOMIC_RELAXED);
+        }
+    }
+
+    // CRITICAL: I must close my copies of the file descriptors.
+    // If I don't, I'll run out of file descriptors and the connections will never close.
+    for (int i = 0; i < count; i++) {
+        close(fds[i]);
+    }
+}
+
+// I'm draining the listen backlog in bursts.
+// Instead of one accept + one sendmsg per connection, I accept until the kernel says EAGAIN
+// (or the batch is full), pick a worker for each fd, and ship every worker its share in one message.
+static void dispatch_backlog(int server_socket, int *worker_pipes, int *current_worker, int batch_size)
+{
+    int fds[MAX_ACCEPT_BATCH];
+    int targets[MAX_ACCEPT_BATCH];
+    int count;
+
+    do {
+        count = 0;
+        while (count < batch_size) {
+            int client_fd = accept4(server_socket, NULL, NULL, SOCK_CLOEXEC);
+            if (client_fd < 0) {
+                // EAGAIN just means the backlog is empty, which is what I'm waiting for.
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+                    perror("accept");
+                }
+                break;
+            }
+
+            // The dispatch policy decides who gets it (round robin by default).
+            // I count it as in transit right away, so the rest of this burst sees the new load.
+            int target = pick_worker(current_worker);
+            __atomic_add_fetch(&worker_loads[target].in_transit, 1, __ATOMIC_RELAXED);
+            fds[count] = client_fd;
+            targets[count] = target;
+            count++;
+        }
+
+        hand_off(worker_pipes, fds, targets, count);
+    } while (count == batch_size); // A full batch means there may be more waiting.
+}
+
+// With IO_MODEL=io_uring I keep batch_size accept submissions armed on the listener.
+// Each io_uring_enter hands me every connection that arrived since the last one,
+// and I re-arm one accept per completion. After an error that would only repeat (like
+// EMFILE), I let the armed accepts drain and wait a second before arming new ones.
+// I return -1 if I can't get a ring.
+static int uring_accept_loop(int server_socket, int *worker_pipes, int *current_worker, int batch_size)
+{
+    uring_t ring;
+    if (uring_init(&ring, MAX_ACCEPT_BATCH * 2) != 0) {
+        return -1;
+    }
+
+    // The ring waits for connections itself; a non-blocking listener would just make
+    // every armed accept complete with EAGAIN.
+    int flags = fcntl(server_socket, F_GETFL);
+    fcntl(server_socket, F_SETFL, flags & ~O_NONBLOCK);
+
+    struct __kernel_timespec backoff = {.tv_sec = 1, .tv_nsec = 0};
+    int armed = 0;
+    int paused = 0;      // Set after a hard error: I arm no accepts until the timer fires.
+    int timer_armed = 0;
+    int failing = 0;     // Set from the first hard error until an accept succeeds again, so I log it once.
+    while (server_running) {
+        while (!paused && armed < batch_size) {
+            struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+            if (!sqe) break;
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = server_socket;
+            sqe->accept_flags = SOCK_CLOEXEC;
+            sqe->user_data = 0;
+            armed++;
+        }
+        if (paused && armed == 0 && !timer_armed) {
+            struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+            if (sqe) {
+                sqe->opcode = IORING_OP_TIMEOUT;
+                sqe->addr = (uint64_t)(uintptr_t)&backoff;
+                sqe->len = 1;
+                sqe->user_data = 1;
+                timer_armed = 1;
+            }
+        }
+
+        int ret = uring_submit_and_wait(&ring, 1);
+        if (ret < 0 && ret != -EINTR) {
+            fprintf(stderr, "io_uring_enter: %s\n", strerror(-ret));
+            break;
+        }
+
+        int fds[MAX_ACCEPT_BATCH];
+        int targets[MAX_ACCEPT_BATCH];
+        int count = 0;
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&ring)) != NULL) {
+            int client_fd = cqe->res;
+            int is_timer = (cqe->user_data == 1);
+            uring_cqe_seen(&ring);
+            if (is_timer) {
+                timer_armed = 0;
+                paused = 0; // A second has passed, so I try accepting again.
+                continue;
+            }
+            armed--;
+            if (client_fd < 0) {
+                if (client_fd != -EINTR && client_fd != -ECONNABORTED && client_fd != -EAGAIN) {
+                    if (!failing) fprintf(stderr, "accept: %s (retrying every second)\n", strerror(-client_fd));
+                    failing = 1;
+                    paused = 1;
+                }
+                continue;
+            }
+            failing = 0;
+
+            int target = pick_worker(current_worker);
+            __atomic_add_fetch(&worker_loads[target].in_transit, 1, __ATOMIC_RELAXED);
+            fds[count] = client_fd;
+            targets[count] = target;
+            count++;
+        }
+        hand_off(worker_pipes, fds, targets, count);
+    }
+
+    uring_exit(&ring);
+    fcntl(server_socket, F_SETFL, flags);
+    return 0;
+}
+
+// I'm creating a listening TCP socket on the given port.
+// The workers call this too when they run in reuseport mode, so each one gets its own accept queue.
+int create_server_socket(int port, int reuse_port)
+{
     int server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_socket < 0) {
+        perror("socket");
+        return -1;
+    }
+
     int opt = 1;
     // I'm setting SO_REUSEADDR so I can restart the server immediately without waiting for the OS to release the port.
     setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
+    // With SO_REUSEPORT several sockets can bind the same port and the kernel
+    // spreads incoming connections across them.
+    if (reuse_port && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt SO_REUSEPORT");
+        close(server_socket);
+        return -1;
+    }
+
     struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY; // I'll listen on all available network interfaces.
-    address.sin_port = htons(config.port); // I'm converting the port number to network byte order. 
+    address.sin_port = htons(port); // I'm converting the port number to network byte order. 
 
     // I'm binding the socket to the address and port.
     if (bind(server_socket, (struct sockaddr *)&address, sizeof(address)) < 0) {
         perror("bind failed");
-        return 1;
+        close(server_socket);
+        return -1;
     }
     
     // Now I start listening! I can handle a backlog of 128 pending connections.
     listen(server_socket, 128);
+    return server_socket;
+}
+
+// This is the main event! I'm starting the master server.
+// I'll set up everything, spawn the workers, and then just sit there accepting connections.
+int start_master_server()
+{
+    // 1. First, I need to handle signals.
+    struct sigaction sa;
+    sa.sa_handler = handle_sigint; // Call this function when SIGINT happens.
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0; // I don't want SA_RESTART because I want accept() to fail when interrupted.
+    sigaction(SIGINT, &sa, NULL);
+
+    // 2. Now I'm creating the server socket.
+    // In reuseport mode every worker binds its own socket, so I only bind here to check
+    // that the port is free before I fork anyone, and then I let it go.
+    int reuse_port = (config.listener_mode == LISTENER_REUSEPORT);
+    int server_socket = create_server_socket(config.port, reuse_port);
+    if (server_socket < 0) {
+        return 1;
+    }
+    if (reuse_port) {
+        close(server_socket);
+        server_socket = -1;
+    } else {
+        // I drain the backlog until EAGAIN, so the listener must never block.
+        fcntl(server_socket, F_SETFL, fcntl(server_socket, F_GETFL) | O_NONBLOCK);
+    }
 
     printf("Master (PID: %d) listening on port %d.\n", getpid(), config.port);
 
@@ -114,6 +337,27 @@ int start_master_server()
     pthread_create(&stats_tid, NULL, stats_monitor_thread, NULL);
 
     // 4. Time to spawn my minions (worker processes)!
+    // They publish their load here so I can dispatch to whoever is least busy.
+    init_worker_loads(config.num_workers);
+    srand(getpid());
+
+    // With a shared cache, the workers pool their CACHE_SIZE_MB into one region that I map
+    // before forking, so every file is cached once and a miss in one worker fills it for all.
+    if (config.cache_shared) {
+        size_t cache_bytes = (size_t)config.cache_size_mb * 1024 * 1024 * config.num_workers;
+        if (cache_init(cache_bytes, 1, config.cache_shards, config.cache_admission) != 0) {
+            fprintf(stderr, "Shared cache unavailable, every worker gets its own.\n");
+            config.cache_shared = 0;
+        } else {
+            // Each worker prefers memory on its own node, but this region serves all of them,
+            // so I spread it over all their nodes instead of leaving it on mine.
+            void *region;
+            size_t region_len;
+            cache_region(&region, &region_len);
+            interleave_shared_region(region, region_len);
+        }
+    }
+
     int *worker_pipes = malloc(sizeof(int) * config.num_workers);
     for (int i = 0; i < config.num_workers; i++)
     {
@@ -129,14 +373,15 @@ int start_master_server()
         if (pid == 0) {
             // === CHILD PROCESS (WORKER) ===
             // I'm the worker now!
-            close(server_socket); // I don't need the listening socket.
+            if (server_socket >= 0) close(server_socket); // I don't need the listening socket.
             close(sv[0]);         // I don't need the master's end of the pipe.
             
             // I'm ignoring SIGINT because I want to finish my current job before dying.
             // The master will tell me when to stop by closing the pipe.
+            // In reuseport mode the pipe carries no fds, but I still watch it for that EOF.
             signal(SIGINT, SIG_IGN); 
             
-            start_worker_process(sv[1]); // I'm starting my shift!
+            start_worker_process(sv[1], i); // I'm starting my shift!
             exit(0);
         }
         
@@ -145,32 +390,59 @@ int start_master_server()
         worker_pipes[i] = sv[0]; // I'll keep my end safe.
     }
 
+    // Now that the workers have their own CPUs, I move my accept loop to ACCEPT_CPUS
+    // (if set), ideally the cores that take the NIC's interrupts.
+    apply_accept_affinity();
+
     // 5. Main Loop: This is where I spend most of my time.
     int current_worker = 0;
+
+    // In reuseport mode the workers accept on their own, so I just supervise
+    // and sleep until a signal tells me to stop. A worker that exits early (say, because it
+    // couldn't bind its listener) wakes me up too, and I report it.
+    int workers_left = config.num_workers;
+    while (server_running && server_socket < 0) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) continue; // Ctrl+C: server_running tells me what to do.
+            break;
+        }
+        // A worker that failed or was killed is worth a line whatever the reason. A clean
+        // exit is only news while I'm still running: during shutdown it's what I asked for.
+        if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "Worker (PID: %d) exited with status %d.\n", pid, WEXITSTATUS(status));
+        } else if (WIFSIGNALED(status)) {
+            fprintf(stderr, "Worker (PID: %d) was killed by signal %d.\n", pid, WTERMSIG(status));
+        } else if (server_running) {
+            fprintf(stderr, "Worker (PID: %d) exited unexpectedly.\n", pid);
+        }
+        if (--workers_left == 0) {
+            fprintf(stderr, "No workers left, shutting down.\n");
+            break;
+        }
+    }
     
-    while (server_running) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
+    int batch_size = config.accept_batch;
+    if (batch_size < 1) batch_size = 1;
+    if (batch_size > MAX_ACCEPT_BATCH) batch_size = MAX_ACCEPT_BATCH;
 
-        // I'm blocking here until a client connects.
-        int client_fd = accept(server_socket, (struct sockaddr *)&client_addr, &client_len);
-        
-        // If accept failed, I need to check why.
-        if (client_fd < 0) {
+    if (server_socket >= 0 && config.io_model == IO_MODEL_URING &&
+        uring_accept_loop(server_socket, worker_pipes, &current_worker, batch_size) != 0) {
+        fprintf(stderr, "io_uring unavailable, the master falls back to poll + accept4.\n");
+    }
+
+    while (server_running && server_socket >= 0) {
+        // I'm blocking here until at least one client is waiting.
+        struct pollfd pfd = {.fd = server_socket, .events = POLLIN};
+        if (poll(&pfd, 1, -1) < 0) {
             // If it was just a signal (like Ctrl+C), I'll loop back and check server_running.
             if (errno == EINTR) continue; 
-            perror("accept");
+            perror("poll");
             continue;
         }
 
-        // Now I'm handing off the connection to a worker.
-        // I use Round-Robin scheduling to be fair.
-        send_fd(worker_pipes[current_worker], client_fd);
-        
-        // CRITICAL: I must close my copy of the file descriptor.
-        // If I don't, I'll run out of file descriptors and the connection will never close.
-        close(client_fd);
-        current_worker = (current_worker + 1) % config.num_workers;
+        dispatch_backlog(server_socket, worker_pipes, &current_worker, batch_size);
     }
 
     // 6. Shutdown Sequence
@@ -184,6 +456,9 @@ int start_master_server()
     // I'm waiting for all my children to finish their homework and go to bed.
     while (wait(NULL) > 0);
 
+    // Nobody uses the shared cache anymore.
+    if (config.cache_shared) cache_destroy();
+
     // I need to stop the stats thread too.
     // Since it's probably sleeping, I'll have to cancel it.
     pthread_cancel(stats_tid);
@@ -191,7 +466,7 @@ int start_master_server()
 
     // Cleaning up the last bits of memory.
     free(worker_pipes);
-    close(server_socket);
+    if (server_socket >= 0) close(server_socket);
 
     printf("Server stopped cleanly.\n");
     return 0;
@@ -5,4 +5,8 @@
 // I'm declaring it here so other files (like main.c) can call it.
 int start_master_server();
 
+// I create a listening socket on the given port, optionally with SO_REUSEPORT.
+// I return the socket, or -1 if it couldn't be bound.
+int create_server_socket(int port, int reuse_port);
+
 #endif 
\ No newline at end of file
@@ -0,0 +1,154 @@
+#define _GNU_SOURCE // I need this for syscall().
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mpmc_ring.h"
+
+// glibc has no futex() wrapper, so I make the syscall myself.
+static void futex_wait(mpmc_ring_t *r, unsigned *addr, unsigned expected, const struct timespec *timeout)
+{
+    int op = r->shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE;
+    syscall(SYS_futex, addr, op, expected, timeout, NULL, 0);
+}
+
+// I read the monotonic clock in milliseconds.
+static long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static void futex_wake(mpmc_ring_t *r, unsigned *addr, int count)
+{
+    int op = r->shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE;
+    syscall(SYS_futex, addr, op, count, NULL, NULL, 0);
+}
+
+static unsigned round_capacity(unsigned capacity)
+{
+    unsigned size = 2;
+    while (size < capacity) size <<= 1;
+    return size;
+}
+
+size_t mpmc_ring_size(unsigned capacity)
+{
+    return sizeof(mpmc_ring_t) + sizeof(mpmc_cell_t) * round_capacity(capacity);
+}
+
+void mpmc_ring_init(mpmc_ring_t *r, unsigned capacity, int shared)
+{
+    unsigned size = round_capacity(capacity);
+    r->enqueue_pos = 0;
+    r->dequeue_pos = 0;
+    r->not_empty = 0;
+    r->sleepers = 0;
+    r->closed = 0;
+    r->shared = shared;
+    r->mask = size - 1;
+    // Cell i is ready for the producer that claims position i.
+    for (unsigned i = 0; i < size; i++) {
+        r->cells[i].seq = i;
+    }
+}
+
+int mpmc_ring_try_push(mpmc_ring_t *r, int value)
+{
+    if (__atomic_load_n(&r->closed, __ATOMIC_RELAXED)) return -1;
+
+    unsigned pos = __atomic_load_n(&r->enqueue_pos, __ATOMIC_RELAXED);
+    mpmc_cell_t *cell;
+    while (1) {
+        cell = &r->cells[pos & r->mask];
+        unsigned seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        int diff = (int)(seq - pos);
+        if (diff == 0) {
+            // The cell is free for this position; I try to claim the position.
+            if (__atomic_compare_exchange_n(&r->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (diff < 0) {
+            return -1; // The consumer of the previous lap hasn't freed this cell: the ring is full.
+        } else {
+            pos = __atomic_load_n(&r->enqueue_pos, __ATOMIC_RELAXED); // Someone beat me to it.
+        }
+    }
+    cell->value = value;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+    // A consumer going to sleep either sees my value, or I see it asleep and wake it.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->sleepers, __ATOMIC_RELAXED) > 0) {
+        __atomic_add_fetch(&r->not_empty, 1, __ATOMIC_RELEASE);
+        futex_wake(r, &r->not_empty, 1);
+    }
+    return 0;
+}
+
+int mpmc_ring_try_pop(mpmc_ring_t *r, int *value)
+{
+    unsigned pos = __atomic_load_n(&r->dequeue_pos, __ATOMIC_RELAXED);
+    mpmc_cell_t *cell;
+    while (1) {
+        cell = &r->cells[pos & r->mask];
+        unsigned seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        int diff = (int)(seq - (pos + 1));
+        if (diff == 0) {
+            // The cell holds the value for this position; I try to claim it.
+            if (__atomic_compare_exchange_n(&r->dequeue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (diff < 0) {
+            return -1; // The producer hasn't filled this cell yet: the ring is empty.
+        } else {
+            pos = __atomic_load_n(&r->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    *value = cell->value;
+    // I hand the cell to the producer of the next lap.
+    __atomic_store_n(&cell->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int mpmc_ring_pop(mpmc_ring_t *r, int timeout_ms)
+{
+    int value;
+    long deadline = timeout_ms >= 0 ? now_ms() + timeout_ms : 0;
+    while (1) {
+        if (mpmc_ring_try_pop(r, &value) == 0) return value;
+
+        // The ring looks empty. I announce that I'm going to sleep, then look once more,
+        // so a producer either sees me or I see its value.
+        __atomic_add_fetch(&r->sleepers, 1, __ATOMIC_SEQ_CST);
+        unsigned seen = __atomic_load_n(&r->not_empty, __ATOMIC_SEQ_CST);
+        if (mpmc_ring_try_pop(r, &value) == 0) {
+            __atomic_sub_fetch(&r->sleepers, 1, __ATOMIC_RELAXED);
+            return value;
+        }
+        if (__atomic_load_n(&r->closed, __ATOMIC_SEQ_CST)) {
+            // Closed and drained: time to stop.
+            __atomic_sub_fetch(&r->sleepers, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+        if (timeout_ms < 0) {
+            futex_wait(r, &r->not_empty, seen, NULL);
+        } else {
+            long left = deadline - now_ms();
+            if (left <= 0) {
+                __atomic_sub_fetch(&r->sleepers, 1, __ATOMIC_RELAXED);
+                return MPMC_RING_TIMED_OUT;
+            }
+            struct timespec ts = {.tv_sec = left / 1000, .tv_nsec = (left % 1000) * 1000000};
+            futex_wait(r, &r->not_empty, seen, &ts);
+        }
+        __atomic_sub_fetch(&r->sleepers, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void mpmc_ring_close(mpmc_ring_t *r)
+{
+    __atomic_store_n(&r->closed, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&r->not_empty, 1, __ATOMIC_SEQ_CST);
+    futex_wake(r, &r->not_empty, INT_MAX);
+}
@@ -0,0 +1,50 @@
+#ifndef MPMC_RING_H
+#define MPMC_RING_H // I'm using include guards to prevent multiple inclusion.
+
+#include <stddef.h> // I need size_t.
+
+// This is a bounded multi-producer/multi-consumer ring of ints (Vyukov's design).
+// Every cell carries a sequence number that tells producers and consumers whose turn it is,
+// so a push or pop is one compare-and-swap on a position plus one store to the cell.
+// Nobody takes a lock; consumers only sleep (on a futex) when the ring is empty.
+typedef struct {
+    unsigned seq;   // Whose turn it is: pos for the producer, pos + 1 for the consumer.
+    int value;      // The fd itself.
+} mpmc_cell_t;
+
+typedef struct {
+    unsigned enqueue_pos __attribute__((aligned(64))); // The next position a producer claims.
+    unsigned dequeue_pos __attribute__((aligned(64))); // The next position a consumer claims.
+    unsigned not_empty __attribute__((aligned(64)));   // Futex word consumers sleep on.
+    int sleepers;                                      // How many consumers are asleep.
+    int closed;                                        // Set once: pops fail after the ring drains.
+    int shared;                                        // Does the ring live in memory shared between processes?
+    unsigned mask;                                     // The capacity minus one (it's a power of two).
+    mpmc_cell_t cells[];                               // The ring itself follows the header.
+} mpmc_ring_t;
+
+// I tell the caller how many bytes a ring for at least 'capacity' items needs.
+// I round the capacity up to a power of two.
+size_t mpmc_ring_size(unsigned capacity);
+
+// I set up a ring in memory of mpmc_ring_size(capacity) bytes.
+// 'shared' must be set if the memory is shared between processes (it picks the futex flavour).
+void mpmc_ring_init(mpmc_ring_t *r, unsigned capacity, int shared);
+
+// I add a value without ever blocking. I return -1 if the ring is full or closed.
+int mpmc_ring_try_push(mpmc_ring_t *r, int value);
+
+// I take a value without blocking. I return -1 if the ring is empty.
+int mpmc_ring_try_pop(mpmc_ring_t *r, int *value);
+
+// mpmc_ring_pop() returns this when nothing arrived within the timeout.
+#define MPMC_RING_TIMED_OUT -2
+
+// I take a value, sleeping while the ring is empty (at most timeout_ms, or forever if it's -1).
+// I return -1 once the ring is closed and drained.
+int mpmc_ring_pop(mpmc_ring_t *r, int timeout_ms);
+
+// I close the ring and wake every sleeping consumer.
+void mpmc_ring_close(mpmc_ring_t *r);
+
+#endif
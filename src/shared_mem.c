@@ -1,3 +1,4 @@
+#define _DEFAULT_SOURCE
 #include "shared_mem.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,20 +7,22 @@
 #include <sys/mman.h>
 #include <sys/stat.h>        
 #include <fcntl.h>           
+#include <stdint.h>
 
 // * Global pointers to shared memory regions
 // These pointers will be accessible from all processes (master and workers).
 connection_queue_t *queue = NULL; // I store client connections here.
 server_stats_t *stats = NULL;     // I keep server statistics here.
+worker_load_t *worker_loads = NULL; // I keep per-worker load counters here.
 
 // I need to initialize the shared connection queue.
-// This creates a circular buffer in shared memory that all processes can access.
+// This creates a lock-free ring in shared memory that all processes can access.
 void init_shared_queue(int max_queue_size)
 {
     // First, I calculate how much memory I need.
-    // I need space for the queue structure PLUS space for the actual connections array.
-    size_t queue_data_size = sizeof(int) * max_queue_size;
-    size_t total_size = sizeof(connection_queue_t) + queue_data_size;
+    // I need space for the queue structure PLUS space for the ring that holds the connections
+    // (plus a cache line of slack, so I can line the ring up with one).
+    size_t total_size = sizeof(connection_queue_t) + 64 + mpmc_ring_size(max_queue_size);
 
     // I use mmap with MAP_ANONYMOUS to allocate shared memory that isn't backed by a file.
     void *mem_block = mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
@@ -31,39 +34,18 @@ void init_shared_queue(int max_queue_size)
 
     // Now I set up my queue structure.
     queue = (connection_queue_t *)mem_block;
-    // The connections array starts right after the queue structure in memory.
-    queue->connections = (int *)(queue + 1);
-
-    // I initialize the circular buffer indices.
-    queue->head = 0;  // This is where I'll take connections from.
-    queue->tail = 0;  // This is where I'll add new connections.
-    queue->max_size = max_queue_size; // I remember my capacity.
     queue->shutting_down = 0; // I start with the queue active.
-    
-    // Now I need to initialize a mutex that works across processes.
-    pthread_mutexattr_t mutex_attr;
-    pthread_mutexattr_init(&mutex_attr);
-    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED); // This is key!
-    if (pthread_mutex_init(&queue->mutex, &mutex_attr) != 0) {
-        perror("mutex init");
-        exit(1);
-    }
-    pthread_mutexattr_destroy(&mutex_attr);
+
+    // The ring starts right after the queue structure, on its own cache line.
+    // It's shared between processes, so its futexes can't be private ones.
+    queue->ring = (mpmc_ring_t *)(((uintptr_t)(queue + 1) + 63) & ~(uintptr_t)63);
+    mpmc_ring_init(queue->ring, max_queue_size, 1);
 
     // I also need a semaphore for logging synchronization.
     if (sem_init(&queue->log_mutex, 1, 1) != 0) {
         perror("sem init log_mutex");
         exit(1);
     }
-    
-    // I set up the producer-consumer semaphores.
-    // empty_slots starts at max_size (all slots are empty).
-    // filled_slots starts at 0 (no connections yet).
-    if (sem_init(&queue->empty_slots, 1, max_queue_size) != 0 ||
-        sem_init(&queue->filled_slots, 1, 0) != 0) {
-        perror("sem init");
-        exit(1);
-    }
 }
 
 // I also need shared memory for server statistics.
@@ -98,6 +80,31 @@ void init_shared_stats()
     }
 }
 
+// I need shared memory for the per-worker load counters.
+// The master creates this before forking, so every worker sees the same array.
+void init_worker_loads(int num_workers)
+{
+    void *mem_block = mmap(NULL, sizeof(worker_load_t) * num_workers,
+                           PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (mem_block == MAP_FAILED) {
+        perror("mmap worker loads failed");
+        exit(1);
+    }
+
+    // Anonymous mappings come back zeroed, so every counter already starts at 0.
+    worker_loads = (worker_load_t *)mem_block;
+}
+
+// I add up everything that is keeping a worker busy.
+int worker_load(const worker_load_t *load)
+{
+    return __atomic_load_n(&load->in_transit, __ATOMIC_RELAXED) +
+           __atomic_load_n(&load->queue_depth, __ATOMIC_RELAXED) +
+           __atomic_load_n(&load->active_connections, __ATOMIC_RELAXED);
+}
+
 // This function adds a client connection to the shared queue.
 // I'm the producer in the producer-consumer pattern.
 int enqueue(int client_socket) {
@@ -106,56 +113,13 @@ int enqueue(int client_socket) {
         return -1; // If we are, I reject new connections.
     }
 
-    // I try to get an empty slot without blocking.
     // If the queue is full, I return immediately.
-    if (sem_trywait(&queue->empty_slots) != 0) {
-        if (errno == EAGAIN) {
-            return -1; // Queue is full.
-        }
-        perror("sem_trywait");
-        return -1; 
-    }
-
-    // Now I have permission to add to the queue.
-    pthread_mutex_lock(&queue->mutex);
-
-    // I add the client socket to the tail position.
-    queue->connections[queue->tail] = client_socket;
-    // I move the tail forward, wrapping around if needed.
-    queue->tail = (queue->tail + 1) % queue->max_size;
-
-    pthread_mutex_unlock(&queue->mutex);
-    
-    // I signal that there's now a new item in the queue.
-    sem_post(&queue->filled_slots);
-    
-    return 0; // Success!
+    return mpmc_ring_try_push(queue->ring, client_socket);
 }
 
 // This function takes a client connection from the shared queue.
 // I'm the consumer in the producer-consumer pattern.
+// This blocks while the queue is empty, and returns -1 once we're shutting down and it's drained.
 int dequeue() {
-    // I wait for a filled slot. This will block if the queue is empty.
-    sem_wait(&queue->filled_slots);
-    
-    // Now I can safely modify the queue.
-    pthread_mutex_lock(&queue->mutex);
-
-    // I check if I woke up because we're shutting down.
-    if (queue->shutting_down && queue->head == queue->tail) {
-        pthread_mutex_unlock(&queue->mutex);
-        return -1; // Queue is empty and we're shutting down.
-    }
-
-    // I take the connection from the head position.
-    int client_socket = queue->connections[queue->head];
-    // I move the head forward, wrapping around if needed.
-    queue->head = (queue->head + 1) % queue->max_size;
-
-    pthread_mutex_unlock(&queue->mutex);
-    
-    // I signal that there's now an empty slot available.
-    sem_post(&queue->empty_slots);
-    
-    return client_socket; // Here's the connection!
-}
\ No newline at end of file
+    return mpmc_ring_pop(queue->ring, -1);
+}
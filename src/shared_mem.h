@@ -2,21 +2,13 @@
 #define SHARED_MEM_H // I'm using include guards to prevent multiple inclusion.
 
 #include <semaphore.h> // I need semaphores for synchronization.
-#include <pthread.h>   // I need pthread_mutex_t for mutual exclusion.
+#include "mpmc_ring.h" // I need the lock-free ring behind the connection queue.
 
 // This structure represents my shared connection queue.
-// It's a circular buffer that lives in shared memory so all processes can access it.
+// It's a lock-free ring that lives in shared memory so all processes can access it.
 typedef struct
 {
-    int *connections;        // I store client file descriptors in this array.
-    int head;               // This is where I take connections from (consumer side).
-    int tail;               // This is where I add new connections (producer side).
-    int max_size;           // I need to know how many connections I can hold.
-
-    // These are my synchronization primitives:
-    sem_t empty_slots;      // I count how many empty slots are available.
-    sem_t filled_slots;     // I count how many slots have connections waiting.
-    pthread_mutex_t mutex;  // I protect the head/tail indices from concurrent access.
+    mpmc_ring_t *ring;      // I store client file descriptors in this ring (it follows the structure).
     sem_t log_mutex;        // I need a separate lock for logging operations.
     int shutting_down;      // This flag tells workers when it's time to stop.
 } connection_queue_t;
@@ -35,10 +27,24 @@ typedef struct
     sem_t mutex;                  // I need a lock to protect these counters.
 } server_stats_t;
 
+// This structure holds the load that one worker publishes for the master's dispatcher.
+// I update these counters with atomic builtins instead of a semaphore,
+// because the master reads them on every connection it hands out.
+// Every slot gets a cache line of its own: a worker bumping its counters then never
+// invalidates the line holding another worker's, which the master is reading.
+typedef struct
+{
+    int in_transit;               // I count fds the master has sent that I haven't received yet.
+    int queue_depth;              // I count connections waiting in this worker's local queue.
+    int active_connections;       // I count connections this worker's threads are serving right now.
+    int pool_threads;             // I report how many threads my elastic pool has right now.
+} __attribute__((aligned(64))) worker_load_t;
+
 // I'm declaring these as extern so other files can access them.
 // They're defined in shared_mem.c and point to the shared memory regions.
 extern connection_queue_t *queue;
 extern server_stats_t *stats;
+extern worker_load_t *worker_loads; // One entry per worker process.
 
 // These are my function declarations:
 
@@ -48,6 +54,12 @@ void init_shared_queue(int max_queue_size);
 // I need to initialize the shared statistics structure.
 void init_shared_stats();
 
+// I need one load slot per worker, shared between the master and all workers.
+void init_worker_loads(int num_workers);
+
+// This is how I read a worker's current load (waiting + in-flight + active connections).
+int worker_load(const worker_load_t *load);
+
 // I use this to add a client connection to the queue.
 int enqueue(int client_socket);
 
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE // I need this for clock_gettime() and pthread_condattr_setclock().
+
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,9 +18,39 @@
 extern server_config_t config;
 extern connection_queue_t *queue;
 
+// I keep my own count of waiting fds (the pool grows on it) and mirror it for the master.
+static void depth_add(local_queue_t *q, int n)
+{
+    __atomic_add_fetch(&q->depth, n, __ATOMIC_RELAXED);
+    if (q->published_depth) __atomic_add_fetch(q->published_depth, n, __ATOMIC_RELAXED);
+}
+
+// I read the monotonic clock in milliseconds.
+static long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// I turn a timeout into an absolute deadline for pthread_cond_timedwait()
+// (my condition variable runs on the monotonic clock).
+static struct timespec deadline_after(int timeout_ms)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
 // This is where I initialize my local queue for this worker process.
 // Each worker has its own queue that feeds its thread pool.
-int local_queue_init(local_queue_t *q, int max_size)
+int local_queue_init(local_queue_t *q, int max_size, int type, int consumers)
 {
     // I allocate memory for the file descriptor array.
     q->fds = malloc(sizeof(int) * max_size);
@@ -29,10 +61,61 @@ int local_queue_init(local_queue_t *q, int max_size)
     q->tail = 0;  // This is where I'll add new connections.
     q->max_size = max_size; // I remember my capacity.
     q->shutting_down = 0; // I start with the queue active.
+    q->published_depth = NULL; // The worker points this at its shared load slot.
+    q->handler = handle_client; // By default my threads serve whole connections.
+    q->type = type;
+    q->ring = NULL;
+    q->rings = NULL;
+    q->ring_count = 0;
+    q->next_ring = 0;
+    q->next_owner = 0;
+    q->sleepers = 0;
+    q->depth = 0;
+    q->min_threads = 0;
+    q->max_threads = 0;
+    q->idle_timeout_ms = -1;
+    q->live_threads = 0;
+    q->idle_threads = 0;
+    q->last_dequeue_ms = now_ms();
+    q->published_threads = NULL;
+
+    if (type == QUEUE_MPMC) {
+        // The ring keeps its positions on separate cache lines, so it has to start on one.
+        size_t bytes = (mpmc_ring_size(max_size) + 63) & ~(size_t)63;
+        q->ring = aligned_alloc(64, bytes);
+        if (!q->ring) return -1;
+        mpmc_ring_init(q->ring, max_size, 0);
+    }
+
+    if (type == QUEUE_STEALING) {
+        // Every thread gets its own ring. I split my capacity between them,
+        // rounded up to a power of two so wrapping around is just a mask.
+        q->ring_count = consumers > 0 ? consumers : 1;
+        unsigned per_ring = 2;
+        while ((int)per_ring * q->ring_count < max_size) per_ring <<= 1;
+
+        q->rings = aligned_alloc(64, sizeof(ws_ring_t) * q->ring_count);
+        if (!q->rings) return -1;
+        memset(q->rings, 0, sizeof(ws_ring_t) * q->ring_count);
+        for (int i = 0; i < q->ring_count; i++) {
+            q->rings[i].slots = malloc(sizeof(int) * per_ring);
+            if (!q->rings[i].slots) return -1;
+            q->rings[i].mask = per_ring - 1;
+        }
+    }
     
     // I need to initialize the mutex and condition variable for synchronization.
+    // Idle threads wait with a timeout, and I don't want clock changes to mess with it.
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
     if (pthread_mutex_init(&q->mutex, NULL) != 0) return -1;
-    if (pthread_cond_init(&q->cond, NULL) != 0) return -1;
+    if (pthread_cond_init(&q->cond, &cond_attr) != 0) return -1;
+    pthread_condattr_destroy(&cond_attr);
+
+    // These let the worker wait for the (detached) pool threads to finish.
+    if (pthread_mutex_init(&q->pool_lock, NULL) != 0) return -1;
+    if (pthread_cond_init(&q->pool_done, NULL) != 0) return -1;
     
     return 0; // Success!
 }
@@ -43,14 +126,110 @@ void local_queue_destroy(local_queue_t *q)
     if (!q) return; // If there's no queue, I have nothing to do.
     
     free(q->fds); // I free the array of file descriptors.
+    for (int i = 0; i < q->ring_count; i++) free(q->rings[i].slots);
+    free(q->rings);
+    free(q->ring);
     pthread_mutex_destroy(&q->mutex); // I destroy the mutex.
     pthread_cond_destroy(&q->cond); // I destroy the condition variable.
+    pthread_mutex_destroy(&q->pool_lock);
+    pthread_cond_destroy(&q->pool_done);
+}
+
+// * Work-Stealing Rings
+// I'm the ring's only producer, so the tail is mine; I just need to see how far the head got.
+static int ring_push(ws_ring_t *r, int fd)
+{
+    unsigned tail = r->tail;
+    unsigned head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    if (tail - head > r->mask) return -1; // The ring is full.
+
+    __atomic_store_n(&r->slots[tail & r->mask], fd, __ATOMIC_RELAXED);
+    // Sequentially consistent, so a thread going to sleep either sees this fd or is seen by me.
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+// The owner and thieves all take from the head. Whoever wins the compare-and-swap gets the fd;
+// the others just try again (if they read a slot that was being reused, their CAS fails anyway).
+static int ring_pop(ws_ring_t *r)
+{
+    unsigned head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    while (1) {
+        unsigned tail = __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST);
+        if (head == tail) return -1; // Nothing here.
+
+        int fd = __atomic_load_n(&r->slots[head & r->mask], __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&r->head, &head, head + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return fd;
+        }
+        // 'head' now holds the new value, so I go around again.
+    }
+}
+
+// Each pool thread remembers which ring is its own.
+static _Thread_local int my_ring = -1;
+
+// I look in my own ring first and then steal from my siblings, starting with my neighbour.
+static int steal_any(local_queue_t *q)
+{
+    int start = my_ring >= 0 ? my_ring : 0;
+    for (int i = 0; i < q->ring_count; i++) {
+        int fd = ring_pop(&q->rings[(start + i) % q->ring_count]);
+        if (fd >= 0) return fd;
+    }
+    return -1;
+}
+
+static int rings_empty(local_queue_t *q)
+{
+    for (int i = 0; i < q->ring_count; i++) {
+        ws_ring_t *r = &q->rings[i];
+        if (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) != __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// I spread fds over the rings in turn, skipping any that are full.
+static int rings_push(local_queue_t *q, int fd)
+{
+    for (int i = 0; i < q->ring_count; i++) {
+        int r = q->next_ring;
+        q->next_ring = (q->next_ring + 1) % q->ring_count;
+        if (ring_push(&q->rings[r], fd) == 0) {
+            depth_add(q, 1);
+            return 0;
+        }
+    }
+    return -1; // Every ring is full.
+}
+
+// I only touch the mutex when someone is actually asleep.
+static void wake_sleepers(local_queue_t *q, int count)
+{
+    if (count == 0 || __atomic_load_n(&q->sleepers, __ATOMIC_SEQ_CST) == 0) return;
+    pthread_mutex_lock(&q->mutex);
+    if (count == 1) pthread_cond_signal(&q->cond);
+    else pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
 }
 
 // This function adds a client connection to the worker's local queue.
 // I'm the producer (worker main thread adds, worker threads consume).
-int local_queue_enqueue(local_queue_t *q, int client_fd)
+static int enqueue_one(local_queue_t *q, int client_fd)
 {
+    if (q->type == QUEUE_MPMC) {
+        if (mpmc_ring_try_push(q->ring, client_fd) != 0) return -1; // Queue full.
+        depth_add(q, 1);
+        return 0;
+    }
+    if (q->type == QUEUE_STEALING) {
+        if (rings_push(q, client_fd) != 0) return -1; // Queue full.
+        wake_sleepers(q, 1);
+        return 0;
+    }
+
     pthread_mutex_lock(&q->mutex); // I need exclusive access to modify the queue.
     
     // First, I check if the queue is full.
@@ -64,6 +243,7 @@ int local_queue_enqueue(local_queue_t *q, int client_fd)
     // There's space, so I add the connection.
     q->fds[q->tail] = client_fd;
     q->tail = next; // I move the tail forward.
+    depth_add(q, 1);
     
     // Now I signal any waiting worker threads that there's work to do.
     pthread_cond_signal(&q->cond);
@@ -72,15 +252,98 @@ int local_queue_enqueue(local_queue_t *q, int client_fd)
     return 0; // Success!
 }
 
+// This function adds a whole burst of connections at once.
+// The master (or my own accept loop) hands me fds in batches, so I take the lock once
+// and wake as many threads as I have new work for.
+static int enqueue_many(local_queue_t *q, const int *client_fds, int count)
+{
+    if (q->type == QUEUE_MPMC) {
+        int pushed = 0;
+        while (pushed < count && mpmc_ring_try_push(q->ring, client_fds[pushed]) == 0) pushed++;
+        depth_add(q, pushed);
+        return pushed;
+    }
+    if (q->type == QUEUE_STEALING) {
+        int pushed = 0;
+        while (pushed < count && rings_push(q, client_fds[pushed]) == 0) pushed++;
+        wake_sleepers(q, pushed);
+        return pushed;
+    }
+
+    pthread_mutex_lock(&q->mutex);
+
+    int queued = 0;
+    while (queued < count) {
+        int next = (q->tail + 1) % q->max_size;
+        if (next == q->head) break; // The queue is full, the rest will be rejected.
+        q->fds[q->tail] = client_fds[queued++];
+        q->tail = next;
+    }
+    depth_add(q, queued);
+
+    if (queued == 1) pthread_cond_signal(&q->cond);
+    else if (queued > 1) pthread_cond_broadcast(&q->cond);
+
+    pthread_mutex_unlock(&q->mutex);
+    return queued;
+}
+
 // This function takes a client connection from the worker's local queue.
 // Worker threads call this to get work to do.
-int local_queue_dequeue(local_queue_t *q)
+int local_queue_dequeue(local_queue_t *q, int timeout_ms)
 {
+    if (q->type == QUEUE_MPMC) {
+        // The ring drains before it reports shutdown, just like the mutex queue.
+        int fd = mpmc_ring_pop(q->ring, timeout_ms);
+        if (fd >= 0) depth_add(q, -1);
+        return fd == MPMC_RING_TIMED_OUT ? QUEUE_TIMED_OUT : fd;
+    }
+    if (q->type == QUEUE_STEALING) {
+        while (1) {
+            int fd = steal_any(q);
+            if (fd >= 0) {
+                depth_add(q, -1);
+                return fd;
+            }
+
+            // Every ring looked empty, so I get ready to sleep. I announce myself first and
+            // look once more, so a producer either sees me asleep or I see its fd.
+            pthread_mutex_lock(&q->mutex);
+            __atomic_add_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+            int timed_out = 0;
+            if (rings_empty(q)) {
+                if (q->shutting_down) {
+                    // Like the mutex queue: I only stop once everything queued has been served.
+                    __atomic_sub_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+                    pthread_mutex_unlock(&q->mutex);
+                    return -1;
+                }
+                if (timeout_ms < 0) {
+                    pthread_cond_wait(&q->cond, &q->mutex);
+                } else {
+                    struct timespec deadline = deadline_after(timeout_ms);
+                    timed_out = (pthread_cond_timedwait(&q->cond, &q->mutex, &deadline) != 0);
+                }
+            }
+            __atomic_sub_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&q->mutex);
+            if (timed_out && rings_empty(q)) return QUEUE_TIMED_OUT;
+        }
+    }
+
     pthread_mutex_lock(&q->mutex);
     
     // If the queue is empty AND we're not shutting down, I wait.
+    struct timespec deadline;
+    if (timeout_ms >= 0) deadline = deadline_after(timeout_ms);
     while (q->head == q->tail && !q->shutting_down) {
-        pthread_cond_wait(&q->cond, &q->mutex); // I sleep until there's work.
+        if (timeout_ms < 0) {
+            pthread_cond_wait(&q->cond, &q->mutex); // I sleep until there's work.
+        } else if (pthread_cond_timedwait(&q->cond, &q->mutex, &deadline) != 0 && q->head == q->tail) {
+            // Nothing came in time. The caller decides whether to retire.
+            pthread_mutex_unlock(&q->mutex);
+            return QUEUE_TIMED_OUT;
+        }
     }
     
     // When I wake up, I check why.
@@ -93,29 +356,183 @@ int local_queue_dequeue(local_queue_t *q)
     // There's work to do! I take a connection from the head.
     int fd = q->fds[q->head];
     q->head = (q->head + 1) % q->max_size; // I move the head forward.
+    depth_add(q, -1);
     
     pthread_mutex_unlock(&q->mutex);
     return fd; // Here's the connection to handle!
 }
 
+// * Elastic Pool
+// The pool starts with min_threads. It adds a thread (up to max_threads) when more fds are
+// waiting than there are idle threads to take them, or when nobody has taken work for
+// POOL_GROW_WAIT_MS while some is waiting. I check after every enqueue, after every dequeue
+// that leaves work behind (so a backlog keeps growing the pool while every thread is busy
+// with a slow client and nothing new arrives), and whenever the worker's loop calls
+// local_queue_check_growth(). Threads above min_threads retire after idle_timeout_ms without work.
+
+// The caller has already counted the new thread in live_threads; I take it back if it can't start.
+static int spawn_thread(local_queue_t *q)
+{
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    // I never join pool threads one by one, since they may retire on their own.
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_t tid;
+    int rc = pthread_create(&tid, &attr, worker_thread, q);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        __atomic_sub_fetch(&q->live_threads, 1, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+    if (q->published_threads) __atomic_add_fetch(q->published_threads, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void pool_maybe_grow(local_queue_t *q)
+{
+    int live = __atomic_load_n(&q->live_threads, __ATOMIC_RELAXED);
+    if (live >= q->max_threads || q->shutting_down) return;
+
+    int depth = __atomic_load_n(&q->depth, __ATOMIC_RELAXED);
+    if (depth <= 0) return;
+    int idle = __atomic_load_n(&q->idle_threads, __ATOMIC_RELAXED);
+    long stuck_ms = now_ms() - __atomic_load_n(&q->last_dequeue_ms, __ATOMIC_RELAXED);
+    if (depth <= idle && stuck_ms <= POOL_GROW_WAIT_MS) return;
+
+    // The producer and every pool thread may get here at once, so I claim the new
+    // thread's place first: only one of us can take the last one below max_threads.
+    while (live < q->max_threads) {
+        if (__atomic_compare_exchange_n(&q->live_threads, &live, live + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            spawn_thread(q);
+            return;
+        }
+    }
+}
+
+void local_queue_check_growth(local_queue_t *q)
+{
+    if (q->max_threads > 0) pool_maybe_grow(q);
+}
+
+int local_queue_start_threads(local_queue_t *q, int min_threads, int max_threads, int idle_timeout_ms, int *published_threads)
+{
+    q->min_threads = min_threads;
+    q->max_threads = max_threads > min_threads ? max_threads : min_threads;
+    // A fixed-size pool never retires anyone, so its threads can sleep without a timeout.
+    q->idle_timeout_ms = (q->max_threads > q->min_threads) ? idle_timeout_ms : -1;
+    q->published_threads = published_threads;
+
+    int started = 0;
+    for (int i = 0; i < min_threads; i++) {
+        __atomic_add_fetch(&q->live_threads, 1, __ATOMIC_SEQ_CST);
+        if (spawn_thread(q) != 0) {
+            perror("pthread_create");
+            break;
+        }
+        started++;
+    }
+    return started;
+}
+
+void local_queue_join_threads(local_queue_t *q)
+{
+    pthread_mutex_lock(&q->pool_lock);
+    while (__atomic_load_n(&q->live_threads, __ATOMIC_SEQ_CST) > 0) {
+        pthread_cond_wait(&q->pool_done, &q->pool_lock);
+    }
+    pthread_mutex_unlock(&q->pool_lock);
+}
+
+// A thread that waited too long for work asks to retire. I only let it go while the
+// pool is above its minimum, and I count it out right here so two threads can't both
+// take the last spare place.
+static int pool_try_retire(local_queue_t *q)
+{
+    int live = __atomic_load_n(&q->live_threads, __ATOMIC_SEQ_CST);
+    while (live > q->min_threads) {
+        if (__atomic_compare_exchange_n(&q->live_threads, &live, live - 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// This is how the worker (or the event loop) adds a client connection.
+// I'm the producer (worker main thread adds, worker threads consume).
+int local_queue_enqueue(local_queue_t *q, int client_fd)
+{
+    int rc = enqueue_one(q, client_fd);
+    if (q->max_threads > 0) pool_maybe_grow(q);
+    return rc;
+}
+
+// This adds a burst of connections and then checks whether the pool should grow.
+int local_queue_enqueue_batch(local_queue_t *q, const int *client_fds, int count)
+{
+    int queued = enqueue_many(q, client_fds, count);
+    if (q->max_threads > 0) pool_maybe_grow(q);
+    return queued;
+}
+
+// When the worker shuts down, I wake every thread so they can drain the queue and exit.
+void local_queue_shutdown(local_queue_t *q)
+{
+    pthread_mutex_lock(&q->mutex);
+    q->shutting_down = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+    if (q->ring) mpmc_ring_close(q->ring);
+}
+
 // This is the entry point for each worker thread in the pool.
 // These threads continuously process client connections.
 void *worker_thread(void *arg)
 {
     local_queue_t *q = (local_queue_t *)arg; // I get my queue from the argument.
+
+    // In stealing mode I claim a ring of my own (the first threads get one each).
+    if (q->ring_count > 0) {
+        my_ring = __atomic_fetch_add(&q->next_owner, 1, __ATOMIC_RELAXED) % q->ring_count;
+    }
     
+    int retired = 0;
     while (1) // I keep running until told to stop.
     {
         // I wait for a connection to become available.
-        int client_socket = local_queue_dequeue(q);
-        
+        __atomic_add_fetch(&q->idle_threads, 1, __ATOMIC_RELAXED);
+        int client_socket = local_queue_dequeue(q, q->idle_timeout_ms);
+        __atomic_sub_fetch(&q->idle_threads, 1, __ATOMIC_RELAXED);
+
+        if (client_socket == QUEUE_TIMED_OUT) {
+            // I've been idle for a while. If the pool can spare me, I retire.
+            if (pool_try_retire(q)) {
+                retired = 1;
+                break;
+            }
+            continue;
+        }
         if (client_socket < 0) {
             break; // A negative value means "shutdown", so I exit the loop.
         }
+        __atomic_store_n(&q->last_dequeue_ms, now_ms(), __ATOMIC_RELAXED);
+
+        // If work is still waiting behind the fd I took, the others may all be busy.
+        if (q->max_threads > 0) pool_maybe_grow(q);
 
-        // I have a connection! Now I handle the client request.
-        handle_client(client_socket);
+        // I have a connection! Now I handle the client request
+        // (or, in event loop mode, just the blocking disk work for it).
+        q->handler(client_socket);
     }
     
+    // I count myself out (a retiring thread already did) and let the worker know
+    // when the last of us is gone.
+    if (q->published_threads) __atomic_sub_fetch(q->published_threads, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&q->pool_lock);
+    int left = retired ? __atomic_load_n(&q->live_threads, __ATOMIC_SEQ_CST)
+                       : __atomic_sub_fetch(&q->live_threads, 1, __ATOMIC_SEQ_CST);
+    if (left == 0) pthread_cond_broadcast(&q->pool_done);
+    pthread_mutex_unlock(&q->pool_lock);
+
     return NULL; // The thread exits cleanly.
 }
\ No newline at end of file
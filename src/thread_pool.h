@@ -2,23 +2,66 @@
 #define THREAD_POOL_H // I'm using include guards to prevent multiple inclusion.
 
 #include <pthread.h> // I need pthread types for thread synchronization.
+#include "mpmc_ring.h" // I need the lock-free ring for QUEUE_MPMC.
+
+// In stealing mode every pool thread owns one of these rings.
+// The worker's dispatcher is the only producer: it writes at the tail. The owner and any
+// idle sibling take from the head with a compare-and-swap, so nobody ever blocks on a lock.
+// Head and tail live on separate cache lines so producer and consumers don't fight over them.
+typedef struct {
+    unsigned head __attribute__((aligned(64))); // The next slot a consumer takes.
+    unsigned tail __attribute__((aligned(64))); // The next slot the producer fills.
+    int *slots;                                 // The fds themselves.
+    unsigned mask;                              // The capacity minus one (it's a power of two).
+} ws_ring_t;
 
 // This structure represents a local queue for a worker process.
 // Each worker has its own queue that feeds its thread pool.
+// Only one thread may enqueue (the dispatcher, or the event loop for disk jobs).
 typedef struct local_queue {
     int *fds;              // I store client file descriptors in this array.
     int head;             // This is where I take connections from (consumer side).
     int tail;             // This is where I add new connections (producer side).
     int max_size;         // I need to know how many connections I can hold.
     int shutting_down;    // This flag tells threads when to stop.
+    int *published_depth; // If set, I mirror my depth here so the master can see how busy I am.
+    void (*handler)(int client_fd); // This is what my threads run for every fd they take.
+    int type;             // QUEUE_MUTEX, QUEUE_STEALING or QUEUE_MPMC.
+    mpmc_ring_t *ring;    // In mpmc mode this replaces fds/head/tail, mutex and cond.
+
+    // In stealing mode I only use these (and mutex/cond just for sleeping):
+    ws_ring_t *rings;     // One ring per pool thread.
+    int ring_count;       // How many rings there are.
+    int next_ring;        // The ring the producer tries next (round robin).
+    int next_owner;       // This hands every new thread a ring of its own.
+    int sleepers;         // How many threads are asleep waiting for work.
+
+    // The elastic pool that serves this queue:
+    int depth;            // How many fds are waiting (kept up to date for every queue type).
+    int min_threads;      // I never retire below this many threads.
+    int max_threads;      // I never grow beyond this many (0 until the pool is started).
+    int idle_timeout_ms;  // A spare thread retires after waiting this long (-1 = never).
+    int live_threads;     // How many threads are running right now.
+    int idle_threads;     // How many of them are waiting for work.
+    long last_dequeue_ms; // When a thread last took work, so I can tell if the queue is stuck.
+    int *published_threads; // If set, I mirror the pool size here for /stats.
+    pthread_mutex_t pool_lock; // I use these to wait for the detached threads at shutdown.
+    pthread_cond_t pool_done;
     
     // I need synchronization primitives for my queue:
     pthread_mutex_t mutex; // I protect the queue data from concurrent access.
     pthread_cond_t cond;   // I signal waiting threads when work is available.
 } local_queue_t;
 
+// local_queue_dequeue() returns this when nothing arrived within the timeout.
+#define QUEUE_TIMED_OUT -2
+
+// The pool grows when work has been waiting this long without any thread taking it.
+#define POOL_GROW_WAIT_MS 50
+
 // I need to initialize the local queue before using it.
-int local_queue_init(local_queue_t *q, int max_size);
+// 'type' is one of the QUEUE_* values; in stealing mode I make one ring per consumer thread.
+int local_queue_init(local_queue_t *q, int max_size, int type, int consumers);
 
 // I need to clean up the local queue when I'm done with it.
 void local_queue_destroy(local_queue_t *q);
@@ -26,8 +69,29 @@ void local_queue_destroy(local_queue_t *q);
 // This adds a client connection to the queue (producer operation).
 int local_queue_enqueue(local_queue_t *q, int client_fd);
 
+// This adds a burst of client connections under a single lock acquisition.
+// I return how many were queued; the ones after that didn't fit.
+int local_queue_enqueue_batch(local_queue_t *q, const int *client_fds, int count);
+
 // This takes a client connection from the queue (consumer operation).
-int local_queue_dequeue(local_queue_t *q);
+// I wait at most timeout_ms (-1 = forever) and return QUEUE_TIMED_OUT if nothing came.
+int local_queue_dequeue(local_queue_t *q, int timeout_ms);
+
+// This starts min_threads pool threads and lets the pool grow up to max_threads under load.
+// Threads above the minimum retire after idle_timeout_ms without work.
+// If published_threads is set, I keep the current pool size there. I return how many I started.
+int local_queue_start_threads(local_queue_t *q, int min_threads, int max_threads, int idle_timeout_ms, int *published_threads);
+
+// This adds a pool thread if queued work isn't being taken fast enough. The queue checks
+// by itself when work comes and goes; a worker calls this from its loop's periodic wake-up
+// too, so a stuck backlog is noticed even when nothing moves at all.
+void local_queue_check_growth(local_queue_t *q);
+
+// This waits until every pool thread has exited (call it after local_queue_shutdown()).
+void local_queue_join_threads(local_queue_t *q);
+
+// This tells the threads to stop once the queue is drained.
+void local_queue_shutdown(local_queue_t *q);
 
 // This is the main function for worker threads in the pool.
 void *worker_thread(void *arg);
@@ -0,0 +1,61 @@
+#ifndef URING_H
+#define URING_H // I'm using include guards to prevent multiple inclusion.
+
+#include <linux/io_uring.h> // I need the kernel's io_uring structures and opcodes.
+#include <sys/uio.h>        // I need struct iovec for registered buffers.
+
+// This structure is my handle on one io_uring instance.
+// I talk to the kernel with raw syscalls, so I keep pointers into the two shared rings myself.
+typedef struct {
+    int fd;                          // The ring file descriptor (-1 when not set up).
+
+    // Submission queue: I fill sqes and move the tail, the kernel consumes from the head.
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local_tail;          // sqes I've filled but not yet published to the kernel.
+
+    // Completion queue: the kernel moves the tail, I consume from the head.
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // I remember the mappings so I can undo them.
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} uring_t;
+
+// I set up a ring with room for 'entries' submissions.
+// I return 0 on success, or -1 if the kernel doesn't support (or allow) io_uring.
+int uring_init(uring_t *ring, unsigned entries);
+
+// I tear the ring down.
+void uring_exit(uring_t *ring);
+
+// I hand out the next free submission slot (zeroed), or NULL if the queue is full.
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+
+// I publish everything queued so far with one io_uring_enter, and wait for at least
+// wait_nr completions. I return the number submitted, or -errno (-EINTR on a signal).
+int uring_submit_and_wait(uring_t *ring, unsigned wait_nr);
+
+// I return the oldest unseen completion, or NULL when there is none.
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+
+// I mark the completion returned by uring_peek_cqe() as consumed.
+void uring_cqe_seen(uring_t *ring);
+
+// I pin buffers with the kernel so READ_FIXED can skip the per-call page mapping.
+int uring_register_buffers(uring_t *ring, const struct iovec *iovs, unsigned count);
+
+// I register a table of fds (entries may be -1) so sqes can use IOSQE_FIXED_FILE.
+int uring_register_files(uring_t *ring, const int *fds, unsigned count);
+
+#endif
@@ -0,0 +1,716 @@
+#define _GNU_SOURCE // I need this for accept4() and O_CLOEXEC.
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/sockios.h>
+
+#include "config.h"
+#include "uring.h"
+#include "uring_loop.h"
+#include "worker.h"
+
+// I need to access the global server configuration.
+extern server_config_t config;
+
+#define URING_MAX_CONNS 1024      // This is how many connections one worker's ring serves at once.
+#define URING_BUFFER_SIZE 8192    // This is the most request header data I buffer per connection.
+#define URING_ENTRIES 4096        // Submission queue size (the completion queue is twice that).
+#define URING_SPLICE_CHUNK 65536  // How much of a streamed body I move per splice (one pipe's worth).
+
+// Every sqe carries the connection slot and what kind of operation it was.
+enum { OP_RECV, OP_SEND, OP_FILE_READ, OP_ACCEPT, OP_IPC, OP_TIMEOUT, OP_SPLICE_IN, OP_SPLICE_OUT,
+       OP_FIXED_SET, OP_FIXED_CLEAR };
+#define USER_DATA(slot, op) (((uint64_t)(slot) << 8) | (op))
+
+// These are the states a connection moves through, like in the epoll loop.
+enum { CONN_READING, CONN_DISK, CONN_WRITING };
+
+struct uring_conn;
+
+// A list of connections ordered by last activity, oldest first, so expiring the quiet
+// ones only ever looks at the front.
+typedef struct {
+    struct uring_conn *head;        // The connection that has been quiet the longest.
+    struct uring_conn *tail;        // The one I heard from (or sent to) most recently.
+} conn_list_t;
+
+// This structure holds everything I know about one client connection.
+// A connection never has more than one operation in flight, so I only free it
+// from inside a completion handler.
+typedef struct uring_conn {
+    int fd;                         // The client socket.
+    int slot;                       // My index in the connection table (and the registered file table).
+    int fixed;                      // Is my socket in the registered file table at 'slot'?
+    int state;                      // One of the CONN_* states above.
+    int close_after;                // I close the connection once this response is out.
+    char client_ip[INET_ADDRSTRLEN];// I need this for the access log.
+    char *in;                       // My receive buffer, a slice of the registered region.
+    size_t in_len;                  // How many bytes are in 'in'.
+    http_parser_t parser;           // How far I got parsing the request at the front of 'in'.
+    arena_t arena;                  // Where the current response is built (reset once it's out).
+    request_ctx_t ctx;              // The request I'm currently answering.
+    char header[2048];              // The response header for that request.
+    struct iovec out[2];            // What's left to send: header, then body.
+    struct msghdr msg;              // The sendmsg() description of 'out'.
+    int file_fd;                    // The file I'm reading for a cache miss.
+    char *file_buf;                 // Where that file is going (in the arena).
+    size_t file_size;               // How big it is.
+    size_t file_done;               // How much of it I have so far.
+    int pipe_fds[2];                // The pipe a streamed body is spliced through (-1 until I need one).
+    size_t pipe_len;                // How many body bytes are sitting in that pipe.
+    time_t last_active;             // When I last heard from the client, or got bytes out to it.
+    int unsent;                     // While WRITING: the socket's send queue when on_tick() last looked (-1: not yet).
+    conn_list_t *list;              // The list I'm in: idle while READING, writing while WRITING (NULL in DISK).
+    struct uring_conn *idle_prev;   // My neighbours in that list.
+    struct uring_conn *idle_next;
+} uring_conn_t;
+
+// * Loop State
+// There's exactly one loop per worker process, so I keep it in one static structure.
+static struct {
+    uring_t ring;                   // My io_uring instance.
+    uring_conn_t *conns[URING_MAX_CONNS]; // Connections by slot.
+    int free_slots[URING_MAX_CONNS];// A stack of unused slots.
+    int free_count;
+    char *buffers;                  // One receive buffer per slot, registered with the kernel.
+    int fixed_files;                // Did the kernel accept my registered file table?
+    int fixed_buffers;              // Did the kernel accept my registered buffers?
+    int ipc_socket;
+    int listen_fd;
+    int running;
+    struct __kernel_timespec tick;  // My once-a-second timeout for idle expiry.
+    int accepts_parked;             // Accepts I didn't re-arm after a hard error; the next tick does.
+    int accept_failing;             // Set from the first hard error until an accept succeeds again.
+    conn_list_t idle;               // READING connections (keep-alive clients between requests).
+    conn_list_t writing;            // WRITING connections, with a send or splice to the client in flight.
+} loop = {.ring.fd = -1};
+
+// I keep reading connections in one list and writing connections in another, each ordered
+// by last activity, so expiring the clients that went quiet only ever looks at the fronts.
+static void list_remove(uring_conn_t *c)
+{
+    conn_list_t *list = c->list;
+    if (!list) return;
+    if (c->idle_prev) c->idle_prev->idle_next = c->idle_next;
+    else list->head = c->idle_next;
+    if (c->idle_next) c->idle_next->idle_prev = c->idle_prev;
+    else list->tail = c->idle_prev;
+    c->idle_prev = c->idle_next = NULL;
+    c->list = NULL;
+}
+
+// I (re)start a connection's clock and put it at the back of a list.
+static void list_append(conn_list_t *list, uring_conn_t *c)
+{
+    list_remove(c);
+    c->last_active = time(NULL);
+    c->list = list;
+    c->idle_prev = list->tail;
+    c->idle_next = NULL;
+    if (list->tail) list->tail->idle_next = c;
+    else list->head = c;
+    list->tail = c;
+}
+
+// The client took some of its response, so its clock starts over. I don't look at the
+// send queue here; on_tick() only asks the kernel about connections that went quiet.
+static void writing_progress(uring_conn_t *c)
+{
+    list_append(&loop.writing, c);
+    c->unsent = -1;
+}
+
+// I get a submission slot, flushing the queue to the kernel first if it's full.
+static struct io_uring_sqe *get_sqe()
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop.ring);
+    if (!sqe) {
+        uring_submit_and_wait(&loop.ring, 0);
+        sqe = uring_get_sqe(&loop.ring);
+    }
+    return sqe;
+}
+
+// I point an sqe at a client socket, through the registered table when I can.
+static void set_conn_fd(struct io_uring_sqe *sqe, uring_conn_t *c)
+{
+    if (c->fixed) {
+        sqe->fd = c->slot;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = c->fd;
+    }
+}
+
+// I ask the kernel for more request bytes, straight into my registered buffer.
+static void arm_recv(uring_conn_t *c)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    set_conn_fd(sqe, c);
+    sqe->addr = (uint64_t)(uintptr_t)(c->in + c->in_len);
+    sqe->len = URING_BUFFER_SIZE - 1 - c->in_len;
+    if (loop.fixed_buffers) {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->buf_index = 0;
+        sqe->off = (uint64_t)-1; // Sockets have no file position.
+    } else {
+        sqe->opcode = IORING_OP_RECV;
+    }
+    sqe->user_data = USER_DATA(c->slot, OP_RECV);
+}
+
+// I queue whatever is left of the response in one sendmsg.
+static void arm_send(uring_conn_t *c)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    set_conn_fd(sqe, c);
+    c->msg.msg_iov = (c->out[0].iov_len > 0) ? &c->out[0] : &c->out[1];
+    c->msg.msg_iovlen = (c->out[0].iov_len > 0) ? 2 : 1;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->addr = (uint64_t)(uintptr_t)&c->msg;
+    sqe->len = 1;
+    // When a file follows, MSG_MORE lets the header share a segment with its first bytes.
+    sqe->msg_flags = MSG_NOSIGNAL | ((c->ctx.file_fd >= 0 && c->ctx.body_len > 0) ? MSG_MORE : 0);
+    sqe->user_data = USER_DATA(c->slot, OP_SEND);
+}
+
+// I queue the next chunk of a file read.
+static void arm_file_read(uring_conn_t *c)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = c->file_fd;
+    sqe->addr = (uint64_t)(uintptr_t)(c->file_buf + c->file_done);
+    sqe->len = (unsigned)(c->file_size - c->file_done);
+    sqe->off = c->file_done;
+    sqe->user_data = USER_DATA(c->slot, OP_FILE_READ);
+}
+
+// There's no sendfile in io_uring, so a body streamed from its file goes
+// file -> pipe -> socket with two splices, one chunk at a time. Nothing is copied to user space.
+static void arm_splice_in(uring_conn_t *c)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->fd = c->pipe_fds[1];
+    sqe->off = (uint64_t)-1;
+    sqe->splice_fd_in = c->ctx.file_fd;
+    sqe->splice_off_in = (uint64_t)c->ctx.body_offset;
+    sqe->len = (c->ctx.body_len < URING_SPLICE_CHUNK) ? (unsigned)c->ctx.body_len : URING_SPLICE_CHUNK;
+    sqe->splice_flags = SPLICE_F_MOVE;
+    sqe->user_data = USER_DATA(c->slot, OP_SPLICE_IN);
+}
+
+static void arm_splice_out(uring_conn_t *c)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    set_conn_fd(sqe, c);
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->off = (uint64_t)-1;
+    sqe->splice_fd_in = c->pipe_fds[0];
+    sqe->splice_off_in = (uint64_t)-1;
+    sqe->len = (unsigned)c->pipe_len;
+    // Until the last chunk, I tell the socket more is coming so it only sends full segments.
+    sqe->splice_flags = SPLICE_F_MOVE | (c->ctx.body_len > 0 ? SPLICE_F_MORE : 0);
+    sqe->user_data = USER_DATA(c->slot, OP_SPLICE_OUT);
+}
+
+// I put a connection's socket into its slot of the registered file table, or take it out.
+// The update is an sqe like any other, so it rides in the io_uring_enter I make anyway
+// instead of costing a register syscall per connection. Setting a slot is linked to the
+// sqe after it (the first receive), which then only runs once the slot is filled.
+static void arm_fixed_update(uring_conn_t *c, int set)
+{
+    static const int no_fd = -1;
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_FILES_UPDATE;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)(set ? &c->fd : &no_fd);
+    sqe->len = 1;
+    sqe->off = (uint64_t)c->slot;
+    if (set) sqe->flags |= IOSQE_IO_LINK;
+    sqe->user_data = USER_DATA(c->slot, set ? OP_FIXED_SET : OP_FIXED_CLEAR);
+}
+
+static void arm_ipc()
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = loop.ipc_socket;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = USER_DATA(0, OP_IPC);
+}
+
+static void arm_accept()
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop.listen_fd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = USER_DATA(0, OP_ACCEPT);
+}
+
+static void arm_timeout()
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&loop.tick;
+    sqe->len = 1;
+    sqe->user_data = USER_DATA(0, OP_TIMEOUT);
+}
+
+// The connection is done. Nothing of it is in flight anymore when I get here.
+static void conn_close(uring_conn_t *c)
+{
+    list_remove(c);
+    // The table holds its own reference to the socket, so it only really closes once
+    // the slot is cleared too.
+    if (c->fixed) arm_fixed_update(c, 0);
+    close(c->fd);
+    track_connection(-1);
+
+    loop.conns[c->slot] = NULL;
+    loop.free_slots[loop.free_count++] = c->slot;
+    request_release(&c->ctx);
+    if (c->pipe_fds[0] >= 0) {
+        close(c->pipe_fds[0]);
+        close(c->pipe_fds[1]);
+    }
+    arena_reset(&c->arena);
+    free(c);
+}
+
+// A new client arrived. I give it a slot and start receiving its first request.
+static void conn_open(int fd)
+{
+    uring_conn_t *c = (loop.free_count > 0) ? calloc(1, sizeof(uring_conn_t)) : NULL;
+    if (!c) {
+        long bytes_sent = 0;
+        send_error_page(fd, 503, "Service Unavailable", &bytes_sent);
+        close(fd);
+        return;
+    }
+
+    c->slot = loop.free_slots[--loop.free_count];
+    c->fd = fd;
+    c->state = CONN_READING;
+    prepare_client_socket(fd);
+    c->file_fd = -1;
+    c->pipe_fds[0] = c->pipe_fds[1] = -1;
+    http_parser_init(&c->parser);
+    arena_init(&c->arena);
+    request_begin(&c->ctx, &c->arena); // An empty request, so closing early releases nothing stale.
+    c->in = loop.buffers + (size_t)c->slot * URING_BUFFER_SIZE;
+    get_client_ip(fd, c->client_ip, sizeof(c->client_ip));
+    loop.conns[c->slot] = c;
+    track_connection(1);
+
+    list_append(&loop.idle, c);
+    c->fixed = loop.fixed_files;
+    if (c->fixed) arm_fixed_update(c, 1);
+    arm_recv(c);
+}
+
+// The response for the current request is ready, so I start sending it.
+static void conn_respond(uring_conn_t *c)
+{
+    c->out[0].iov_base = (void *)request_header(&c->ctx, c->header, sizeof(c->header), &c->out[0].iov_len);
+    // A streamed body isn't in memory; on_send() splices it from the file after the header.
+    // The boundary lines of its first part (for a multipart body) ride along with the header.
+    int in_memory = (c->ctx.file_fd < 0 && c->ctx.content);
+    if (in_memory) {
+        c->out[1].iov_base = c->ctx.content + c->ctx.body_offset;
+        c->out[1].iov_len = c->ctx.body_len;
+    } else {
+        c->out[1] = c->ctx.part_head;
+        c->ctx.part_head.iov_len = 0;
+    }
+    c->state = CONN_WRITING;
+    writing_progress(c);
+    arm_send(c);
+}
+
+// I finish a file read and either respond or start the next read (for an error page).
+static void file_read_done(uring_conn_t *c, int rc)
+{
+    if (c->file_fd >= 0) close(c->file_fd);
+    c->file_fd = -1;
+    char *buf = c->file_buf;
+    c->file_buf = NULL;
+
+    request_loaded(&c->ctx, rc, rc == 0 ? buf : NULL, rc == 0 ? c->file_size : 0);
+}
+
+// The request needs file contents. I open the file here and let the ring read it.
+static void start_file_read(uring_conn_t *c)
+{
+    while (c->ctx.needs_disk) {
+        c->file_fd = open(c->ctx.full_path, O_RDONLY | O_CLOEXEC);
+        if (c->file_fd < 0) {
+            file_read_done(c, errno == ENOENT ? -1 : -2);
+            continue;
+        }
+
+        struct stat st;
+        if (fstat(c->file_fd, &st) != 0 || !(c->file_buf = arena_alloc(&c->arena, st.st_size))) {
+            file_read_done(c, -2);
+            continue;
+        }
+        c->file_size = st.st_size;
+        c->file_done = 0;
+        if (c->file_size == 0) {
+            file_read_done(c, 0);
+            continue;
+        }
+
+        c->state = CONN_DISK;
+        arm_file_read(c);
+        return;
+    }
+    conn_respond(c);
+}
+
+// I look for the next complete request. If there isn't one yet, I go back to receiving.
+static void conn_process(uring_conn_t *c)
+{
+    int taken = request_take(&c->ctx, &c->arena, &c->parser, c->in, &c->in_len, URING_BUFFER_SIZE);
+    if (taken == 0) {
+        arm_recv(c);
+        return;
+    }
+    // I hang up after a bad request, or when the client asked me to.
+    if (taken < 0 || !c->ctx.keep_alive) c->close_after = 1;
+    list_remove(c);
+
+    if (c->ctx.needs_disk) start_file_read(c);
+    else conn_respond(c);
+}
+
+// The kernel wouldn't put a socket into the table (a kernel older than 5.6 doesn't know
+// the opcode). That connection and every later one use their normal fds instead.
+static void on_fixed_set(uring_conn_t *c, int res)
+{
+    if (res >= 0) return;
+    loop.fixed_files = 0;
+    if (c) c->fixed = 0;
+}
+
+static void on_recv(uring_conn_t *c, int res)
+{
+    // -ECANCELED: the first receive was linked to a table update that failed. I try again.
+    if (res == -EINTR || res == -EAGAIN || res == -ECANCELED) {
+        arm_recv(c);
+        return;
+    }
+    if (res <= 0) {
+        // Connection closed, error, or I shut it down for being idle.
+        conn_close(c);
+        return;
+    }
+    c->in_len += res;
+    // I heard from the client, so it moves to the back of the idle line.
+    list_append(&loop.idle, c);
+    conn_process(c);
+}
+
+// The whole response is out. I log it and get ready for the next request.
+static void conn_sent(uring_conn_t *c)
+{
+    request_finish(&c->ctx, c->client_ip);
+    arena_reset(&c->arena);
+    if (c->close_after) {
+        conn_close(c);
+        return;
+    }
+    c->state = CONN_READING;
+    list_append(&loop.idle, c);
+    conn_process(c);
+}
+
+static void on_send(uring_conn_t *c, int res)
+{
+    if (res < 0 && res != -EINTR && res != -EAGAIN) {
+        conn_close(c);
+        return;
+    }
+
+    // I advance through the header first, then the body.
+    size_t n = res > 0 ? (size_t)res : 0;
+    if (n > 0) writing_progress(c);
+    for (int i = 0; i < 2 && n > 0; i++) {
+        size_t step = (n < c->out[i].iov_len) ? n : c->out[i].iov_len;
+        c->out[i].iov_base = (char *)c->out[i].iov_base + step;
+        c->out[i].iov_len -= step;
+        n -= step;
+    }
+    if (c->out[0].iov_len + c->out[1].iov_len > 0) {
+        arm_send(c); // A short send: I queue the rest.
+        return;
+    }
+
+    // A body that's streamed from its file follows the header.
+    if (c->ctx.file_fd >= 0 && c->ctx.body_len > 0) {
+        if (c->pipe_fds[0] < 0 && pipe2(c->pipe_fds, O_CLOEXEC) != 0) {
+            c->pipe_fds[0] = c->pipe_fds[1] = -1;
+            conn_close(c);
+            return;
+        }
+        arm_splice_in(c);
+        return;
+    }
+    conn_sent(c);
+}
+
+// A chunk of a streamed body moved from the file into the pipe; now it goes to the client.
+static void on_splice_in(uring_conn_t *c, int res)
+{
+    if (res == -EINTR || res == -EAGAIN) {
+        arm_splice_in(c);
+        return;
+    }
+    if (res <= 0) {
+        // An error, or the file got shorter under me. The response can't be finished.
+        conn_close(c);
+        return;
+    }
+    c->pipe_len = (size_t)res;
+    c->ctx.body_offset += res;
+    c->ctx.body_len -= res;
+    arm_splice_out(c);
+}
+
+static void on_splice_out(uring_conn_t *c, int res)
+{
+    if (res == -EINTR || res == -EAGAIN) {
+        arm_splice_out(c);
+        return;
+    }
+    if (res <= 0) {
+        conn_close(c);
+        return;
+    }
+    c->pipe_len -= (size_t)res;
+    writing_progress(c);
+    if (c->pipe_len > 0) arm_splice_out(c);
+    else if (c->ctx.body_len > 0) arm_splice_in(c);
+    else if (request_next_part(&c->ctx, &c->out[0])) {
+        // The next part of a multipart body: its boundary lines go out, then on_send() splices its slice.
+        c->out[1].iov_len = 0;
+        arm_send(c);
+    }
+    else conn_sent(c);
+}
+
+static void on_file_read(uring_conn_t *c, int res)
+{
+    if (res == -EINTR || res == -EAGAIN) {
+        arm_file_read(c);
+        return;
+    }
+    if (res <= 0) {
+        // An error, or the file got shorter under me.
+        file_read_done(c, -2);
+        start_file_read(c);
+        return;
+    }
+    c->file_done += res;
+    if (c->file_done < c->file_size) {
+        arm_file_read(c);
+        return;
+    }
+    file_read_done(c, 0);
+    start_file_read(c);
+}
+
+static void on_ipc()
+{
+    if (loop.listen_fd >= 0) {
+        // In reuseport mode the IPC socket only ever tells me to stop.
+        char ch;
+        if (recv(loop.ipc_socket, &ch, 1, MSG_DONTWAIT) <= 0) {
+            loop.running = 0;
+            return;
+        }
+    } else {
+        int fds[MAX_ACCEPT_BATCH];
+        int count = receive_connections(loop.ipc_socket, fds, MAX_ACCEPT_BATCH);
+        if (count < 0) {
+            loop.running = 0; // The master hung up - time to shut down.
+            return;
+        }
+        for (int k = 0; k < count; k++) conn_open(fds[k]);
+    }
+    arm_ipc();
+}
+
+// Once a second I shut down keep-alive connections that have been quiet for too long,
+// and connections whose client hasn't taken a byte of its response for TIMEOUT_SECONDS.
+// Their pending receive, send or splice then fails and closes them the normal way.
+static void on_tick()
+{
+    int timeout = config.keep_alive_timeout > 0 ? config.keep_alive_timeout : 5;
+    time_t now = time(NULL);
+    while (loop.idle.head && now - loop.idle.head->last_active >= timeout) {
+        uring_conn_t *c = loop.idle.head;
+        list_remove(c);
+        shutdown(c->fd, SHUT_RDWR);
+    }
+
+    // The kernel's send buffer can hold a lot, so a client that reads slowly may keep a send
+    // in flight for a while. It only counts as stalled if the queue hasn't shrunk either: a
+    // connection a second past its last completion gets its queue size noted, and when the
+    // timeout comes, it has to be smaller than that.
+    int write_timeout = config.timeout_seconds > 0 ? config.timeout_seconds : 30;
+    uring_conn_t *next;
+    for (uring_conn_t *c = loop.writing.head; c && now - c->last_active >= 1; c = next) {
+        next = c->idle_next;
+        int unsent;
+        if (ioctl(c->fd, SIOCOUTQ, &unsent) < 0) unsent = 0;
+        if (c->unsent < 0) {
+            c->unsent = unsent;
+        } else if (unsent < c->unsent) {
+            list_append(&loop.writing, c);
+            c->unsent = unsent;
+        } else if (now - c->last_active >= write_timeout) {
+            list_remove(c);
+            shutdown(c->fd, SHUT_RDWR);
+        }
+    }
+
+    // Accepts that failed hard get another try now that a second has passed.
+    for (; loop.accepts_parked > 0 && loop.running; loop.accepts_parked--) arm_accept();
+    arm_timeout();
+}
+
+// An accept completed. Errors that only concern one connection (it was aborted, or I was
+// interrupted) don't stop me, but EMFILE, ENFILE, ENOMEM and the like would fail again
+// right away: re-arming then would just spin the ring, so I park the accept until the next tick.
+static void on_accept(int res)
+{
+    if (res >= 0) {
+        loop.accept_failing = 0;
+        conn_open(res);
+    }
+    if (!loop.running) return;
+    if (res >= 0 || res == -EAGAIN || res == -ECONNABORTED || res == -EINTR) {
+        arm_accept();
+        return;
+    }
+    loop.accepts_parked++;
+    if (!loop.accept_failing) {
+        fprintf(stderr, "[Worker %d] accept: %s (retrying every second)\n", getpid(), strerror(-res));
+        loop.accept_failing = 1;
+    }
+}
+
+int uring_loop_init()
+{
+    if (uring_init(&loop.ring, URING_ENTRIES) != 0) return -1;
+
+    loop.buffers = malloc((size_t)URING_MAX_CONNS * URING_BUFFER_SIZE);
+    if (!loop.buffers) {
+        uring_exit(&loop.ring);
+        return -1;
+    }
+    for (int i = 0; i < URING_MAX_CONNS; i++) {
+        loop.free_slots[i] = URING_MAX_CONNS - 1 - i;
+    }
+    loop.free_count = URING_MAX_CONNS;
+
+    // Registered buffers and files are optimizations: if the kernel (or my memlock limit)
+    // says no, I still work with plain recv() and normal fds.
+    struct iovec region = {.iov_base = loop.buffers, .iov_len = (size_t)URING_MAX_CONNS * URING_BUFFER_SIZE};
+    loop.fixed_buffers = (uring_register_buffers(&loop.ring, &region, 1) == 0);
+
+    int empty[URING_MAX_CONNS];
+    for (int i = 0; i < URING_MAX_CONNS; i++) empty[i] = -1;
+    loop.fixed_files = (uring_register_files(&loop.ring, empty, URING_MAX_CONNS) == 0);
+    return 0;
+}
+
+void uring_loop_run(int ipc_socket, int listen_fd)
+{
+    loop.ipc_socket = ipc_socket;
+    loop.listen_fd = listen_fd;
+    loop.running = 1;
+    loop.tick.tv_sec = 1;
+    loop.tick.tv_nsec = 0;
+
+    arm_ipc();
+    arm_timeout();
+    if (listen_fd >= 0) {
+        // A listener socket is non-blocking; the ring waits for readiness itself.
+        fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) & ~O_NONBLOCK);
+        for (int i = 0; i < config.accept_batch && i < MAX_ACCEPT_BATCH; i++) arm_accept();
+    }
+
+    while (loop.running) {
+        // One syscall submits everything I queued and waits for at least one completion.
+        int ret = uring_submit_and_wait(&loop.ring, 1);
+        if (ret < 0 && ret != -EINTR && ret != -EBUSY) {
+            fprintf(stderr, "io_uring_enter: %s\n", strerror(-ret));
+            break;
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&loop.ring)) != NULL) {
+            int op = (int)(cqe->user_data & 0xff);
+            int slot = (int)(cqe->user_data >> 8);
+            int res = cqe->res;
+            uring_cqe_seen(&loop.ring);
+
+            switch (op) {
+            case OP_RECV:      on_recv(loop.conns[slot], res); break;
+            case OP_SEND:      on_send(loop.conns[slot], res); break;
+            case OP_FILE_READ: on_file_read(loop.conns[slot], res); break;
+            case OP_SPLICE_IN: on_splice_in(loop.conns[slot], res); break;
+            case OP_SPLICE_OUT: on_splice_out(loop.conns[slot], res); break;
+            case OP_IPC:       on_ipc(); break;
+            case OP_TIMEOUT:   on_tick(); break;
+            case OP_ACCEPT:    on_accept(res); break;
+            case OP_FIXED_SET: on_fixed_set(loop.conns[slot], res); break;
+            case OP_FIXED_CLEAR: break;
+            }
+        }
+    }
+}
+
+void uring_loop_cleanup()
+{
+    // I shut every client down before the ring goes, so nothing in flight outlives it.
+    for (int i = 0; i < URING_MAX_CONNS; i++) {
+        if (loop.conns[i]) shutdown(loop.conns[i]->fd, SHUT_RDWR);
+    }
+    uring_exit(&loop.ring);
+
+    for (int i = 0; i < URING_MAX_CONNS; i++) {
+        uring_conn_t *c = loop.conns[i];
+        if (!c) continue;
+        close(c->fd);
+        if (c->file_fd >= 0) close(c->file_fd);
+        if (c->pipe_fds[0] >= 0) {
+            close(c->pipe_fds[0]);
+            close(c->pipe_fds[1]);
+        }
+        request_release(&c->ctx);
+        track_connection(-1);
+        arena_reset(&c->arena);
+        free(c);
+        loop.conns[i] = NULL;
+    }
+    free(loop.buffers);
+    loop.buffers = NULL;
+}
@@ -0,0 +1,17 @@
+#ifndef URING_LOOP_H
+#define URING_LOOP_H // I'm using include guards to prevent multiple inclusion.
+
+// I set up the worker's io_uring engine: the ring, the registered file table and
+// the registered receive buffers. I return -1 if the kernel can't give me a ring,
+// so the worker can fall back to the epoll loop.
+int uring_loop_init();
+
+// This runs the worker's io_uring loop until the master hangs up.
+// Accepts (or fd handoffs), receives, sends and file reads are all submitted to the
+// ring and reaped in batches, so one io_uring_enter covers many connections.
+void uring_loop_run(int ipc_socket, int listen_fd);
+
+// I close every remaining connection and tear the ring down.
+void uring_loop_cleanup();
+
+#endif
@@ -1,16 +1,23 @@
-#define _POSIX_C_SOURCE 199309L // I need this for clock_gettime and other POSIX features.
+#define _POSIX_C_SOURCE 200809L // I need this for clock_gettime, strdup and other POSIX features.
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h> 
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
 #include <pthread.h>
 #include <time.h> 
 #include <sys/time.h> 
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <strings.h>
 
 #include "http.h"
 #include "config.h"
@@ -20,11 +27,24 @@
 #include "logger.h"
 #include "worker.h"
 #include "cache.h"
+#include "master.h"
+#include "event_loop.h"
+#include "uring_loop.h"
+#include "idle_poller.h"
+#include "affinity.h"
+#include "arena.h"
+#include "compress.h"
 
 // I need to access the global server configuration and shared queue.
 extern server_config_t config;
 extern connection_queue_t *queue;
 
+// This is how many pipelined requests I answer with a single write in handle_client().
+#define PIPELINE_BATCH 16
+
+// This is my slot in the shared per-worker load array (NULL until the worker starts).
+static worker_load_t *my_load = NULL;
+
 // This helper calculates the time difference between two timestamps in milliseconds.
 // I use this to measure how long it takes to handle each request.
 long get_time_diff_ms(struct timespec start, struct timespec end) {
@@ -64,120 +84,508 @@ const char *get_mime_type(const char *path)
         return "image/jpeg";
     if (strcmp(ext, ".pdf") == 0)
         return "application/pdf";
+    if (strcmp(ext, ".svg") == 0)
+        return "image/svg+xml";
+    if (strcmp(ext, ".json") == 0)
+        return "application/json";
+    if (strcmp(ext, ".txt") == 0)
+        return "text/plain";
     
     return "application/octet-stream"; // Fallback for other types.
 }
 
-// This helper function sends custom error pages.
-// If there's an error HTML file in www/errors/, I send that.
-// Otherwise, I send a simple hardcoded error message.
-static void send_error_page(int client_fd, int status_code, const char *status_text, long *bytes_sent)
+// This helper function sends custom error pages (when I have to turn a client away).
+// It goes through the same steps as a request: the page in www/errors/ comes from the
+// cache after the first time, and without one I send a simple hardcoded error message.
+void send_error_page(int client_fd, int status_code, const char *status_text, long *bytes_sent)
 {
-    char filepath[1024];
-    snprintf(filepath, sizeof(filepath), "%s/errors/%d.html", config.document_root, status_code);
+    arena_t arena;
+    arena_init(&arena);
+    request_ctx_t ctx;
+    request_begin(&ctx, &arena);
+    request_error(&ctx, status_code, status_text);
+    request_load(&ctx);
 
-    struct stat st;
-    if (stat(filepath, &st) == 0) {
-        // I found a custom error page!
-        FILE *fp = fopen(filepath, "rb");
-        if (fp) {
-            char *buf = malloc(st.st_size);
-            if (buf) {
-                size_t rb = fread(buf, 1, st.st_size, fp);
-                if (rb == (size_t)st.st_size) {
-                    send_http_response(client_fd, status_code, status_text, "text/html", buf, st.st_size);
-                    *bytes_sent = st.st_size;
-                    free(buf);
-                    fclose(fp);
-                    return;
-                }
-                free(buf);
-            }
-            fclose(fp);
-        }
+    // The connection closes right after this, and the response says so.
+    char header[2048];
+    struct iovec iov[2];
+    int count = 0;
+    iov[count].iov_base = (void *)request_header(&ctx, header, sizeof(header), &iov[count].iov_len);
+    count++;
+    if (ctx.body_len > 0) {
+        iov[count].iov_base = ctx.content + ctx.body_offset;
+        iov[count].iov_len = ctx.body_len;
+        count++;
     }
+    http_send_iov(client_fd, iov, count, 0);
+    *bytes_sent = ctx.bytes_sent;
+    request_release(&ctx);
+    arena_reset(&arena);
+}
 
-    // Fallback: I send a simple HTML error message.
-    char body[512];
-    snprintf(body, sizeof(body), "<h1>%d %s</h1>", status_code, status_text);
-    size_t len = strlen(body);
-    send_http_response(client_fd, status_code, status_text, "text/html", body, len);
-    *bytes_sent = len;
+// Every response leaves in as few writes as I can manage (one sendmsg for a header and
+// its body, MSG_MORE in front of a streamed file), so Nagle's algorithm has nothing left
+// to coalesce and would only hold back the last segment of a response. I turn it off.
+void prepare_client_socket(int client_fd)
+{
+    int one = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 }
 
-// This is the main function that handles each client connection.
-// It processes HTTP requests from start to finish.
-void handle_client(int client_socket)
+// I keep track of how many clients are connected, globally and for this worker.
+// The blocking threads and the event loop both call this when a connection opens (+1) or closes (-1).
+void track_connection(int delta)
 {
-    struct timespec start_time, end_time;
-    
-    // 1. I increment the active connections counter.
     // This needs to be thread-safe, so I use a semaphore.
     sem_wait(&stats->mutex);
-    stats->active_connections++;
+    stats->active_connections += delta;
     sem_post(&stats->mutex);
+    if (my_load) __atomic_add_fetch(&my_load->active_connections, delta, __ATOMIC_RELAXED);
+}
 
-    char client_ip[INET_ADDRSTRLEN];
-    get_client_ip(client_socket, client_ip, sizeof(client_ip));
+// I'm starting a fresh request: everything zeroed and the clock running.
+// Whatever the request allocates comes from 'arena'.
+void request_begin(request_ctx_t *ctx, arena_t *arena)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->arena = arena;
+    ctx->file_fd = -1;
+    clock_gettime(CLOCK_MONOTONIC, &ctx->start_time);
+}
+
+// Text compresses well; images, PDFs and archives are compressed already.
+static int is_compressible(const char *mime)
+{
+    return strncmp(mime, "text/", 5) == 0 || strcmp(mime, "application/javascript") == 0 ||
+           strcmp(mime, "application/json") == 0 || strcmp(mime, "image/svg+xml") == 0;
+}
 
-    // I set a timeout on the socket for keep-alive connections.
-    struct timeval tv;
-    tv.tv_sec = config.keep_alive_timeout > 0 ? config.keep_alive_timeout : 5;
-    tv.tv_usec = 0;
-    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+// The ETag names one version of one representation: the file's size, modification time
+// and inode, plus the coding for a compressed version (which is different bytes).
+static void format_etag(const request_ctx_t *ctx, char *buf, size_t cap)
+{
+    snprintf(buf, cap, "\"%lx-%lx%08lx-%lx%s%s\"", ctx->stamp.size, ctx->stamp.mtime_sec,
+             ctx->stamp.mtime_nsec, ctx->stamp.ino, ctx->encoding ? "-" : "", ctx->encoding ? ctx->encoding : "");
+}
 
-    // I can handle multiple requests on the same connection (keep-alive).
-    while (1) {
-        clock_gettime(CLOCK_MONOTONIC, &start_time);
+// I write the header lines that describe the file behind a response into buf: its encoding,
+// whether it depends on Accept-Encoding, and its validators (ETag, Last-Modified).
+static size_t entity_headers(const request_ctx_t *ctx, char *buf, size_t cap, int vary)
+{
+    char etag[80] = "";
+    char modified[HTTP_DATE_LEN + 1] = "";
+    if (ctx->has_stamp) {
+        format_etag(ctx, etag, sizeof(etag));
+        http_format_date(modified, sizeof(modified), (time_t)ctx->stamp.mtime_sec);
+    }
+    int n = snprintf(buf, cap, "%s%s%s%s%s%s%s%s%s",
+                     ctx->encoding ? "Content-Encoding: " : "", ctx->encoding ? ctx->encoding : "",
+                     ctx->encoding ? "\r\n" : "",
+                     vary ? "Vary: Accept-Encoding\r\n" : "",
+                     ctx->has_stamp ? "ETag: " : "", etag, ctx->has_stamp ? "\r\nLast-Modified: " : "",
+                     modified, ctx->has_stamp ? "\r\n" : "");
+    if (n < 0) return 0;
+    return ((size_t)n < cap) ? (size_t)n : cap - 1;
+}
+
+// I work out what the cache calls the bytes this request serves. A file is stored under its
+// path; a compressed version under "<coding>:<path of the uncompressed file>", so a .gz sidecar
+// and my own gzip of the same file share an entry, and no key can clash with a real path
+// (those all start with the document root).
+static const char *cache_key(request_ctx_t *ctx, char *buf, size_t cap)
+{
+    if (!ctx->encoding) return ctx->full_path;
+    snprintf(buf, cap, "%s:%.*s", ctx->encoding, (int)ctx->original_len, ctx->full_path);
+    return buf;
+}
+
+// I give every multipart response its own boundary, so it can't turn up inside the file by accident.
+static unsigned long boundary_seq = 0;
+
+// I answer the Range header (RFC 7233) now that I know the size. A range that starts
+// past the end is dropped; a suffix range ("-500") is the last bytes of the file.
+// If nothing is left the answer is 416, one range gets a plain 206, and several get a
+// multipart/byteranges body. I return -1 when the request turned into an error response.
+static int apply_ranges(request_ctx_t *ctx)
+{
+    long size = (long)ctx->content_len;
+    long first[MAX_RANGES], last[MAX_RANGES];
+    int count = 0;
+    long total = 0;
+    for (int i = 0; i < ctx->range_count; i++) {
+        long f = ctx->range_first[i];
+        long l = ctx->range_last[i];
+        if (f < 0) {
+            if (l == 0 || size == 0) continue;
+            f = (l < size) ? size - l : 0;
+            l = size - 1;
+        } else {
+            if (f >= size) continue;
+            if (l < 0 || l >= size) l = size - 1;
+        }
+        first[count] = f;
+        last[count] = l;
+        total += l - f + 1;
+        count++;
+    }
+
+    if (count == 0) {
+        ctx->range_size = size;
+        request_release(ctx); // A big file was going to be streamed; now it's the error page.
+        request_error(ctx, 416, "Range Not Satisfiable");
+        return -1;
+    }
+
+    // Overlapping ranges could ask for the file many times over. The RFC lets me
+    // send the whole thing instead, once.
+    if (total > size) return 0;
+
+    ctx->status = 206;
+    ctx->status_text = "Partial Content";
+
+    if (count == 1) {
+        ctx->body_offset = first[0];
+        ctx->content_length = total;
+        snprintf(ctx->extra_headers, sizeof(ctx->extra_headers), "Content-Range: bytes %ld-%ld/%ld\r\n",
+                 first[0], last[0], size);
+        return 0;
+    }
+
+    // Every part gets its own boundary line, Content-Type and Content-Range. I write them all
+    // into one block, followed by the closing boundary, and remember where each one starts.
+    if (!ctx->mime) ctx->mime = get_mime_type(ctx->full_path);
+    char boundary[24];
+    unsigned long seq = __atomic_add_fetch(&boundary_seq, 1, __ATOMIC_RELAXED);
+    snprintf(boundary, sizeof(boundary), "%08lx%08lx",
+             (unsigned long)ctx->start_time.tv_nsec & 0xffffffffUL, seq & 0xffffffffUL);
+
+    size_t head_cap = 160 + strlen(ctx->mime);
+    char *heads = arena_alloc(ctx->arena, head_cap * (count + 1));
+    char *mime = arena_alloc(ctx->arena, 64);
+    if (!heads || !mime) {
+        request_release(ctx);
+        request_error(ctx, 500, "Internal Server Error");
+        return -1;
+    }
+    size_t off = 0;
+    for (int i = 0; i < count; i++) {
+        ctx->part_head_off[i] = (unsigned)off;
+        off += (size_t)snprintf(heads + off, head_cap,
+                                "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %ld-%ld/%ld\r\n\r\n",
+                                boundary, ctx->mime, first[i], last[i], size);
+    }
+    ctx->part_head_off[count] = (unsigned)off;
+    off += (size_t)snprintf(heads + off, head_cap, "\r\n--%s--\r\n", boundary);
+    ctx->part_head_off[count + 1] = (unsigned)off;
+
+    snprintf(mime, 64, "multipart/byteranges; boundary=%s", boundary);
+    ctx->mime = mime;
+    ctx->content_length = total + (long)off;
+
+    if (ctx->file_fd >= 0) {
+        // A streamed file goes out part by part (see request_next_part()).
+        ctx->part_heads = heads;
+        ctx->part_steps = count + 1;
+        ctx->part = 0;
+        for (int i = 0; i < count; i++) {
+            ctx->range_first[i] = first[i];
+            ctx->range_last[i] = last[i];
+        }
+        ctx->part_head.iov_base = heads;
+        ctx->part_head.iov_len = ctx->part_head_off[1];
+        return 0;
+    }
+
+    // The file is in memory (it's under the cache limit, and so is the sum of the ranges),
+    // so I lay out the whole body right away and it's sent like any other.
+    char *body = arena_alloc(ctx->arena, (size_t)ctx->content_length);
+    if (!body) {
+        request_error(ctx, 500, "Internal Server Error");
+        return -1;
+    }
+    char *p = body;
+    for (int i = 0; i <= count; i++) {
+        size_t len = ctx->part_head_off[i + 1] - ctx->part_head_off[i];
+        memcpy(p, heads + ctx->part_head_off[i], len);
+        p += len;
+        if (i < count) {
+            memcpy(p, ctx->content + first[i], (size_t)(last[i] - first[i] + 1));
+            p += last[i] - first[i] + 1;
+        }
+    }
+    ctx->content = body;
+    ctx->body_offset = 0;
+    return 0;
+}
+
+// Once I have the bytes to serve, I work out what actually goes on the wire.
+// This is where HEAD and Range requests are handled.
+static void finalize_body(request_ctx_t *ctx)
+{
+    ctx->body_offset = 0;
+    ctx->content_length = (long)ctx->content_len;
+    ctx->extra_headers[0] = '\0';
+    ctx->part_steps = 0;
+    ctx->part_head.iov_len = 0;
+
+    if (ctx->status == 416) {
+        // A 416 tells the client how big the file really is.
+        snprintf(ctx->extra_headers, sizeof(ctx->extra_headers), "Content-Range: bytes */%ld\r\n",
+                 ctx->range_size);
+    } else if (ctx->status == 200 && ctx->range_count > 0 && apply_ranges(ctx) != 0) {
+        return;
+    }
+
+    // HEAD request: I send headers only, but Content-Length still describes the real body.
+    // A 304 has no body either.
+    ctx->body_len = (ctx->is_head || ctx->status == 304) ? 0 : ctx->content_length;
+    ctx->bytes_sent = ctx->body_len;
+
+    // A multipart body streamed from its file starts with the first part's slice.
+    if (ctx->part_steps > 0) {
+        ctx->body_offset = ctx->range_first[0];
+        ctx->body_len = ctx->range_last[0] - ctx->range_first[0] + 1;
+    }
+}
+
+// I switch the request over to an error response.
+// If I already have the custom error page in the cache I use it right away,
+// otherwise I note that it has to come from disk.
+void request_error(request_ctx_t *ctx, int status_code, const char *status_text)
+{
+    // Whatever I had is left in the arena until the response is out.
+    // A cache entry I was going to send from is let go right away.
+    cache_release(ctx->cache_ref);
+    ctx->cache_ref = NULL;
+    ctx->content = NULL;
+    ctx->cached_header = NULL;
+    ctx->content_len = 0;
+    ctx->status = status_code;
+    ctx->status_text = status_text;
+    ctx->mime = "text/html";
+    ctx->is_error_page = 1;
+    ctx->range_count = 0;
+    ctx->encoding = NULL;
+    ctx->compress = 0;
+    ctx->vary = 0;
+    ctx->has_stamp = 0;
+    snprintf(ctx->full_path, sizeof(ctx->full_path), "%s/errors/%d.html", config.document_root, status_code);
+
+    if (cache_get(ctx->full_path, NULL, &ctx->cache_ref, &ctx->cached_header, &ctx->cached_header_len,
+                  &ctx->content, &ctx->content_len) == 0) {
+        finalize_body(ctx);
+        return;
+    }
+    ctx->needs_disk = 1;
+}
+
+// I'm reading a whole file into a buffer from the request's arena.
+// This is the read that request_load() does on a pool thread.
+// I return 0 on success, -1 if the file is gone, -2 if something else went wrong.
+static int read_whole_file(const char *path, arena_t *arena, char **out_buf, size_t *out_len)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return errno == ENOENT ? -1 : -2;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -2;
+    }
+
+    char *buf = arena_alloc(arena, st.st_size);
+    if (!buf) {
+        close(fd);
+        return -2;
+    }
+    size_t done = 0;
+    while (done < (size_t)st.st_size) {
+        ssize_t n = read(fd, buf + done, st.st_size - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += (size_t)n;
+    }
+    close(fd);
+
+    if (done != (size_t)st.st_size) return -2;
+    *out_buf = buf;
+    *out_len = done;
+    return 0;
+}
+
+// Text files can go out compressed. I go through the codings the client accepts, best first
+// (br, then gzip), and take the first .br/.gz sidecar I find next to the file; in dynamic
+// mode a gzip I make myself comes last. Afterwards full_path and st describe the file to
+// serve (a sidecar, or the original with compress set) and cache_key() names its version.
+static void choose_encoding(request_ctx_t *ctx, const http_parser_t *parser, const char *buffer, struct stat *st)
+{
+    const char *mime = get_mime_type(ctx->full_path);
+    if (!is_compressible(mime)) return;
+    ctx->mime = mime;
+    ctx->vary = 1; // Whatever I send now depends on Accept-Encoding, even the plain file.
+
+    const http_header_t *ae = http_find_header(parser, buffer, "Accept-Encoding");
+    if (!ae) return;
+    const char *value = buffer + ae->value_off;
+    size_t path_len = strlen(ctx->full_path);
+    static const char *const codings[] = { "br", "gzip" };
+    static const char *const suffixes[] = { ".br", ".gz" };
+
+    for (int i = 0; i < 2; i++) {
+        if (!http_accepts_encoding(value, ae->value_len, codings[i])) continue;
+        struct stat side;
+        if (path_len + 3 >= sizeof(ctx->full_path)) break;
+        memcpy(ctx->full_path + path_len, suffixes[i], 4);
+        if (stat(ctx->full_path, &side) == 0 && S_ISREG(side.st_mode)) {
+            ctx->encoding = codings[i];
+            ctx->original_len = path_len;
+            *st = side;
+            return;
+        }
+        ctx->full_path[path_len] = '\0';
+    }
 
-        // I read the request from the client.
-        char buffer[2048];
-        ssize_t bytes = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
+    if (config.compression == COMPRESSION_DYNAMIC && st->st_size >= GZIP_MIN_SIZE &&
+        st->st_size < MAX_CACHED_FILE_SIZE && http_accepts_encoding(value, ae->value_len, "gzip")) {
+        ctx->encoding = "gzip";
+        ctx->original_len = path_len;
+        ctx->compress = 1;
+    }
+}
 
-        int status_code = 0;
-        long bytes_sent = 0;
-        http_request_t req = {0}; 
+// I check If-None-Match (or, without it, If-Modified-Since) against the file I'm about to
+// serve. Both only need its stamp, so a 304 never touches the file's contents.
+// I return 1 when the client's copy is still good.
+static int not_modified(request_ctx_t *ctx, const http_parser_t *parser, const char *buffer)
+{
+    const http_header_t *inm = http_find_header(parser, buffer, "If-None-Match");
+    if (inm) {
+        char etag[80];
+        format_etag(ctx, etag, sizeof(etag));
+        size_t etag_len = strlen(etag);
+        const char *p = buffer + inm->value_off;
+        const char *end = p + inm->value_len;
+        // It's a list of entity tags, or "*". The comparison is the weak one, so I skip any W/.
+        while (p < end) {
+            while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+            if (p < end && *p == '*') return 1;
+            if (end - p >= 2 && p[0] == 'W' && p[1] == '/') p += 2;
+            const char *tag = p;
+            if (p < end && *p == '"') {
+                p++;
+                while (p < end && *p != '"') p++;
+                if (p < end) p++;
+            }
+            if ((size_t)(p - tag) == etag_len && memcmp(tag, etag, etag_len) == 0) return 1;
+            while (p < end && *p != ',') p++;
+        }
+        return 0; // If-Modified-Since doesn't count when If-None-Match is there.
+    }
+
+    const http_header_t *ims = http_find_header(parser, buffer, "If-Modified-Since");
+    if (ims) {
+        time_t since = http_parse_date(buffer + ims->value_off, ims->value_len);
+        return since != (time_t)-1 && ctx->stamp.mtime_sec <= (long)since;
+    }
+    return 0;
+}
 
-        if (bytes <= 0)
-        {
-            // Connection closed or timeout - I break out of the loop.
-            break; 
+// I read a number for parse_ranges(). I return -1 if there's no digit or it doesn't fit in a long.
+static long parse_range_number(const char **p, const char *end)
+{
+    long n = 0;
+    const char *start = *p;
+    while (*p < end && **p >= '0' && **p <= '9') {
+        if (n > (LONG_MAX - 9) / 10) return -1;
+        n = n * 10 + (**p - '0');
+        (*p)++;
+    }
+    return (*p > start) ? n : -1;
+}
+
+// I read a Range header value ("bytes=0-99, 200-, -500") into the request's range list.
+// Anything I can't parse, or more than MAX_RANGES ranges, means I ignore the header
+// and send the whole file, which is what RFC 7233 asks for.
+static void parse_ranges(request_ctx_t *ctx, const char *value, size_t len)
+{
+    const char *p = value;
+    const char *end = value + len;
+    if (len < 6 || strncasecmp(p, "bytes=", 6) != 0) return;
+    p += 6;
+
+    int count = 0;
+    while (p < end) {
+        // Ranges are separated by commas, with optional whitespace (empty elements are allowed).
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        if (p == end) break;
+        if (count == MAX_RANGES) return;
+
+        long first = -1;
+        if (*p != '-') {
+            first = parse_range_number(&p, end);
+            if (first < 0) return;
+        }
+        if (p == end || *p != '-') return;
+        p++;
+        long last = -1;
+        if (p < end && *p >= '0' && *p <= '9') {
+            last = parse_range_number(&p, end);
+            if (last < 0) return;
         }
-        buffer[bytes] = '\0';
+        if (first < 0 && last < 0) return;             // "-" alone
+        if (first >= 0 && last >= 0 && last < first) return;
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        if (p < end && *p != ',') return;
 
-    if (parse_http_request(buffer, &req) != 0)
+        ctx->range_first[count] = first;
+        ctx->range_last[count] = last;
+        count++;
+    }
+    ctx->range_count = count;
+}
+
+// This is the first step for every request: I parse it and figure out what to answer.
+// I never block on file contents here. If I can answer from memory (the cache, /stats,
+// a cached error page) the response is ready when I return. Otherwise I set needs_disk
+// and request_load() has to run before the response can be sent.
+void request_route(request_ctx_t *ctx, const http_parser_t *parser, const char *buffer)
+{
+    ctx->keep_alive = parser->keep_alive;
+    if (http_request_line(parser, buffer, &ctx->req) != 0)
     {
-        status_code = 400;
-        send_error_page(client_socket, 400, "Bad Request", &bytes_sent);
-        status_code = 400;
-        goto update_stats_and_log; 
+        request_error(ctx, 414, "URI Too Long");
+        return;
+    }
+
+    // I don't decode chunked request bodies, so I can't tell where the next request starts.
+    if (parser->chunked)
+    {
+        ctx->keep_alive = 0;
+        request_error(ctx, 501, "Not Implemented");
+        return;
     }
 
     // I only support GET and HEAD methods.
-    int is_head = (strcmp(req.method, "HEAD") == 0);
-    if (strcmp(req.method, "GET") != 0 && strcmp(req.method, "HEAD") != 0)
+    ctx->is_head = (strcmp(ctx->req.method, "HEAD") == 0);
+    if (strcmp(ctx->req.method, "GET") != 0 && strcmp(ctx->req.method, "HEAD") != 0)
     {
-        status_code = 405;
-        send_error_page(client_socket, 405, "Method Not Allowed", &bytes_sent);
-        status_code = 405;
-        goto update_stats_and_log;
+        request_error(ctx, 405, "Method Not Allowed");
+        return;
     }
 
     // Security check: I prevent directory traversal attacks.
-    if (strstr(req.path, ".."))
+    if (strstr(ctx->req.path, ".."))
     {
-        status_code = 403;
-        send_error_page(client_socket, 403, "Forbidden", &bytes_sent);
-        status_code = 403;
-        goto update_stats_and_log;
+        request_error(ctx, 403, "Forbidden");
+        return;
     }
 
     // Special endpoint: /stats returns server statistics as JSON.
-    if (strcmp(req.path, "/stats") == 0)
+    if (strcmp(ctx->req.path, "/stats") == 0)
     {
         sem_wait(&stats->mutex);
-        char json_body[1024];
-        snprintf(json_body, sizeof(json_body),
+        char json_body[4096];
+        int off = snprintf(json_body, sizeof(json_body),
             "{"
             "\"active_connections\": %d,"
             "\"total_requests\": %ld,"
@@ -185,8 +593,8 @@ void handle_client(int client_socket)
             "\"status_200\": %ld,"
             "\"status_404\": %ld,"
             "\"status_500\": %ld,"
-            "\"avg_response_time_ms\": %ld"
-            "}",
+            "\"avg_response_time_ms\": %ld,"
+            "\"workers\": [",
             stats->active_connections,
             stats->total_requests,
             stats->bytes_transferred,
@@ -197,250 +605,514 @@ void handle_client(int client_socket)
         );
         sem_post(&stats->mutex);
 
-        size_t len = strlen(json_body);
-        send_http_response(client_socket, 200, "OK", "application/json", json_body, len);
-        bytes_sent = len;
-        status_code = 200;
-        goto update_stats_and_log;
-    }
-
-    // I check for HTTP Range requests (for partial file downloads).
-    long range_start = -1;
-    long range_end = -1;
-    char *range_header = strstr(buffer, "Range: bytes=");
-    if (range_header) {
-        range_header += 13; // Skip "Range: bytes="
-        char *dash = strchr(range_header, '-');
-        if (dash) {
-            *dash = '\0';
-            range_start = atol(range_header);
-            if (*(dash + 1) != '\r' && *(dash + 1) != '\n') {
-                range_end = atol(dash + 1);
-            }
-            *dash = '-'; // Restore the buffer
+        // I also report the load every worker publishes for the dispatcher.
+        for (int i = 0; worker_loads && i < config.num_workers && off < (int)sizeof(json_body); i++) {
+            off += snprintf(json_body + off, sizeof(json_body) - off,
+                "%s{\"queue_depth\": %d, \"active_connections\": %d, \"pool_threads\": %d}",
+                i ? "," : "",
+                __atomic_load_n(&worker_loads[i].queue_depth, __ATOMIC_RELAXED),
+                __atomic_load_n(&worker_loads[i].active_connections, __ATOMIC_RELAXED),
+                __atomic_load_n(&worker_loads[i].pool_threads, __ATOMIC_RELAXED));
+        }
+        // Then the cache, added up over its shards. With CACHE_SHARED=0 that's only my own cache.
+        cache_stats_t cs;
+        cache_get_stats(&cs);
+        if (off < (int)sizeof(json_body)) {
+            snprintf(json_body + off, sizeof(json_body) - off,
+                "],\"cache\": {\"shards\": %d, \"entries\": %ld, \"bytes_used\": %zu, \"capacity\": %zu, "
+                "\"hits\": %ld, \"misses\": %ld, \"rejected\": %ld, \"admission\": \"%s\"}}",
+                cs.shards, cs.entries, cs.used, cs.capacity, cs.hits, cs.misses, cs.rejected,
+                config.cache_admission == CACHE_ADMISSION_TINYLFU ? "tinylfu" : "all");
         }
+
+        ctx->status = 200;
+        ctx->status_text = "OK";
+        ctx->mime = "application/json";
+        ctx->content_len = strlen(json_body);
+        ctx->content = arena_alloc(ctx->arena, ctx->content_len);
+        if (!ctx->content) {
+            request_error(ctx, 500, "Internal Server Error");
+            return;
+        }
+        memcpy(ctx->content, json_body, ctx->content_len);
+        finalize_body(ctx);
+        return;
+    }
+
+    // I check for HTTP Range requests (for partial file downloads). Range only means
+    // something for GET, so a HEAD describes the whole file.
+    const http_header_t *range = http_find_header(parser, buffer, "Range");
+    if (range && !ctx->is_head) {
+        parse_ranges(ctx, buffer + range->value_off, range->value_len);
     }
 
     // I handle virtual hosts: check if there's a directory matching the Host header.
-    char full_path[2048];
     char vhost_path[1024];
     int vhost_found = 0;
 
     // Parse the Host header from the request.
-    char *host_header = strstr(buffer, "Host: ");
-    if (host_header) {
-        host_header += 6; // Skip "Host: "
-        char *end = strchr(host_header, '\r');
-        if (!end) end = strchr(host_header, '\n');
-        if (end) {
-            char host[256];
-            size_t len = end - host_header;
-            if (len > 255) len = 255;
-            strncpy(host, host_header, len);
-            host[len] = '\0';
-            
-            // Remove port if present
-            char *colon = strchr(host, ':');
-            if (colon) *colon = '\0';
-
-            // Check if directory exists: www/host
-            snprintf(vhost_path, sizeof(vhost_path), "%s/%s", config.document_root, host);
-            struct stat st_vhost;
-            if (stat(vhost_path, &st_vhost) == 0 && S_ISDIR(st_vhost.st_mode)) {
-                snprintf(full_path, sizeof(full_path), "%s%s", vhost_path, req.path);
-                vhost_found = 1;
-            }
+    const http_header_t *host_header = http_find_header(parser, buffer, "Host");
+    if (host_header && host_header->value_len > 0) {
+        char host[256];
+        size_t len = host_header->value_len;
+        if (len > 255) len = 255;
+        memcpy(host, buffer + host_header->value_off, len);
+        host[len] = '\0';
+        
+        // Remove port if present
+        char *colon = strchr(host, ':');
+        if (colon) *colon = '\0';
+
+        // Check if directory exists: www/host
+        snprintf(vhost_path, sizeof(vhost_path), "%s/%s", config.document_root, host);
+        struct stat st_vhost;
+        if (stat(vhost_path, &st_vhost) == 0 && S_ISDIR(st_vhost.st_mode)) {
+            snprintf(ctx->full_path, sizeof(ctx->full_path), "%s%s", vhost_path, ctx->req.path);
+            vhost_found = 1;
         }
     }
 
     if (!vhost_found) {
-        snprintf(full_path, sizeof(full_path), "%s%s", config.document_root, req.path);
+        snprintf(ctx->full_path, sizeof(ctx->full_path), "%s%s", config.document_root, ctx->req.path);
     }
 
     // If the path is a directory, I serve index.html.
     struct stat st;
-    if (stat(full_path, &st) == 0 && S_ISDIR(st.st_mode))
+    int found = (stat(ctx->full_path, &st) == 0);
+    if (found && S_ISDIR(st.st_mode))
     {
-        strncat(full_path, "/index.html", sizeof(full_path) - strlen(full_path) - 1);
+        strncat(ctx->full_path, "/index.html", sizeof(ctx->full_path) - strlen(ctx->full_path) - 1);
+        found = (stat(ctx->full_path, &st) == 0);
     }
 
     // Check if the file exists.
-    if (stat(full_path, &st) != 0) {
-        status_code = 404;
-        send_error_page(client_socket, 404, "Not Found", &bytes_sent);
-        goto update_stats_and_log;
+    if (!found) {
+        request_error(ctx, 404, "Not Found");
+        return;
     }
 
-    long fsize = st.st_size;
-    char *content = NULL;
-    size_t read_bytes = 0;
+    ctx->status = 200;
+    ctx->status_text = "OK";
+
+    // * COMPRESSION
+    // A compressed version may replace the file.
+    if (config.compression != COMPRESSION_OFF) choose_encoding(ctx, parser, buffer, &st);
+
+    // * VALIDATORS
+    // The stat() I just did is all I need for ETag and Last-Modified, so a conditional
+    // request for an unchanged file is answered without reading (or copying) a byte of it.
+    ctx->stamp.size = st.st_size;
+    ctx->stamp.mtime_sec = st.st_mtim.tv_sec;
+    ctx->stamp.mtime_nsec = st.st_mtim.tv_nsec;
+    ctx->stamp.ino = st.st_ino;
+    ctx->has_stamp = 1;
+    if (not_modified(ctx, parser, buffer)) {
+        ctx->status = 304;
+        ctx->status_text = "Not Modified";
+        ctx->range_count = 0;
+        ctx->compress = 0;
+        finalize_body(ctx);
+        return;
+    }
 
     // * CACHING LOGIC
     // I only cache files smaller than 1MB to save memory.
-    if (fsize > 0 && fsize < (1 * 1024 * 1024)) {
-        // First, I try to get the file from cache.
-        if (cache_get(full_path, &content, &read_bytes) == 0) {
-            // Cache HIT! 'content' now has a copy of the cached data.
-        } else {
-            // Cache MISS: I need to read from disk.
-            FILE *fp = fopen(full_path, "rb");
-            if (!fp) {
-                status_code = 404;
-                send_error_page(client_socket, 404, "Not Found", &bytes_sent);
-                goto update_stats_and_log;
-            }
-            char *buf = malloc(fsize);
-            if (!buf) {
-                fclose(fp);
-                status_code = 500;
-                send_error_page(client_socket, 500, "Internal Server Error", &bytes_sent);
-                goto update_stats_and_log;
-            }
-            size_t rb = fread(buf, 1, fsize, fp);
-            fclose(fp);
-            
-            if (rb != (size_t)fsize) {
-                free(buf);
-                status_code = 500;
-                send_error_page(client_socket, 500, "Internal Server Error", &bytes_sent);
-                goto update_stats_and_log;
-            }
-            read_bytes = rb;
-            content = buf;
+    // On a HIT 'content' now points at the cached data itself (pinned until the response
+    // is out), with a ready-made header in front of it, and I'm done. I don't even need the MIME type unless that header won't do.
+    // An entry read from an older version of the file doesn't count.
+    long fsize = st.st_size;
+    char key[sizeof(ctx->full_path) + 8];
+    if (fsize > 0 && fsize < MAX_CACHED_FILE_SIZE &&
+        cache_get(cache_key(ctx, key, sizeof(key)), &ctx->stamp, &ctx->cache_ref, &ctx->cached_header,
+                  &ctx->cached_header_len, &ctx->content, &ctx->content_len) == 0) {
+        ctx->compress = 0;
+        finalize_body(ctx);
+        return;
+    }
 
-            // I update the cache for next time (best effort).
-            cache_put(full_path, content, read_bytes);
-        }
-    } else {
-        // Large files: I read directly from disk without caching.
-        FILE *fp = fopen(full_path, "rb");
-        if (!fp) {
-            status_code = 404;
-            send_error_page(client_socket, 404, "Not Found", &bytes_sent);
-            goto update_stats_and_log;
-        }
-        char *buf = malloc(fsize);
-        if (!buf) {
-            fclose(fp);
-            status_code = 500;
-            send_error_page(client_socket, 500, "Internal Server Error", &bytes_sent);
-            goto update_stats_and_log;
-        }
-        size_t rb = fread(buf, 1, fsize, fp);
-        fclose(fp);
-        if (rb != (size_t)fsize) {
-            free(buf);
-            status_code = 500;
-            // ... send 500 ...
-            close(client_socket);
-            goto update_stats_and_log;
+    // Determine the MIME type for the response header.
+    if (!ctx->mime) ctx->mime = get_mime_type(ctx->full_path);
+
+    // Cache MISS: a file the cache will keep is read into memory (and cached when it arrives).
+    if (fsize < MAX_CACHED_FILE_SIZE) {
+        ctx->needs_disk = 1;
+        return;
+    }
+
+    // Anything bigger is never loaded: I keep the file open and the body is streamed
+    // straight from it to the socket, so memory use doesn't grow with the file.
+    ctx->file_fd = open(ctx->full_path, O_RDONLY | O_CLOEXEC);
+    if (ctx->file_fd < 0) {
+        if (errno == ENOENT) request_error(ctx, 404, "Not Found");
+        else request_error(ctx, 500, "Internal Server Error");
+        return;
+    }
+    ctx->content_len = (size_t)fsize;
+    finalize_body(ctx);
+}
+
+// I finish a file read for this request. rc, buf and len are what read_whole_file()
+// produced (however it was done). If the read failed I switch to an error page,
+// which may need another read, so callers loop while needs_disk is set.
+void request_loaded(request_ctx_t *ctx, int rc, char *buf, size_t len)
+{
+    ctx->needs_disk = 0;
+
+    if (rc != 0) {
+        if (ctx->is_error_page) {
+            // Fallback: I send a simple HTML error message.
+            char body[512];
+            snprintf(body, sizeof(body), "<h1>%d %s</h1>", ctx->status, ctx->status_text);
+            ctx->content_len = strlen(body);
+            ctx->content = arena_alloc(ctx->arena, ctx->content_len);
+            if (ctx->content) memcpy(ctx->content, body, ctx->content_len);
+            else ctx->content_len = 0;
+            finalize_body(ctx);
+            return;
         }
-        content = buf;
-        read_bytes = rb;
+        // The file vanished after I checked it, or I couldn't read it.
+        // The error page itself may need a read.
+        if (rc == -1) request_error(ctx, 404, "Not Found");
+        else request_error(ctx, 500, "Internal Server Error");
+        return;
     }
 
-    // Determine the MIME type for the response header.
-    const char *mime = get_mime_type(full_path);
-    
-    // Handle Range requests (partial content).
-    if (range_start != -1) {
-        // Partial Content response (206)
-        if (range_end == -1 || range_end >= fsize) range_end = fsize - 1;
-        long content_length = range_end - range_start + 1;
-        
-        status_code = 206;
-        
-        // Construct Content-Range header
-        char extra_headers[128];
-        snprintf(extra_headers, sizeof(extra_headers), "Content-Range: bytes %ld-%ld/%ld\r\n", range_start, range_end, fsize);
-        
-        // Send the header
-        char header[1024];
-        snprintf(header, sizeof(header), 
-            "HTTP/1.1 206 Partial Content\r\n"
-            "Content-Type: %s\r\n"
-            "Content-Length: %ld\r\n"
-            "%s"
-            "Connection: keep-alive\r\n"
-            "\r\n", mime, content_length, extra_headers);
-        send(client_socket, header, strlen(header), MSG_NOSIGNAL);
-        
-        // Send the body (or just header for HEAD requests)
-        if (!is_head) {
-            if (content) {
-                // From cache or full read
-                send(client_socket, content + range_start, content_length, MSG_NOSIGNAL);
-            } else {
-                // For large files, I need to read just the requested range
-                FILE *fp = fopen(full_path, "rb");
-                 if (fp) {
-                     fseek(fp, range_start, SEEK_SET);
-                     char *chunk = malloc(content_length);
-                     if (chunk) {
-                         size_t rb = fread(chunk, 1, content_length, fp);
-                         if (rb > 0) {
-                            send(client_socket, chunk, rb, MSG_NOSIGNAL);
-                         }
-                         free(chunk);
-                     }
-                     fclose(fp);
-                 }
-            }
+    ctx->content = buf;
+    ctx->content_len = len;
+
+    // I update the cache for next time (best effort).
+    // Large files are read directly from disk without caching.
+    // Along with the file I store the header of a plain 200 keep-alive response for it,
+    // which is what almost every later hit sends; only its Date changes.
+    if (len > 0 && len < MAX_CACHED_FILE_SIZE) {
+        const char *mime = ctx->mime ? ctx->mime : get_mime_type(ctx->full_path);
+        const cache_stamp_t *stamp = ctx->has_stamp ? &ctx->stamp : NULL;
+        int vary = config.compression != COMPRESSION_OFF && is_compressible(mime);
+        char extra[256];
+        char head[768];
+        char key[sizeof(ctx->full_path) + 8];
+
+        // In dynamic mode I gzip the file now and keep both versions, so the next client
+        // gets whichever it accepts straight from memory. If gzip doesn't make the file
+        // smaller I send it as it is.
+        char *packed = NULL;
+        size_t packed_len = 0;
+        if (ctx->compress && gzip_compress(ctx->arena, buf, len, &packed, &packed_len) != 0) {
+            ctx->encoding = NULL;
         }
-        bytes_sent = content_length;
-    }
-    else {
-        // Normal 200 OK response
-        status_code = 200;
-        if (is_head) // HEAD request: send headers only
-        {
-            send_http_response(client_socket, 200, "OK", mime, NULL, fsize);
-            bytes_sent = 0;
+        ctx->compress = 0;
+
+        // What I read goes in under its own key (a sidecar under its coding); the gzip I just
+        // made goes in next to it.
+        const char *encoding = ctx->encoding;
+        ctx->encoding = packed ? NULL : encoding;
+        entity_headers(ctx, extra, sizeof(extra), vary);
+        size_t head_len = http_format_header(head, sizeof(head), 200, "OK", mime, len, extra, 1);
+        cache_put(cache_key(ctx, key, sizeof(key)), stamp, head, head_len, buf, len);
+
+        if (packed) {
+            ctx->encoding = encoding;
+            entity_headers(ctx, extra, sizeof(extra), 1);
+            head_len = http_format_header(head, sizeof(head), 200, "OK", mime, packed_len, extra, 1);
+            cache_put(cache_key(ctx, key, sizeof(key)), stamp, head, head_len, packed, packed_len);
+            ctx->content = packed;
+            ctx->content_len = packed_len;
         }
-        else // GET request: send headers and body
-        {
-            send_http_response(client_socket, 200, "OK", mime, content, fsize);
-            bytes_sent = fsize;
+    }
+    finalize_body(ctx);
+}
+
+// This is the blocking step: I read whatever request_route() couldn't find in memory.
+// Thread pool threads call this; the event loop never does, unless it has no threads.
+void request_load(request_ctx_t *ctx)
+{
+    while (ctx->needs_disk) {
+        char *buf = NULL;
+        size_t len = 0;
+        int rc = read_whole_file(ctx->full_path, ctx->arena, &buf, &len);
+        request_loaded(ctx, rc, buf, len);
+    }
+}
+
+// I look for one complete request at the front of a connection's receive buffer.
+// Every engine calls this whenever new bytes arrive; the parser remembers how far it got,
+// so I never rescan what I've already seen. I return 1 when I routed a request (and removed
+// it from the buffer), 0 when I need more bytes, and -1 when the request is malformed or
+// too big (the context then holds the error response and the caller should hang up).
+int request_take(request_ctx_t *ctx, arena_t *arena, http_parser_t *parser, char *buf, size_t *len, size_t cap)
+{
+    int rc = http_parse(parser, buf, *len);
+    if (rc == HTTP_PARSE_INCOMPLETE && *len >= cap - 1) {
+        // The request doesn't fit in the buffer, so I refuse it. If I haven't even
+        // seen the whole request line, it's the URI that's too long.
+        parser->error_status = (parser->method_len == 0) ? 414 : 431;
+        rc = HTTP_PARSE_ERROR;
+    }
+    if (rc == HTTP_PARSE_INCOMPLETE) return 0; // Still waiting for the rest.
+
+    if (rc == HTTP_PARSE_ERROR) {
+        request_begin(ctx, arena);
+        if (parser->error_status == 414) request_error(ctx, 414, "URI Too Long");
+        else if (parser->error_status == 431) request_error(ctx, 431, "Request Header Fields Too Large");
+        else if (parser->error_status == 501) request_error(ctx, 501, "Not Implemented");
+        else request_error(ctx, 400, "Bad Request");
+        http_parser_init(parser);
+        *len = 0;
+        return -1;
+    }
+
+    request_begin(ctx, arena);
+    request_route(ctx, parser, buf);
+
+    // I don't use request bodies, but I have to skip them to find the next request.
+    // If the body isn't all here I answer and close rather than wait for it.
+    size_t request_len = parser->head_len;
+    if (parser->content_length > 0) {
+        if ((size_t)parser->content_length <= *len - request_len) {
+            request_len += (size_t)parser->content_length;
+        } else {
+            ctx->keep_alive = 0;
+            request_len = *len;
         }
     }
 
-    free(content);
+    // I drop the request from the buffer and keep whatever the client sent after it.
+    memmove(buf, buf + request_len, *len - request_len);
+    *len -= request_len;
+    http_parser_init(parser);
+    return 1;
+}
+
+// I return the response header for this request and put its length in *len.
+// When the cache handed me a header that says exactly this (a full 200 on a connection
+// that stays open), I copy it into buf and refresh its Date there; the cached one is
+// shared by everyone sending that file, so I never write to it. Otherwise I build the header into buf.
+const char *request_header(request_ctx_t *ctx, char *buf, size_t cap, size_t *len)
+{
+    if (ctx->cached_header && ctx->status == 200 && ctx->keep_alive && ctx->cached_header_len <= cap) {
+        memcpy(buf, ctx->cached_header, ctx->cached_header_len);
+        http_refresh_date(buf, ctx->cached_header_len);
+        *len = ctx->cached_header_len;
+        return buf;
+    }
+    if (!ctx->mime) ctx->mime = get_mime_type(ctx->full_path);
+    char extra[sizeof(ctx->extra_headers) + 256];
+    size_t used = (size_t)snprintf(extra, sizeof(extra), "%s", ctx->extra_headers);
+    entity_headers(ctx, extra + used, sizeof(extra) - used, ctx->vary);
+    *len = http_format_header(buf, cap, ctx->status, ctx->status_text, ctx->mime,
+                              (size_t)ctx->content_length, extra, ctx->keep_alive);
+    return buf;
+}
 
-// * Cleanup Label: I use goto to handle errors and normal completion in one place.
-update_stats_and_log:
+// When the response is out, I update the statistics, write the access log and free the body.
+void request_finish(request_ctx_t *ctx, const char *client_ip)
+{
+    struct timespec end_time;
     clock_gettime(CLOCK_MONOTONIC, &end_time);
-    long elapsed_ms = get_time_diff_ms(start_time, end_time);
+    long elapsed_ms = get_time_diff_ms(ctx->start_time, end_time);
 
     // Update shared statistics (thread-safe)
     sem_wait(&stats->mutex);
     stats->total_requests++;
-    stats->bytes_transferred += bytes_sent;
+    stats->bytes_transferred += ctx->bytes_sent;
     stats->average_response_time += elapsed_ms;
 
-    if (status_code == 200) stats->status_200++;
-    else if (status_code == 404) stats->status_404++;
-    else if (status_code == 500) stats->status_500++;
+    // A 206 is still a successful file response, so I count it with the 200s like before.
+    if (ctx->status == 200 || ctx->status == 206) stats->status_200++;
+    else if (ctx->status == 404) stats->status_404++;
+    else if (ctx->status == 500) stats->status_500++;
     
     sem_post(&stats->mutex);
 
     // Log the request in Apache format
-    const char *log_method = (req.method[0] != '\0') ? req.method : "-";
-    const char *log_path = (req.path[0] != '\0') ? req.path : "-";
+    const char *log_method = (ctx->req.method[0] != '\0') ? ctx->req.method : "-";
+    const char *log_path = (ctx->req.path[0] != '\0') ? ctx->req.path : "-";
     
-    log_request(&queue->log_mutex, client_ip, log_method, log_path, status_code, bytes_sent);
+    log_request(&queue->log_mutex, client_ip, log_method, log_path, ctx->status, ctx->bytes_sent);
+
+    // The body belongs to the arena (the connection resets it once the response is out)
+    // or to the cache, which gets its entry back here.
+    ctx->content = NULL;
+    request_release(ctx);
+}
+
+// I close the file a streamed response was coming from, and unpin the cache entry an
+// in-memory one was sent from. request_finish() does this; engines call it themselves
+// when a connection dies before its response is out.
+void request_release(request_ctx_t *ctx)
+{
+    if (ctx->file_fd >= 0) close(ctx->file_fd);
+    ctx->file_fd = -1;
+    cache_release(ctx->cache_ref);
+    ctx->cache_ref = NULL;
+}
+
+// I stream the body of a response from its file with sendfile(), SENDFILE_CHUNK bytes
+// per call at most, and keep body_offset/body_len up to date as the bytes go out.
+// A multipart body goes part by part, each slice behind its boundary lines.
+// I return 0 when the body is all out, 1 if a non-blocking socket is full, -1 on error.
+int request_send_file(request_ctx_t *ctx, int client_fd)
+{
+    do {
+        // MSG_MORE keeps a part's boundary lines together with the slice after them.
+        while (ctx->part_head.iov_len > 0) {
+            ssize_t n = send(client_fd, ctx->part_head.iov_base, ctx->part_head.iov_len,
+                             MSG_NOSIGNAL | (ctx->body_len > 0 ? MSG_MORE : 0));
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+                return -1;
+            }
+            ctx->part_head.iov_base = (char *)ctx->part_head.iov_base + n;
+            ctx->part_head.iov_len -= (size_t)n;
+        }
+        while (ctx->body_len > 0) {
+            off_t offset = ctx->body_offset;
+            size_t chunk = (ctx->body_len < SENDFILE_CHUNK) ? (size_t)ctx->body_len : SENDFILE_CHUNK;
+            ssize_t n = sendfile(client_fd, ctx->file_fd, &offset, chunk);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+                return -1;
+            }
+            if (n == 0) return -1; // The file got shorter under me.
+            ctx->body_offset += n;
+            ctx->body_len -= n;
+        }
+    } while (request_next_part(ctx, &ctx->part_head));
+    return 0;
+}
 
+// Once the current slice of a multipart body is out, I move on to the next part:
+// *head gets the boundary lines that go first and body_offset/body_len the slice after
+// them (nothing after the closing boundary). I return 0 when the body is complete.
+int request_next_part(request_ctx_t *ctx, struct iovec *head)
+{
+    if (ctx->part + 1 >= ctx->part_steps) return 0;
+    int i = ++ctx->part;
+    head->iov_base = ctx->part_heads + ctx->part_head_off[i];
+    head->iov_len = ctx->part_head_off[i + 1] - ctx->part_head_off[i];
+    if (i < ctx->part_steps - 1) {
+        ctx->body_offset = ctx->range_first[i];
+        ctx->body_len = ctx->range_last[i] - ctx->range_first[i] + 1;
+    } else {
+        ctx->body_len = 0;
+    }
+    return 1;
+}
+
+// This is the main function that handles each client connection.
+// It processes HTTP requests from start to finish, blocking this thread the whole time.
+void handle_client(int client_socket)
+{
+    // A connection coming back from the idle poller is already counted and set up.
+    if (!idle_poller_resumed(client_socket)) {
+        // 1. I increment the active connections counter.
+        track_connection(1);
+
+        prepare_client_socket(client_socket);
+
+        // I set a timeout on the socket for keep-alive connections.
+        struct timeval tv;
+        tv.tv_sec = config.keep_alive_timeout > 0 ? config.keep_alive_timeout : 5;
+        tv.tv_usec = 0;
+        setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+    }
+
+    char client_ip[INET_ADDRSTRLEN];
+    get_client_ip(client_socket, client_ip, sizeof(client_ip));
+
+    // I keep the bytes the client sent in one buffer so pipelined requests aren't lost.
+    char buffer[HTTP_MAX_HEADER_BYTES + 1];
+    size_t buffered = 0;
+    http_parser_t parser;
+    http_parser_init(&parser);
+    // Every response in a batch is built in this arena; I reset it once they're all out.
+    arena_t arena;
+    arena_init(&arena);
+
+    // I can handle multiple requests on the same connection (keep-alive).
+    // Pipelined requests are answered in batches: every complete request in the buffer
+    // (up to PIPELINE_BATCH) gets its response built, then they all go out in one write.
+    request_ctx_t batch[PIPELINE_BATCH];
+    char headers[PIPELINE_BATCH][2048];
+    struct iovec iov[PIPELINE_BATCH * 2];
+    while (1) {
+        int count = 0;
+        int last = 0; // Set when the connection ends after this batch.
+        while (count < PIPELINE_BATCH && !last) {
+            request_ctx_t *ctx = &batch[count];
+            int taken = request_take(ctx, &arena, &parser, buffer, &buffered, sizeof(buffer));
+            if (taken == 0) break;
+
+            // I work out the answer, reading from disk if the cache couldn't help.
+            request_load(ctx);
+            count++;
+
+            // A bad request or a client that asked to close ends the connection.
+            if (taken < 0 || !ctx->keep_alive) last = 1;
+        }
+
+        if (count == 0) {
+            // If the next request isn't here yet, I park the socket with the idle poller
+            // instead of blocking, and give my thread back to the pool.
+            // I only do that between requests, when there's nothing buffered to lose.
+            char peek;
+            if (buffered == 0 &&
+                recv(client_socket, &peek, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+                (errno == EAGAIN || errno == EWOULDBLOCK) &&
+                idle_poller_park(client_socket) == 0) {
+                return;
+            }
+
+            // I read more of the request from the client.
+            ssize_t bytes = recv(client_socket, buffer + buffered, sizeof(buffer) - 1 - buffered, 0);
+            if (bytes <= 0)
+            {
+                // Connection closed or timeout - I break out of the loop.
+                break;
+            }
+            buffered += (size_t)bytes;
+            continue;
+        }
+
+        // Each response is its header, then its body (nothing for HEAD requests), in request order.
+        // A body streamed from a file breaks the batch: I flush what's queued, then sendfile() it.
+        int iov_count = 0;
+        int sent = 0;
+        for (int i = 0; i < count && sent == 0; i++) {
+            iov[iov_count].iov_base = (void *)request_header(&batch[i], headers[i], sizeof(headers[i]),
+                                                             &iov[iov_count].iov_len);
+            iov_count++;
+            if (batch[i].file_fd >= 0) {
+                // MSG_MORE lets the header share a segment with the start of the file.
+                sent = http_send_iov(client_socket, iov, iov_count, batch[i].body_len > 0 ? MSG_MORE : 0);
+                iov_count = 0;
+                if (sent == 0) sent = request_send_file(&batch[i], client_socket);
+            } else if (batch[i].body_len > 0) {
+                iov[iov_count].iov_base = batch[i].content + batch[i].body_offset;
+                iov[iov_count].iov_len = batch[i].body_len;
+                iov_count++;
+            }
+        }
+        if (sent == 0) sent = http_send_iov(client_socket, iov, iov_count, 0);
+
+        for (int i = 0; i < count; i++) {
+            request_finish(&batch[i], client_ip);
+        }
+        arena_reset(&arena);
+        if (sent != 0 || last) break;
     } // End of while(1) keep-alive loop
 
     // Connection is closing, so I clean up.
     close(client_socket);
-    sem_wait(&stats->mutex);
-    stats->active_connections--; // Decrement active connections
-    sem_post(&stats->mutex);
+    track_connection(-1);
 }
 
-// This function receives a file descriptor from another process via UNIX socket.
-// It's the counterpart to send_fd() in master.c.
-static int recv_fd(int socket)
+// This function receives a batch of file descriptors from another process via UNIX socket.
+// It's the counterpart to send_fds() in master.c.
+// I return how many fds I got, or -1 when the master hung up.
+static int recv_fds(int socket, int *fds, int max_fds)
 {
     struct msghdr msg = {0};
 
@@ -449,9 +1121,10 @@ static int recv_fd(int socket)
     struct iovec io = {.iov_base = buf, .iov_len = 1};
 
     // I use a union for proper alignment of the control buffer.
+    // It's sized for the biggest batch the master is allowed to send.
     union
     {
-        char buf[CMSG_SPACE(sizeof(int))];
+        char buf[CMSG_SPACE(sizeof(int) * MAX_ACCEPT_BATCH)];
         struct cmsghdr align;
     } u;
 
@@ -463,27 +1136,129 @@ static int recv_fd(int socket)
     msg.msg_controllen = sizeof(u.buf);
 
     // Perform the receive operation
-    if (recvmsg(socket, &msg, 0) < 0)
+    ssize_t r;
+    do {
+        r = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+    } while (r < 0 && errno == EINTR);
+    if (r <= 0)
         return -1;
 
-    // Extract the file descriptor from the control message
-    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-    
-    // Verify it's the right type of message
-    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    // Extract the file descriptors from the control messages
+    int count = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
     {
-        return *((int *)CMSG_DATA(cmsg)); // Here's the file descriptor!
+        // Verify it's the right type of message
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < n; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (count < max_fds) fds[count++] = fd;
+            else close(fd); // This can't happen with a well-behaved master, but I won't leak it.
+        }
     }
     
-    return -1; // Failed to receive a valid FD
+    return count; // Zero means a message without fds, which I just skip.
+}
+
+// I take the next burst of connections the master sent me and mark them as arrived,
+// so they stop counting as "in transit" in my published load.
+int receive_connections(int ipc_socket, int *fds, int max_fds)
+{
+    int count = recv_fds(ipc_socket, fds, max_fds);
+    if (count > 0 && my_load) __atomic_sub_fetch(&my_load->in_transit, count, __ATOMIC_RELAXED);
+    return count;
+}
+
+// I drain my listener's backlog in one burst and return how many fds I got.
+static int accept_burst(int listen_fd, int *fds, int max_fds)
+{
+    int count = 0;
+    while (count < max_fds) {
+        int client_fd = accept(listen_fd, NULL, NULL);
+        if (client_fd < 0) {
+            if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
+                perror("accept");
+            }
+            break;
+        }
+        fds[count++] = client_fd;
+    }
+    return count;
+}
+
+// In reuseport mode I accept connections myself instead of waiting for the master.
+// I also keep an eye on the IPC socket: when the master closes it, it's time to stop.
+// Like the master, I drain my backlog in one burst and return how many fds I got,
+// or -1 when I should shut down.
+static int accept_clients(int listen_fd, int ipc_socket, int *fds, int max_fds)
+{
+    struct pollfd pfds[2] = {
+        {.fd = listen_fd, .events = POLLIN},
+        {.fd = ipc_socket, .events = POLLIN},
+    };
+
+    while (1) {
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return -1;
+        }
+
+        // Any activity on the IPC socket means the master hung up on me.
+        if (pfds[1].revents) {
+            char c;
+            if (recv(ipc_socket, &c, 1, MSG_DONTWAIT) <= 0) return -1;
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            int count = accept_burst(listen_fd, fds, max_fds);
+            if (count > 0) return count;
+        }
+    }
+}
+
+// With the idle poller running, the dispatcher waits in epoll instead.
+// I return new connections and parked ones whose next request arrived, all ready
+// for the local queue, or -1 when I should shut down.
+static int poll_clients(int listen_fd, int ipc_socket, int *fds, int batch_size)
+{
+    int ipc_ready, listen_ready;
+    int count = idle_poller_wait(fds, &ipc_ready, &listen_ready);
+    if (count < 0) return -1;
+
+    if (ipc_ready) {
+        if (listen_fd >= 0) {
+            // In reuseport mode the IPC socket only ever tells me to stop.
+            char c;
+            if (recv(ipc_socket, &c, 1, MSG_DONTWAIT) <= 0) return -1;
+        } else {
+            int received = receive_connections(ipc_socket, fds + count, MAX_ACCEPT_BATCH);
+            if (received < 0) return -1; // The master hung up.
+            count += received;
+        }
+    }
+    if (listen_ready) {
+        count += accept_burst(listen_fd, fds + count, batch_size);
+    }
+    return count;
 }
 
 // This is the main entry point for a worker process.
 // The master process calls fork() and then the child executes this function.
-void start_worker_process(int ipc_socket)
+void start_worker_process(int ipc_socket, int worker_id)
 {
     printf("Worker (PID: %d) started\n", getpid());
 
+    // I settle on my CPUs (and their NUMA node) before I allocate anything,
+    // so my queue, cache and thread stacks are all first touched on local memory.
+    apply_worker_affinity(worker_id);
+
+    // I publish my load in the shared slot the master gave me.
+    if (worker_loads) my_load = &worker_loads[worker_id];
+
     // Initialize time zone for proper logging timestamps
     tzset();
     
@@ -498,77 +1273,119 @@ void start_worker_process(int ipc_socket)
 
     // Initialize the local queue for this worker's thread pool
     local_queue_t local_q;
-    if (local_queue_init(&local_q, config.max_queue_size) != 0) {
+    // The pool starts at MIN_THREADS and may grow to MAX_THREADS (both default to THREADS_PER_WORKER).
+    int min_threads = config.min_threads > 0 ? config.min_threads : config.threads_per_worker;
+    if (min_threads < 1) min_threads = 1;
+    int max_threads = config.max_threads > min_threads ? config.max_threads : min_threads;
+    if (local_queue_init(&local_q, config.max_queue_size, config.queue_type, max_threads) != 0) {
         perror("local_queue_init");
     }
+    if (my_load) local_q.published_depth = &my_load->queue_depth;
     
-    // Initialize the file cache
+    // Initialize the file cache, unless I share the one the master mapped for all of us.
     size_t cache_bytes = (size_t)config.cache_size_mb * 1024 * 1024;
-    if (cache_init(cache_bytes) != 0) {
+    if (!config.cache_shared && cache_init(cache_bytes, 0, config.cache_shards, config.cache_admission) != 0) {
         perror("cache_init");
     }
 
-    // Create the thread pool
-    int thread_count = config.threads_per_worker > 0 ? config.threads_per_worker : 0;
-    pthread_t *threads = NULL;
-    if (thread_count > 0) {
-        threads = malloc(sizeof(pthread_t) * thread_count);
-        if (!threads) {
-            perror("Failed to allocate worker threads array");
-            thread_count = 0;
-        }
+    // The io_uring loop reads files through the ring itself, so it needs no pool threads.
+    // If this kernel won't give me a ring, I fall back to the default thread-per-connection model.
+    if (config.io_model == IO_MODEL_URING && uring_loop_init() != 0) {
+        fprintf(stderr, "[Worker %d] io_uring unavailable, falling back to threads.\n", getpid());
+        config.io_model = IO_MODEL_THREADS;
+    }
+
+    // In event loop mode my threads only do the blocking disk reads for the loop.
+    if (config.io_model == IO_MODEL_EPOLL) {
+        local_q.handler = event_loop_disk_job;
     }
 
+    // Create the thread pool
     int created = 0;
-    for (int i = 0; i < thread_count; i++) {
-        if (pthread_create(&threads[i], NULL, worker_thread, &local_q) != 0) {
-            perror("pthread_create");
-            break;
+    if (config.io_model != IO_MODEL_URING && config.threads_per_worker > 0) {
+        created = local_queue_start_threads(&local_q, min_threads, max_threads,
+                                            config.thread_idle_timeout * 1000,
+                                            my_load ? &my_load->pool_threads : NULL);
+    }
+
+    // In reuseport mode I get my own listening socket on the shared port.
+    int listen_fd = -1;
+    if (config.listener_mode == LISTENER_REUSEPORT) {
+        listen_fd = create_server_socket(config.port, 1);
+        if (listen_fd < 0) {
+            // The master sends me nothing in this mode, so without a listener I could never
+            // serve anyone. I exit with an error so the master sees I'm gone.
+            fprintf(stderr, "[Worker %d] Could not bind SO_REUSEPORT listener.\n", getpid());
+            exit(1);
+        } else {
+            // I drain my backlog until EAGAIN, so the listener must never block.
+            fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
         }
-        created++;
     }
 
-    // * Main Loop: Receive and dispatch connections from master
-    while (1)
+    int batch_size = config.accept_batch;
+    if (batch_size < 1) batch_size = 1;
+    if (batch_size > MAX_ACCEPT_BATCH) batch_size = MAX_ACCEPT_BATCH;
+
+    // * Main Loop: Receive and dispatch connections from master (or accept them myself)
+    // In event loop mode the epoll loop does all of this itself and returns when the master hangs up.
+    if (config.io_model == IO_MODEL_EPOLL) {
+        event_loop_run(ipc_socket, listen_fd, &local_q, created);
+    } else if (config.io_model == IO_MODEL_URING) {
+        uring_loop_run(ipc_socket, listen_fd);
+    }
+
+    // In thread mode I double as the idle poller: parked keep-alive sockets sit in my
+    // epoll set next to the IPC socket, so I stay the only thread feeding the local queue.
+    int parking = (config.io_model == IO_MODEL_THREADS && idle_poller_init(ipc_socket, listen_fd) == 0);
+
+    while (config.io_model == IO_MODEL_THREADS)
     {
-        int client_fd = recv_fd(ipc_socket);
-        if (client_fd < 0) {
+        int fds[IDLE_POLLER_MAX_READY + 2 * MAX_ACCEPT_BATCH];
+        int count;
+        if (parking) count = poll_clients(listen_fd, ipc_socket, fds, batch_size);
+        else if (listen_fd >= 0) count = accept_clients(listen_fd, ipc_socket, fds, batch_size);
+        else count = receive_connections(ipc_socket, fds, MAX_ACCEPT_BATCH);
+        if (count < 0) {
             // IPC socket closed or error - time to shut down
             break;
         }
 
-        // Try to add the client to the local queue
-        if (local_queue_enqueue(&local_q, client_fd) != 0) {
+        // I add the whole burst to the local queue under one lock acquisition.
+        int queued = local_queue_enqueue_batch(&local_q, fds, count);
+
+        // Whatever didn't fit gets turned away.
+        for (int i = queued; i < count; i++) {
             fprintf(stderr, "[Worker %d] Queue full! Rejecting client.\n", getpid());
             
             long bytes_sent = 0;
-            send_error_page(client_fd, 503, "Service Unavailable", &bytes_sent);
+            send_error_page(fds[i], 503, "Service Unavailable", &bytes_sent);
 
-            close(client_fd);
+            if (idle_poller_resumed(fds[i])) track_connection(-1); // It was a parked keep-alive client.
+            close(fds[i]);
         }
     }
 
     // * === Graceful Shutdown Sequence === 
+    if (listen_fd >= 0) close(listen_fd);
     
     // 1. Signal worker threads to stop
-    pthread_mutex_lock(&local_q.mutex); 
-    local_q.shutting_down = 1;
-    pthread_cond_broadcast(&local_q.cond);
-    pthread_mutex_unlock(&local_q.mutex);
+    local_queue_shutdown(&local_q);
 
     // 2. Stop logger thread
     logger_request_shutdown();
     pthread_join(flush_tid, NULL);
 
-    // 3. Join worker threads
-    for (int i = 0; i < created; i++) {
-        pthread_join(threads[i], NULL);
-    }
+    // 3. Wait for the worker threads (however many the pool has right now)
+    if (created > 0) local_queue_join_threads(&local_q);
 
     // 4. Cleanup resources
-    if (threads) free(threads);
+    // No disk jobs are running anymore, so the event loop can close its connections.
+    if (config.io_model == IO_MODEL_EPOLL) event_loop_cleanup();
+    if (config.io_model == IO_MODEL_URING) uring_loop_cleanup();
+    if (parking) idle_poller_cleanup();
     local_queue_destroy(&local_q);
-    cache_destroy();
+    if (!config.cache_shared) cache_destroy(); // The master owns a shared cache.
     
     close(ipc_socket);
 }
\ No newline at end of file
@@ -4,6 +4,58 @@
 #include <stddef.h> // I need size_t for buffer lengths.
 #include <time.h>   // I need struct timespec for timing measurements.
 #include <pthread.h> // I need pthread types for thread operations.
+#include "http.h"    // I need http_request_t for the request context.
+#include "arena.h"   // Request memory comes from the connection's arena.
+#include "cache.h"   // I need cache_stamp_t for a file's validators.
+
+// This is the most ranges I answer in one multipart/byteranges response.
+// A Range header with more of them gets the whole file instead.
+#define MAX_RANGES 16
+
+// This structure follows one HTTP request from parsing to logging.
+// I split the work into steps (route, load, send, finish) so the blocking
+// thread pool and the epoll event loop can share the same request logic.
+typedef struct {
+    http_request_t req;           // The parsed request line.
+    struct timespec start_time;   // When I started working on this request.
+    int is_head;                  // HEAD requests get headers only.
+    int range_count;              // How many ranges the Range header asked for (0: none, or I ignore it).
+    long range_first[MAX_RANGES]; // Each range as the client wrote it: the first byte (-1 for a suffix)...
+    long range_last[MAX_RANGES];  // ...and the last byte (-1 for "to the end"), or the suffix length.
+    long range_size;              // The size a 416 reports in its Content-Range.
+    char full_path[2048];         // The file I'm going to serve (or the error page).
+    int is_error_page;            // Set when full_path points at www/errors/.
+    int status;                   // The status code I'm answering with.
+    const char *status_text;      // ...and its reason phrase.
+    const char *mime;             // The Content-Type of the body (NULL: request_header() works it out).
+    arena_t *arena;               // Where this request's memory comes from.
+    char *content;                // The bytes I'm serving from (in the arena, or in the cache on a hit).
+    char *cached_header;          // On a cache hit: the header the cache kept, right in front of 'content'.
+    size_t cached_header_len;
+    cache_node_t *cache_ref;      // On a cache hit: the entry I'm sending from, pinned until request_release().
+    int file_fd;                  // For files too big to cache: the body is streamed from here (-1 otherwise).
+    size_t content_len;           // How many bytes are in 'content'.
+    long body_offset;             // Where the body starts inside 'content' or the file (for ranges).
+    long body_len;                // How many body bytes go on the wire.
+    long content_length;          // What I put in Content-Length (HEAD keeps the real size).
+    char extra_headers[128];      // Additional header lines, like Content-Range.
+    const char *encoding;         // The Content-Encoding of the body ("br", "gzip"; NULL when it's sent as is).
+    size_t original_len;          // With an encoding: how much of full_path is the uncompressed file's path.
+    int compress;                 // Set when I gzip the file myself once it's read (COMPRESSION=dynamic).
+    int vary;                     // Set when the response depends on Accept-Encoding.
+    cache_stamp_t stamp;          // What stat() said about the file I serve; ETag and Last-Modified come from it.
+    int has_stamp;                // Set when 'stamp' describes a real file (not an error page or /stats).
+    int needs_disk;               // Set when the response still needs a blocking file read.
+    int keep_alive;               // Whether the connection stays open after this response.
+    long bytes_sent;              // What I report in stats and the access log.
+    // A multipart/byteranges body streamed from its file goes out one part at a time:
+    // the boundary lines of a part, then its slice of the file (body_offset/body_len).
+    char *part_heads;             // All boundary lines, back to back (in the arena).
+    unsigned part_head_off[MAX_RANGES + 2]; // Where each part's lines start; the closing boundary comes last.
+    int part;                     // The part that's going out now...
+    int part_steps;               // ...out of how many, closing boundary included (0: not multipart).
+    struct iovec part_head;       // Boundary lines still to send before the current slice.
+} request_ctx_t;
 
 // This function calculates the time difference between two timestamps in milliseconds.
 // I use it to measure how long it takes to handle each request.
@@ -17,12 +69,54 @@ void get_client_ip(int client_fd, char *ip_buffer, size_t buffer_len);
 // I use this to set the correct Content-Type header in HTTP responses.
 const char *get_mime_type(const char *path);
 
+// I set up the socket options every client connection gets (TCP_NODELAY).
+void prepare_client_socket(int client_fd);
+
+// I add delta to the active connection counters (global and this worker's).
+void track_connection(int delta);
+
+// This is the most I hand to one sendfile() call when a body is streamed from its file.
+#define SENDFILE_CHUNK (1024 * 1024)
+
+// These are the steps every request goes through, in order.
+// request_route() never blocks on file contents; if it sets needs_disk,
+// request_load() must run (on a thread that may block) before the response is sent.
+// An engine that reads files asynchronously can instead read full_path itself and
+// report the result with request_loaded(), repeating while needs_disk stays set.
+// When file_fd is set the body isn't in 'content': engines send the header and part_head,
+// then stream body_len bytes from body_offset of that file (request_send_file() does it with
+// sendfile()), then ask request_next_part() whether another part of a multipart body follows.
+void request_begin(request_ctx_t *ctx, arena_t *arena);
+void request_error(request_ctx_t *ctx, int status_code, const char *status_text);
+void request_route(request_ctx_t *ctx, const http_parser_t *parser, const char *buffer);
+void request_load(request_ctx_t *ctx);
+void request_loaded(request_ctx_t *ctx, int rc, char *buf, size_t len);
+const char *request_header(request_ctx_t *ctx, char *buf, size_t cap, size_t *len);
+int request_send_file(request_ctx_t *ctx, int client_fd);
+int request_next_part(request_ctx_t *ctx, struct iovec *head);
+void request_finish(request_ctx_t *ctx, const char *client_ip);
+void request_release(request_ctx_t *ctx);
+
+// Every engine keeps a receive buffer, a parser and an arena per connection and uses this
+// to take one complete request off the buffer's front. I return 1 when a request was routed,
+// 0 when more bytes are needed, and -1 when the request was malformed or its headers
+// overflowed cap (answer, then close). The parser carries over between calls; the arena
+// must be reset once the response has been sent.
+int request_take(request_ctx_t *ctx, arena_t *arena, http_parser_t *parser, char *buf, size_t *len, size_t cap);
+
+// I send an error page straight to a socket (used when I have to turn a client away).
+void send_error_page(int client_fd, int status_code, const char *status_text, long *bytes_sent);
+
+// I receive the next burst of fds the master handed me. I return -1 when it hung up.
+int receive_connections(int ipc_socket, int *fds, int max_fds);
+
 // This is the main function that handles a client connection.
 // It processes HTTP requests from start to finish.
 void handle_client(int client_socket);
 
 // This is the entry point for a worker process.
 // The master process calls fork() and the child executes this function.
-void start_worker_process(int ipc_socket);
+// worker_id tells me which slot of worker_loads belongs to me.
+void start_worker_process(int ipc_socket, int worker_id);
 
 #endif 
\ No newline at end of file
@@ -0,0 +1,336 @@
+#define _DEFAULT_SOURCE // I need this for usleep().
+
+// I'm testing the shared file cache (src/cache.c) the way the workers use it: several
+// processes forked after cache_init() read while others write, over a region small enough
+// that writers evict all the time. Every entry's header and bytes are derived from its key,
+// so a reader that gets a torn entry, someone else's entry, or a block that was reused
+// while it still held the pin, sees bytes that don't match and fails.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "../src/cache.h"
+
+#define REGION_BYTES (4 * 1024 * 1024) // Two 2MB blocks: one per shard.
+#define SHARDS 2
+#define KEYS 256
+#define READERS 4
+#define WRITERS 2
+#define RUN_SECONDS 2
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        printf("  FAIL: "); printf(__VA_ARGS__); printf("\n"); \
+        failures++; \
+    } \
+} while (0)
+
+static long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// * Entries that encode their key
+// Key k is "/stress/<k>". Its size depends on k (a few are big enough to take a whole
+// 1MB-plus block, so evicting for them frees many small ones at once), its header names
+// it, and byte i of the file is a mix of k and i.
+static void key_name(char *buf, size_t cap, int k)
+{
+    snprintf(buf, cap, "/stress/%d", k);
+}
+
+static size_t key_size(int k)
+{
+    if (k % 64 == 0) return 600 * 1024 + (size_t)k;
+    return 200 + (size_t)(k * 7919) % 40000;
+}
+
+static char key_byte(int k, size_t i)
+{
+    return (char)((unsigned)k * 131u + (unsigned)i * 7u + (unsigned)(i >> 8));
+}
+
+static size_t key_head(char *buf, size_t cap, int k)
+{
+    return (size_t)snprintf(buf, cap, "X-Key: %d\r\n", k);
+}
+
+static char *file_bytes(int k)
+{
+    size_t len = key_size(k);
+    char *data = malloc(len);
+    for (size_t i = 0; i < len; i++) data[i] = key_byte(k, i);
+    return data;
+}
+
+// I return 0 if a hit for key k has exactly the header and bytes k was stored with.
+static int entry_intact(int k, const char *head, size_t head_len, const char *buf, size_t len)
+{
+    char want[32];
+    size_t want_len = key_head(want, sizeof(want), k);
+    if (head_len != want_len || memcmp(head, want, want_len) != 0) return -1;
+    if (len != key_size(k)) return -1;
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] != key_byte(k, i)) return -1;
+    }
+    return 0;
+}
+
+// * Readers and writers
+// A reader looks keys up at random and checks every hit twice: once right away, and once
+// after holding the pin a little longer while the writers keep evicting around it.
+static int reader(int id)
+{
+    srand(1000 + id);
+    long hits = 0, bad = 0;
+    long deadline = now_ms() + RUN_SECONDS * 1000;
+    while (now_ms() < deadline) {
+        int k = rand() % KEYS;
+        char path[32];
+        key_name(path, sizeof(path), k);
+        cache_node_t *ref;
+        char *head, *buf;
+        size_t head_len, len;
+        if (cache_get(path, NULL, &ref, &head, &head_len, &buf, &len) != 0) continue;
+        hits++;
+        if (entry_intact(k, head, head_len, buf, len) != 0) bad++;
+        if (rand() % 8 == 0) {
+            usleep(200);
+            if (entry_intact(k, head, head_len, buf, len) != 0) bad++;
+        }
+        cache_release(ref);
+    }
+    if (bad) printf("  FAIL: reader %d saw %ld damaged entries in %ld hits\n", id, bad, hits);
+    return bad ? 1 : (hits == 0 ? 2 : 0);
+}
+
+// A writer stores keys at random, replacing what's there; the region only holds a
+// fraction of them, so nearly every put evicts something.
+static int writer(int id)
+{
+    srand(2000 + id);
+    char *files[KEYS];
+    for (int k = 0; k < KEYS; k++) files[k] = file_bytes(k);
+    long deadline = now_ms() + RUN_SECONDS * 1000;
+    while (now_ms() < deadline) {
+        int k = rand() % KEYS;
+        char path[32], head[32];
+        key_name(path, sizeof(path), k);
+        size_t head_len = key_head(head, sizeof(head), k);
+        cache_put(path, NULL, head, head_len, files[k], key_size(k));
+    }
+    for (int k = 0; k < KEYS; k++) free(files[k]);
+    return 0;
+}
+
+static void test_stress(int admission)
+{
+    printf("%d readers and %d writer processes on a %d MB shared cache (%s admission)\n",
+           READERS, WRITERS, REGION_BYTES >> 20, admission == CACHE_ADMISSION_TINYLFU ? "tinylfu" : "all");
+    if (cache_init(REGION_BYTES, 1, SHARDS, admission) != 0) {
+        perror("cache_init");
+        exit(1);
+    }
+
+    // I warm the cache up so the readers have hits from the start.
+    char *files[KEYS];
+    for (int k = 0; k < KEYS; k++) {
+        char path[32], head[32];
+        files[k] = file_bytes(k);
+        key_name(path, sizeof(path), k);
+        cache_put(path, NULL, head, key_head(head, sizeof(head), k), files[k], key_size(k));
+    }
+
+    pid_t pids[READERS + WRITERS];
+    for (int i = 0; i < READERS + WRITERS; i++) {
+        pids[i] = fork();
+        if (pids[i] < 0) {
+            perror("fork");
+            exit(1);
+        }
+        if (pids[i] == 0) _exit(i < READERS ? reader(i) : writer(i - READERS));
+    }
+    for (int i = 0; i < READERS + WRITERS; i++) {
+        int status;
+        waitpid(pids[i], &status, 0);
+        CHECK(WIFEXITED(status), "%s %d died (signal %d)", i < READERS ? "reader" : "writer", i,
+              WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+        if (!WIFEXITED(status)) continue;
+        CHECK(WEXITSTATUS(status) != 1, "reader %d read damaged entries", i);
+        CHECK(WEXITSTATUS(status) != 2, "reader %d never had a hit", i);
+    }
+
+    // Everyone is gone, so nothing is pinned: whatever is left must be intact, and the
+    // bookkeeping must add up.
+    int left = 0;
+    for (int k = 0; k < KEYS; k++) {
+        char path[32];
+        key_name(path, sizeof(path), k);
+        cache_node_t *ref;
+        char *head, *buf;
+        size_t head_len, len;
+        if (cache_get(path, NULL, &ref, &head, &head_len, &buf, &len) != 0) continue;
+        CHECK(entry_intact(k, head, head_len, buf, len) == 0, "%s is damaged after the run", path);
+        cache_release(ref);
+        left++;
+    }
+    cache_stats_t st;
+    cache_get_stats(&st);
+    CHECK(st.entries == left, "the shards count %ld entries, I found %d", st.entries, left);
+    CHECK(st.used <= st.capacity, "%zu bytes used out of %zu", st.used, st.capacity);
+    CHECK(left > 0, "the cache is empty after the run");
+
+    for (int k = 0; k < KEYS; k++) free(files[k]);
+    cache_destroy();
+}
+
+// * Scan resistance
+// A hot set is asked for again and again, then a crawler reads a long run of cold files
+// once each (a miss and a put apiece, in sizes from 1KB to 300KB). Under TinyLFU the cold
+// files never win against the hot ones, so the hot set must survive the scan. Without an
+// admission filter the same scan flushes it, which shows the scan is long enough to matter.
+#define SCAN_REGION_BYTES (8 * 1024 * 1024)
+#define HOT_KEYS 64
+#define HOT_ROUNDS 8
+#define COLD_KEYS 3000
+
+// I look a key up the way a worker does: a miss is followed by a put. I return 1 on a hit.
+static int request(const char *path, const char *data, size_t len)
+{
+    cache_node_t *ref;
+    char *head, *buf;
+    size_t head_len, got;
+    if (cache_get(path, NULL, &ref, &head, &head_len, &buf, &got) == 0) {
+        cache_release(ref);
+        return 1;
+    }
+    cache_put(path, NULL, NULL, 0, data, len);
+    return 0;
+}
+
+static int hot_survivors(int admission)
+{
+    if (cache_init(SCAN_REGION_BYTES, 0, 1, admission) != 0) {
+        perror("cache_init");
+        exit(1);
+    }
+    static char data[300 * 1024];
+    memset(data, 'x', sizeof(data));
+    char path[32];
+
+    for (int round = 0; round < HOT_ROUNDS; round++) {
+        for (int k = 0; k < HOT_KEYS; k++) {
+            snprintf(path, sizeof(path), "/hot/%d", k);
+            request(path, data, 10 * 1024);
+        }
+    }
+    srand(7);
+    for (int k = 0; k < COLD_KEYS; k++) {
+        snprintf(path, sizeof(path), "/cold/%d", k);
+        request(path, data, 1024 + (size_t)rand() % (299 * 1024));
+    }
+
+    int left = 0;
+    for (int k = 0; k < HOT_KEYS; k++) {
+        snprintf(path, sizeof(path), "/hot/%d", k);
+        cache_node_t *ref;
+        char *head, *buf;
+        size_t head_len, len;
+        if (cache_get(path, NULL, &ref, &head, &head_len, &buf, &len) == 0) {
+            cache_release(ref);
+            left++;
+        }
+    }
+    cache_destroy();
+    return left;
+}
+
+static void test_scan_resistance()
+{
+    printf("a one-pass scan of %d cold files against a hot set of %d\n", COLD_KEYS, HOT_KEYS);
+    int filtered = hot_survivors(CACHE_ADMISSION_TINYLFU);
+    int unfiltered = hot_survivors(CACHE_ADMISSION_ALL);
+    printf("  hot files still cached: %d with tinylfu, %d with all\n", filtered, unfiltered);
+    CHECK(filtered >= HOT_KEYS * 9 / 10, "the scan evicted %d of %d hot files under tinylfu", HOT_KEYS - filtered, HOT_KEYS);
+    CHECK(unfiltered < HOT_KEYS / 2, "the scan should flush an unfiltered cache, but %d hot files survived", unfiltered);
+}
+
+// * Default geometry
+// At the defaults (10MB per worker, 4 workers, 8 shards) a shard has 5MB. The window must
+// not take a big bite out of that: a hot set filling 70% of the cache has to fit next to
+// it, and still be there after the same scan as above.
+#define DEFAULT_REGION_BYTES (10 * 1024 * 1024 * 4)
+#define DEFAULT_SHARDS 8
+#define DEFAULT_HOT_KEYS ((DEFAULT_REGION_BYTES / (16 * 1024)) * 7 / 10) // 10KB entries take 16KB blocks.
+
+static int hot_cached(char *path, size_t cap)
+{
+    int left = 0;
+    for (int k = 0; k < DEFAULT_HOT_KEYS; k++) {
+        snprintf(path, cap, "/hot/%d", k);
+        cache_node_t *ref;
+        char *head, *buf;
+        size_t head_len, len;
+        if (cache_get(path, NULL, &ref, &head, &head_len, &buf, &len) == 0) {
+            cache_release(ref);
+            left++;
+        }
+    }
+    return left;
+}
+
+static void test_default_geometry()
+{
+    printf("a hot set of %d files in a %d MB cache of %d shards (tinylfu admission)\n",
+           DEFAULT_HOT_KEYS, DEFAULT_REGION_BYTES >> 20, DEFAULT_SHARDS);
+    if (cache_init(DEFAULT_REGION_BYTES, 0, DEFAULT_SHARDS, CACHE_ADMISSION_TINYLFU) != 0) {
+        perror("cache_init");
+        exit(1);
+    }
+    static char data[300 * 1024];
+    memset(data, 'x', sizeof(data));
+    char path[32];
+
+    for (int round = 0; round < HOT_ROUNDS; round++) {
+        for (int k = 0; k < DEFAULT_HOT_KEYS; k++) {
+            snprintf(path, sizeof(path), "/hot/%d", k);
+            request(path, data, 10 * 1024);
+        }
+    }
+    int before = hot_cached(path, sizeof(path));
+
+    srand(7);
+    for (int k = 0; k < COLD_KEYS; k++) {
+        snprintf(path, sizeof(path), "/cold/%d", k);
+        request(path, data, 1024 + (size_t)rand() % (299 * 1024));
+    }
+    int after = hot_cached(path, sizeof(path));
+    cache_destroy();
+
+    printf("  hot files cached: %d before the scan, %d after it\n", before, after);
+    CHECK(before >= DEFAULT_HOT_KEYS * 95 / 100, "only %d of %d hot files fit", before, DEFAULT_HOT_KEYS);
+    CHECK(after >= DEFAULT_HOT_KEYS * 9 / 10, "the scan evicted %d of %d hot files", DEFAULT_HOT_KEYS - after, DEFAULT_HOT_KEYS);
+}
+
+int main()
+{
+    test_stress(CACHE_ADMISSION_ALL);
+    test_stress(CACHE_ADMISSION_TINYLFU);
+    test_scan_resistance();
+    test_default_geometry();
+
+    if (failures) {
+        printf("cache: %d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("cache: all checks passed\n");
+    return 0;
+}
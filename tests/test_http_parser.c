@@ -0,0 +1,259 @@
+// I'm testing the resumable request parser (src/http.c) against a table of requests.
+// Every case is fed three ways: in one piece, split in two at every offset, and one
+// byte at a time. Resuming must never change the answer, so all three have to agree
+// with the table. The bytes past what I've fed so far are newlines, so a scan that
+// looks beyond len finds a line end that isn't there and gets caught.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/http.h"
+#include "../src/http_scan.h"
+
+#define MAX_INPUT 16384
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        printf("  FAIL: "); printf(__VA_ARGS__); printf("\n"); \
+        failures++; \
+    } \
+} while (0)
+
+// One request and what the parser has to make of it. input is the request itself,
+// or NULL when build() writes it (the cases near the size limits are too long to spell out).
+// The fields after status are only checked when the head parses.
+typedef struct {
+    const char *name;
+    const char *input;
+    size_t (*build)(char *buf);
+    int rc;                  // HTTP_PARSE_DONE, _INCOMPLETE or _ERROR.
+    int status;              // error_status for HTTP_PARSE_ERROR.
+    const char *target;
+    int headers;
+    long content_length;
+    int chunked;
+    int keep_alive;
+    size_t head_len;         // 0: the whole input is the head.
+    const char *header;      // A header to look up (or NULL)...
+    const char *value;       // ...and the value it must have.
+} parse_case_t;
+
+// * Builders for the long requests
+static size_t put(char *buf, size_t at, const char *s)
+{
+    size_t n = strlen(s);
+    memcpy(buf + at, s, n);
+    return at + n;
+}
+
+static size_t with_headers(char *buf, int count)
+{
+    size_t at = put(buf, 0, "GET / HTTP/1.1\r\n");
+    for (int i = 0; i < count; i++) at = put(buf, at, "X-h: v\r\n");
+    return put(buf, at, "\r\n");
+}
+
+static size_t max_headers(char *buf) { return with_headers(buf, HTTP_MAX_HEADERS); }
+static size_t too_many_headers(char *buf) { return with_headers(buf, HTTP_MAX_HEADERS + 1); }
+
+// A head of exactly total bytes, padded out with one long header.
+static size_t head_of(char *buf, size_t total)
+{
+    size_t at = put(buf, 0, "GET / HTTP/1.1\r\nX-Pad: ");
+    size_t pad = total - at - 4;
+    memset(buf + at, 'a', pad);
+    return put(buf, at + pad, "\r\n\r\n");
+}
+
+static size_t head_at_limit(char *buf) { return head_of(buf, HTTP_MAX_HEADER_BYTES); }
+static size_t head_over_limit(char *buf) { return head_of(buf, HTTP_MAX_HEADER_BYTES + 1); }
+
+// A header line that never ends.
+static size_t endless_header(char *buf)
+{
+    size_t at = put(buf, 0, "GET / HTTP/1.1\r\nX-Pad: ");
+    memset(buf + at, 'a', HTTP_MAX_HEADER_BYTES);
+    return at + HTTP_MAX_HEADER_BYTES;
+}
+
+// A request line that never ends, and one that ends too late.
+static size_t endless_target(char *buf)
+{
+    size_t at = put(buf, 0, "GET /");
+    memset(buf + at, 'a', HTTP_MAX_HEADER_BYTES);
+    return at + HTTP_MAX_HEADER_BYTES;
+}
+
+static size_t long_target(char *buf)
+{
+    size_t at = endless_target(buf);
+    return put(buf, at, " HTTP/1.1\r\n\r\n");
+}
+
+static const parse_case_t cases[] = {
+    {.name = "simple GET", .input = "GET /index.html HTTP/1.1\r\nHost: example.com\r\n\r\n",
+     .rc = HTTP_PARSE_DONE, .target = "/index.html", .headers = 1, .content_length = -1, .keep_alive = 1,
+     .header = "host", .value = "example.com"},
+    {.name = "HTTP/1.0 closes by default", .input = "GET / HTTP/1.0\r\n\r\n",
+     .rc = HTTP_PARSE_DONE, .target = "/", .content_length = -1, .keep_alive = 0},
+    {.name = "HTTP/1.0 keep-alive", .input = "GET / HTTP/1.0\r\nConnection: Keep-Alive\r\n\r\n",
+     .rc = HTTP_PARSE_DONE, .target = "/", .headers = 1, .content_length = -1, .keep_alive = 1},
+    {.name = "Connection list with close", .input = "GET / HTTP/1.1\r\nConnection: upgrade, close\r\n\r\n",
+     .rc = HTTP_PARSE_DONE, .target = "/", .headers = 1, .content_length = -1, .keep_alive = 0},
+    {.name = "empty lines before the request line", .input = "\r\n\r\nGET /a HTTP/1.1\r\n\r\n",
+     .rc = HTTP_PARSE_DONE, .target = "/a", .content_length = -1, .keep_alive = 1},
+    {.name = "bare LF line ends", .input = "GET /lf HTTP/1.1\nHost: a\nAccept: */*\r\n\n",
+     .rc = HTTP_PARSE_DONE, .target = "/lf", .headers = 2, .content_length = -1, .keep_alive = 1,
+     .header = "accept", .value = "*/*"},
+    {.name = "value whitespace is trimmed", .input = "GET / HTTP/1.1\r\nX-Y: \t v w \t\r\n\r\n",
+     .rc = HTTP_PARSE_DONE, .target = "/", .headers = 1, .content_length = -1, .keep_alive = 1,
+     .header = "X-y", .value = "v w"},
+    {.name = "pipelined body stays out of the head",
+     .input = "POST /f HTTP/1.1\r\nContent-Length: 5\r\n\r\nhelloGET / HTTP/1.1\r\n\r\n",
+     .rc = HTTP_PARSE_DONE, .target = "/f", .headers = 1, .content_length = 5, .keep_alive = 1,
+     .head_len = 39},
+    {.name = "repeated equal Content-Length", .input = "POST / HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 5\r\n\r\n",
+     .rc = HTTP_PARSE_DONE, .target = "/", .headers = 2, .content_length = 5, .keep_alive = 1},
+    {.name = "Transfer-Encoding is flagged (answered with 501)",
+     .input = "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n",
+     .rc = HTTP_PARSE_DONE, .target = "/", .headers = 1, .content_length = -1, .chunked = 1, .keep_alive = 1},
+    {.name = "a coding under chunked that I can't undo", .input = "POST / HTTP/1.1\r\nTransfer-Encoding: gzip;q=1 , CHUNKED\r\n\r\n",
+     .rc = HTTP_PARSE_ERROR, .status = 501},
+    {.name = "chunked matched case-insensitively", .input = "POST / HTTP/1.1\r\nTransfer-Encoding: identity, Chunked\r\n\r\n",
+     .rc = HTTP_PARSE_DONE, .target = "/", .headers = 1, .content_length = -1, .chunked = 1, .keep_alive = 1},
+    {.name = "Transfer-Encoding: identity is no coding at all", .input = "GET / HTTP/1.1\r\nTransfer-Encoding: identity\r\n\r\n",
+     .rc = HTTP_PARSE_DONE, .target = "/", .headers = 1, .content_length = -1, .keep_alive = 1},
+    {.name = "unsupported coding", .input = "POST / HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n",
+     .rc = HTTP_PARSE_ERROR, .status = 501},
+    {.name = "chunked applied twice", .input = "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nTransfer-Encoding: chunked\r\n\r\n",
+     .rc = HTTP_PARSE_ERROR, .status = 400},
+    {.name = "head ending exactly at the limit", .build = head_at_limit,
+     .rc = HTTP_PARSE_DONE, .target = "/", .headers = 1, .content_length = -1, .keep_alive = 1},
+    {.name = "HTTP_MAX_HEADERS headers", .build = max_headers,
+     .rc = HTTP_PARSE_DONE, .target = "/", .headers = HTTP_MAX_HEADERS, .content_length = -1, .keep_alive = 1},
+
+    {.name = "head without its empty line", .input = "GET / HTTP/1.1\r\nHost: a\r\n",
+     .rc = HTTP_PARSE_INCOMPLETE},
+    {.name = "obs-fold with a space", .input = "GET / HTTP/1.1\r\nX-A: one\r\n two\r\n\r\n",
+     .rc = HTTP_PARSE_ERROR, .status = 400},
+    {.name = "obs-fold with a tab", .input = "GET / HTTP/1.1\nX-A: one\n\ttwo\n\n",
+     .rc = HTTP_PARSE_ERROR, .status = 400},
+    {.name = "whitespace before the colon", .input = "GET / HTTP/1.1\r\nHost : a\r\n\r\n",
+     .rc = HTTP_PARSE_ERROR, .status = 400},
+    {.name = "conflicting Content-Length", .input = "POST / HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 6\r\n\r\n",
+     .rc = HTTP_PARSE_ERROR, .status = 400},
+    {.name = "Content-Length that isn't a number", .input = "POST / HTTP/1.1\r\nContent-Length: 5a\r\n\r\n",
+     .rc = HTTP_PARSE_ERROR, .status = 400},
+    {.name = "empty Content-Length", .input = "POST / HTTP/1.1\r\nContent-Length:\r\n\r\n",
+     .rc = HTTP_PARSE_ERROR, .status = 400},
+    {.name = "unknown version", .input = "GET / HTTP/2.0\r\n\r\n",
+     .rc = HTTP_PARSE_ERROR, .status = 400},
+    {.name = "missing target", .input = "GET HTTP/1.1\r\n\r\n",
+     .rc = HTTP_PARSE_ERROR, .status = 400},
+    {.name = "one header more than HTTP_MAX_HEADERS", .build = too_many_headers,
+     .rc = HTTP_PARSE_ERROR, .status = 431},
+    {.name = "head one byte over HTTP_MAX_HEADER_BYTES", .build = head_over_limit,
+     .rc = HTTP_PARSE_ERROR, .status = 431},
+    {.name = "header line that never ends", .build = endless_header,
+     .rc = HTTP_PARSE_ERROR, .status = 431},
+    {.name = "request line that never ends", .build = endless_target,
+     .rc = HTTP_PARSE_ERROR, .status = 414},
+    {.name = "request line over the limit", .build = long_target,
+     .rc = HTTP_PARSE_ERROR, .status = 414},
+};
+
+static char scratch[MAX_INPUT + 64];
+
+// I grow the request in scratch to len bytes; everything after it stays a newline.
+static void feed(const char *input, size_t len)
+{
+    memcpy(scratch, input, len);
+}
+
+// I check what the parser made of a request it has seen all of.
+static void check_result(const parse_case_t *c, const char *how, http_parser_t *p, int rc, size_t len)
+{
+    CHECK(rc == c->rc, "%s (%s): returned %d, expected %d", c->name, how, rc, c->rc);
+    if (rc != c->rc) return;
+    if (rc == HTTP_PARSE_ERROR) {
+        CHECK(p->error_status == c->status, "%s (%s): status %d, expected %d", c->name, how, p->error_status, c->status);
+    }
+    if (rc != HTTP_PARSE_DONE) return;
+
+    size_t head_len = c->head_len ? c->head_len : len;
+    CHECK(p->head_len == head_len, "%s (%s): head_len %zu, expected %zu", c->name, how, p->head_len, head_len);
+    CHECK(p->target_len == strlen(c->target) && memcmp(scratch + p->target_off, c->target, p->target_len) == 0,
+          "%s (%s): target '%.*s', expected '%s'", c->name, how, (int)p->target_len, scratch + p->target_off, c->target);
+    CHECK(p->header_count == c->headers, "%s (%s): %d headers, expected %d", c->name, how, p->header_count, c->headers);
+    CHECK(p->content_length == c->content_length, "%s (%s): Content-Length %ld, expected %ld",
+          c->name, how, p->content_length, c->content_length);
+    CHECK(p->chunked == c->chunked, "%s (%s): chunked %d, expected %d", c->name, how, p->chunked, c->chunked);
+    CHECK(p->keep_alive == c->keep_alive, "%s (%s): keep_alive %d, expected %d", c->name, how, p->keep_alive, c->keep_alive);
+    if (c->header) {
+        const http_header_t *h = http_find_header(p, scratch, c->header);
+        CHECK(h && h->value_len == strlen(c->value) && memcmp(scratch + h->value_off, c->value, h->value_len) == 0,
+              "%s (%s): header %s is '%.*s', expected '%s'", c->name, how, c->header,
+              h ? (int)h->value_len : 0, h ? scratch + h->value_off : "", c->value);
+    }
+}
+
+// I feed the request in the pieces that end at cuts[0], cuts[1], ... (the last one is len).
+// A piece may already settle the answer (an error can show up before the end); then
+// that's the answer. Otherwise every piece but the last must ask for more.
+static void run_pieces(const parse_case_t *c, const char *input, size_t len, const size_t *cuts, int n, const char *how)
+{
+    memset(scratch, '\n', sizeof(scratch));
+    http_parser_t p;
+    http_parser_init(&p);
+    int rc = HTTP_PARSE_INCOMPLETE;
+    for (int i = 0; i < n && rc == HTTP_PARSE_INCOMPLETE; i++) {
+        feed(input, cuts[i]);
+        rc = http_parse(&p, scratch, cuts[i]);
+    }
+    check_result(c, how, &p, rc, len);
+}
+
+static void run_case(const parse_case_t *c)
+{
+    static char built[MAX_INPUT];
+    const char *input = c->input;
+    size_t len;
+    if (input) {
+        len = strlen(input);
+    } else {
+        len = c->build(built);
+        input = built;
+    }
+
+    run_pieces(c, input, len, &len, 1, "whole");
+
+    int before = failures;
+    for (size_t k = 1; k < len && failures == before; k++) {
+        size_t cuts[2] = {k, len};
+        char how[48];
+        snprintf(how, sizeof(how), "split at %zu", k);
+        run_pieces(c, input, len, cuts, 2, how);
+    }
+
+    size_t *cuts = malloc(len * sizeof(size_t));
+    for (size_t k = 0; k < len; k++) cuts[k] = k + 1;
+    run_pieces(c, input, len, cuts, (int)len, "byte at a time");
+    free(cuts);
+}
+
+int main()
+{
+    http_scan_init();
+    printf("request parser (%s scans)\n", http_scan_kernel());
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) run_case(&cases[i]);
+
+    if (failures) {
+        printf("http_parser: %d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("http_parser: all %zu cases passed\n", sizeof(cases) / sizeof(cases[0]));
+    return 0;
+}
@@ -0,0 +1,194 @@
+#define _DEFAULT_SOURCE // I need this for MAP_ANONYMOUS.
+
+// I'm checking that every version of the request scans (src/http_scan.c) gives the same
+// answers: scalar, SSE4.2 and AVX2 against a plain byte-by-byte reference written here.
+// The SIMD versions step 16 or 32 bytes at a time and finish with the scalar loop, so the
+// interesting lengths sit around those steps (0, 15, 16, 31, 32, 33...) and the interesting
+// positions are the last byte. I include the source itself to reach the versions that
+// http_scan_init() doesn't pick, and skip the ones this CPU can't run.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "../src/http_scan.c"
+
+#define RANDOM_ROUNDS 20000
+#define MAX_LEN 300
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        printf("  FAIL: "); printf(__VA_ARGS__); printf("\n"); \
+        failures++; \
+    } \
+} while (0)
+
+typedef size_t (*scan_fn)(const char *, size_t);
+
+typedef struct {
+    const char *name;
+    scan_fn line, token, target;
+    int supported;
+} kernel_t;
+
+// * Reference scans
+static int ref_is_token(unsigned char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+           (c != '\0' && strchr("!#$%&'*+-.^_`|~", c) != NULL);
+}
+
+static size_t ref_line(const char *buf, size_t len)
+{
+    size_t i = 0;
+    while (i < len && buf[i] != '\n') i++;
+    return i;
+}
+
+static size_t ref_token(const char *buf, size_t len)
+{
+    size_t i = 0;
+    while (i < len && ref_is_token((unsigned char)buf[i])) i++;
+    return i;
+}
+
+static size_t ref_target(const char *buf, size_t len)
+{
+    size_t i = 0;
+    while (i < len && (unsigned char)buf[i] > 0x20 && (unsigned char)buf[i] != 0x7f) i++;
+    return i;
+}
+
+static const struct {
+    const char *name;
+    scan_fn ref;
+    char stop;     // A byte that ends this scan...
+    char go;       // ...and one that doesn't.
+} scans[] = {
+    {"line", ref_line, '\n', 'a'},
+    {"token", ref_token, ':', 'a'},
+    {"target", ref_target, ' ', '/'},
+};
+
+static scan_fn kernel_scan(const kernel_t *k, int which)
+{
+    return which == 0 ? k->line : which == 1 ? k->token : k->target;
+}
+
+static void compare(const kernel_t *k, int which, const char *buf, size_t len, const char *what)
+{
+    size_t want = scans[which].ref(buf, len);
+    size_t got = kernel_scan(k, which)(buf, len);
+    CHECK(got == want, "%s %s: %s, len %zu: got %zu, expected %zu", k->name, scans[which].name, what, len, got, want);
+}
+
+// * Random buffers
+// Uniform bytes stop the token and target scans almost at once, so half the buffers
+// are drawn from the bytes a scan accepts, with a stop byte now and then.
+static void fill_random(char *buf, size_t len, int which)
+{
+    int sparse = rand() % 2;
+    for (size_t i = 0; i < len; i++) {
+        if (!sparse) {
+            buf[i] = (char)(rand() & 0xff);
+        } else if (rand() % 97 == 0) {
+            buf[i] = scans[which].stop;
+        } else {
+            do buf[i] = (char)(rand() & 0xff); while (scans[which].ref(buf + i, 1) != 1);
+        }
+    }
+}
+
+static void test_random(const kernel_t *k)
+{
+    static char block[MAX_LEN + 64];
+    for (int which = 0; which < 3; which++) {
+        int before = failures;
+        for (int round = 0; round < RANDOM_ROUNDS && failures == before; round++) {
+            size_t len = (size_t)rand() % (MAX_LEN + 1);
+            size_t offset = (size_t)rand() % 32; // Unaligned starts as well.
+            fill_random(block + offset, len, which);
+            block[offset + len] = scans[which].stop; // A stop right after the end must not count.
+            compare(k, which, block + offset, len, "random bytes");
+        }
+    }
+}
+
+// * Boundary lengths
+// For the lengths around the 16 and 32 byte steps, I put the only stop byte at every
+// position (the last byte included), and also try a buffer with no stop at all.
+static void test_boundaries(const kernel_t *k)
+{
+    static const size_t lengths[] = {0, 1, 15, 16, 17, 31, 32, 33, 47, 48, 63, 64, 65, 95, 96, 97};
+    char buf[128];
+    for (int which = 0; which < 3; which++) {
+        for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+            size_t len = lengths[l];
+            memset(buf, scans[which].go, sizeof(buf));
+            compare(k, which, buf, len, "no stop byte");
+            for (size_t at = 0; at < len; at++) {
+                memset(buf, scans[which].go, sizeof(buf));
+                buf[at] = scans[which].stop;
+                char what[32];
+                snprintf(what, sizeof(what), "stop at %zu", at);
+                compare(k, which, buf, len, what);
+            }
+        }
+    }
+}
+
+// * No reads past the end
+// A buffer that ends right at an unmapped page: a load past len would crash.
+static void test_page_end(const kernel_t *k)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    char *map = mmap(NULL, (size_t)page * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    mprotect(map + page, (size_t)page, PROT_NONE);
+    for (int which = 0; which < 3; which++) {
+        for (size_t len = 0; len <= 97; len++) {
+            char *buf = map + page - len;
+            memset(buf, scans[which].go, len);
+            compare(k, which, buf, len, "at a page end");
+        }
+    }
+    munmap(map, (size_t)page * 2);
+}
+
+int main()
+{
+    http_scan_init();
+    kernel_t kernels[] = {
+        {"scalar", scan_line_scalar, scan_token_scalar, scan_target_scalar, 1},
+#ifdef HTTP_SCAN_X86
+        {"sse4.2", scan_line_sse42, scan_token_sse42, scan_target_sse42, __builtin_cpu_supports("sse4.2")},
+        {"avx2", scan_line_avx2, scan_token_avx2, scan_target_avx2, __builtin_cpu_supports("avx2")},
+#endif
+    };
+
+    srand(12345); // The same buffers every run, so a failure can be reproduced.
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (!kernels[i].supported) {
+            printf("%s: not supported by this CPU, skipped\n", kernels[i].name);
+            continue;
+        }
+        printf("%s scans against the reference\n", kernels[i].name);
+        test_boundaries(&kernels[i]);
+        test_page_end(&kernels[i]);
+        test_random(&kernels[i]);
+    }
+
+    if (failures) {
+        printf("http_scan: %d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("http_scan: all checks passed (dispatch picked %s)\n", http_scan_kernel());
+    return 0;
+}
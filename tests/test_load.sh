@@ -49,6 +49,8 @@ cleanup() {
     log "Stopping Server (PID: $SERVER_PID)..."
     kill $SERVER_PID
     wait $SERVER_PID 2>/dev/null
+    [ -n "$URING_PID" ] && kill $URING_PID 2>/dev/null && wait $URING_PID 2>/dev/null
+    rm -rf "$RANGE_DIR" www/range_small.txt www/range_big.txt www/sidecar_test.css www/sidecar_test.css.gz www/stall_test.bin
 }
 trap cleanup EXIT # This ensures cleanup runs even if the script exits early
 
@@ -112,6 +114,116 @@ else
     error "Directory Indexing failed (Code: $HTTP_CODE)"
 fi
 
+# 3.5 Test Range requests against two fixture files: a small one that the cache serves,
+# and one over MAX_CACHED_FILE_SIZE that is streamed from disk. Every line is 10 bytes,
+# so the bytes at any offset are easy to tell apart.
+RANGE_DIR=$(mktemp -d)
+seq -f '%09g' 0 99 > www/range_small.txt         # 1000 bytes
+seq -f '%09g' 0 199999 > www/range_big.txt       # 2000000 bytes
+
+# I send one request with a Range header; the status goes to R_CODE, the rest to $RANGE_DIR.
+range_request() {
+    R_CODE=$(curl -s -D "$RANGE_DIR/head" -o "$RANGE_DIR/body" -w "%{http_code}" -H "Range: $2" "$URL/$1")
+}
+
+header_value() {
+    grep -i "^$1:" "$RANGE_DIR/head" | cut -d' ' -f2- | tr -d '\r'
+}
+
+# Bytes first..last (inclusive) of a fixture.
+slice() {
+    tail -c +$(( $2 + 1 )) "www/$1" | head -c $(( $3 - $2 + 1 ))
+}
+
+# A single range must come back as a 206 with exactly those bytes.
+expect_range() {
+    local file=$1 range=$2 first=$3 last=$4 size
+    size=$(stat -c %s "www/$file")
+    range_request "$file" "$range"
+    [ "$R_CODE" -eq 206 ] || error "Range '$range' on $file: expected 206 (Code: $R_CODE)"
+    [ "$(header_value Content-Range)" == "bytes $first-$last/$size" ] ||
+        error "Range '$range' on $file: Content-Range is '$(header_value Content-Range)'"
+    cmp -s "$RANGE_DIR/body" <(slice "$file" "$first" "$last") || error "Range '$range' on $file: wrong bytes"
+}
+
+for FILE in range_small.txt range_small.txt range_big.txt; do # The second small pass is a cache hit.
+    SIZE=$(stat -c %s "www/$FILE")
+    expect_range $FILE "bytes=10-19" 10 19
+    expect_range $FILE "bytes=0-0" 0 0
+    expect_range $FILE "bytes=-100" $(( SIZE - 100 )) $(( SIZE - 1 ))
+    expect_range $FILE "bytes=$(( SIZE - 10 ))-" $(( SIZE - 10 )) $(( SIZE - 1 ))
+    expect_range $FILE "bytes=$(( SIZE - 5 ))-$(( SIZE + 1000 ))" $(( SIZE - 5 )) $(( SIZE - 1 ))
+    expect_range $FILE "bytes=-$(( SIZE * 2 ))" 0 $(( SIZE - 1 ))
+
+    # Nothing left of the range: 416, and the real size in Content-Range.
+    range_request $FILE "bytes=$SIZE-"
+    [ "$R_CODE" -eq 416 ] || error "Unsatisfiable range on $FILE: expected 416 (Code: $R_CODE)"
+    [ "$(header_value Content-Range)" == "bytes */$SIZE" ] ||
+        error "Unsatisfiable range on $FILE: Content-Range is '$(header_value Content-Range)'"
+
+    # Overlapping ranges add up to more than the file, so it comes back whole, once.
+    range_request $FILE "bytes=0-$(( SIZE / 2 )),$(( SIZE / 4 ))-"
+    [ "$R_CODE" -eq 200 ] || error "Overlapping ranges on $FILE: expected 200 (Code: $R_CODE)"
+    cmp -s "$RANGE_DIR/body" "www/$FILE" || error "Overlapping ranges on $FILE: body is not the whole file"
+
+    # Several ranges: multipart/byteranges, every part framed by its boundary, then the closing one.
+    # Each part carries the file's own Content-Type.
+    MIME=$(curl -s -I "$URL/$FILE" | grep -i "^Content-Type:" | cut -d' ' -f2- | tr -d '\r')
+    range_request $FILE "bytes=0-9,500-509,-5"
+    [ "$R_CODE" -eq 206 ] || error "Multiple ranges on $FILE: expected 206 (Code: $R_CODE)"
+    BOUNDARY=$(header_value Content-Type | sed -n 's/^multipart\/byteranges; boundary=//p')
+    [ -n "$BOUNDARY" ] || error "Multiple ranges on $FILE: Content-Type is '$(header_value Content-Type)'"
+    {
+        for PART in "0 9" "500 509" "$(( SIZE - 5 )) $(( SIZE - 1 ))"; do
+            set -- $PART
+            printf '\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %d-%d/%d\r\n\r\n' "$BOUNDARY" "$MIME" $1 $2 $SIZE
+            slice $FILE $1 $2
+        done
+        printf '\r\n--%s--\r\n' "$BOUNDARY"
+    } > "$RANGE_DIR/expected"
+    cmp -s "$RANGE_DIR/body" "$RANGE_DIR/expected" || error "Multiple ranges on $FILE: wrong multipart body"
+    [ "$(header_value Content-Length)" -eq "$(stat -c %s "$RANGE_DIR/expected")" ] ||
+        error "Multiple ranges on $FILE: Content-Length doesn't match the body"
+    echo "✓ Range requests on $FILE ($SIZE bytes)"
+done
+
+# 3.6 Test the .gz sidecar: a client that accepts gzip gets the compressed file, one that
+# doesn't gets the plain one. The sidecar is a real gzip of the file, made here.
+for i in $(seq 1 200); do echo ".rule$i { color: #$(printf '%06x' $i); }"; done > www/sidecar_test.css
+gzip -k -9 www/sidecar_test.css
+curl -s -D "$RANGE_DIR/head" -o "$RANGE_DIR/body" -H "Accept-Encoding: gzip" "$URL/sidecar_test.css"
+[ "$(header_value Content-Encoding)" == "gzip" ] || error "Sidecar: Content-Encoding is '$(header_value Content-Encoding)'"
+gunzip -c < "$RANGE_DIR/body" | cmp -s - www/sidecar_test.css || error "Sidecar: the gzip body doesn't unpack to the file"
+curl -s -D "$RANGE_DIR/head" -o "$RANGE_DIR/body" "$URL/sidecar_test.css"
+[ -z "$(header_value Content-Encoding)" ] || error "Sidecar: sent compressed to a client that didn't ask"
+cmp -s "$RANGE_DIR/body" www/sidecar_test.css || error "Sidecar: the plain body isn't the file"
+echo "✓ .gz sidecar negotiated with Accept-Encoding"
+
+# 3.7 Test that io_uring mode hangs up on a client that stops reading. A second server runs
+# with IO_MODEL=io_uring and a 2 second TIMEOUT_SECONDS; the client asks for a 64MB file
+# (far more than the socket buffers hold) and never reads. After a few seconds the server
+# must have closed the connection, so draining the socket ends early, short of the file.
+truncate -s 64M www/stall_test.bin
+HTTP_PORT=8081 HTTP_IO_MODEL=io_uring HTTP_TIMEOUT=2 $SERVER_BIN > "$RANGE_DIR/uring.log" 2>&1 &
+URING_PID=$!
+sleep 2
+if grep -q "io_uring unavailable" "$RANGE_DIR/uring.log"; then
+    echo "io_uring not allowed here. Skipping the stalled reader test."
+else
+    exec 3<>/dev/tcp/localhost/8081 || error "Stalled reader: can't connect to the io_uring server"
+    printf 'GET /stall_test.bin HTTP/1.1\r\nHost: localhost\r\n\r\n' >&3
+    sleep 5
+    GOT=$(timeout 10 cat <&3 | wc -c)
+    exec 3<&-
+    [ "$GOT" -lt $((64 * 1024 * 1024)) ] || error "Stalled reader: io_uring mode sent the whole file instead of hanging up"
+    R_CODE=$(curl -s -o /dev/null -w "%{http_code}" http://localhost:8081/index.html)
+    [ "$R_CODE" == "200" ] || error "Stalled reader: the io_uring server answers $R_CODE afterwards"
+    echo "✓ io_uring mode closed a client that stopped reading (after $GOT bytes)"
+fi
+kill $URING_PID
+wait $URING_PID 2>/dev/null
+URING_PID=
+
 # 4. Concurrency Tests - I test how the server handles multiple simultaneous requests
 log "Running Concurrency Tests (Apache Bench)..."
 if command -v ab >/dev/null 2>&1; then
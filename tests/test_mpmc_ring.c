@@ -0,0 +1,226 @@
+#define _GNU_SOURCE // I need this for sched_yield() and clock_gettime().
+
+// I'm testing the lock-free MPMC ring (src/mpmc_ring.c) with real threads:
+// every item is delivered exactly once, items from one producer come out in the order
+// they went in, and a consumer asleep on an empty ring is always woken by the next push
+// (or by closing the ring).
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/mpmc_ring.h"
+
+#define PRODUCERS 4
+#define CONSUMERS 4
+#define ITEMS_PER_PRODUCER 200000
+#define WAKEUP_ROUNDS 20000
+#define WAKEUP_DEADLINE_MS 2000 // A pushed item must be taken within this long.
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        printf("  FAIL: "); printf(__VA_ARGS__); printf("\n"); \
+        failures++; \
+    } \
+} while (0)
+
+static long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static mpmc_ring_t *new_ring(unsigned capacity, int shared)
+{
+    mpmc_ring_t *r = malloc(mpmc_ring_size(capacity));
+    if (!r) {
+        perror("malloc");
+        exit(1);
+    }
+    mpmc_ring_init(r, capacity, shared);
+    return r;
+}
+
+// * Exactly once, in order
+// Every producer pushes ids producer * ITEMS_PER_PRODUCER + i for i = 0, 1, 2, ...
+// Every consumer checks that the ids it gets from one producer keep growing, and marks
+// each id as seen; an id seen twice (or never) is a failure.
+typedef struct {
+    mpmc_ring_t *ring;
+    int id;
+    unsigned char *seen;
+    int out_of_order;
+    int duplicates;
+    long taken;
+} worker_arg_t;
+
+static void *producer(void *p)
+{
+    worker_arg_t *a = p;
+    for (int i = 0; i < ITEMS_PER_PRODUCER; i++) {
+        int value = a->id * ITEMS_PER_PRODUCER + i;
+        while (mpmc_ring_try_push(a->ring, value) != 0) sched_yield(); // Full: let a consumer in.
+    }
+    return NULL;
+}
+
+static void *consumer(void *p)
+{
+    worker_arg_t *a = p;
+    int last[PRODUCERS];
+    for (int i = 0; i < PRODUCERS; i++) last[i] = -1;
+
+    int value;
+    while ((value = mpmc_ring_pop(a->ring, -1)) >= 0) {
+        int from = value / ITEMS_PER_PRODUCER;
+        int seq = value % ITEMS_PER_PRODUCER;
+        if (seq <= last[from]) a->out_of_order++;
+        last[from] = seq;
+        if (__atomic_exchange_n(&a->seen[value], 1, __ATOMIC_RELAXED)) a->duplicates++;
+        a->taken++;
+    }
+    return NULL;
+}
+
+static void test_exactly_once(int shared, unsigned capacity)
+{
+    printf("exactly once, per-producer order (capacity %u, %s futex)\n", capacity, shared ? "shared" : "private");
+    mpmc_ring_t *ring = new_ring(capacity, shared);
+    unsigned char *seen = calloc(PRODUCERS * ITEMS_PER_PRODUCER, 1);
+
+    pthread_t pt[PRODUCERS], ct[CONSUMERS];
+    worker_arg_t pa[PRODUCERS], ca[CONSUMERS];
+    for (int i = 0; i < CONSUMERS; i++) {
+        ca[i] = (worker_arg_t){.ring = ring, .id = i, .seen = seen};
+        pthread_create(&ct[i], NULL, consumer, &ca[i]);
+    }
+    for (int i = 0; i < PRODUCERS; i++) {
+        pa[i] = (worker_arg_t){.ring = ring, .id = i, .seen = seen};
+        pthread_create(&pt[i], NULL, producer, &pa[i]);
+    }
+    for (int i = 0; i < PRODUCERS; i++) pthread_join(pt[i], NULL);
+
+    // Closing only ends the consumers once they've drained the ring.
+    mpmc_ring_close(ring);
+    long taken = 0;
+    int out_of_order = 0, duplicates = 0;
+    for (int i = 0; i < CONSUMERS; i++) {
+        pthread_join(ct[i], NULL);
+        taken += ca[i].taken;
+        out_of_order += ca[i].out_of_order;
+        duplicates += ca[i].duplicates;
+    }
+
+    long missing = 0;
+    for (long i = 0; i < (long)PRODUCERS * ITEMS_PER_PRODUCER; i++) missing += !seen[i];
+    CHECK(taken == (long)PRODUCERS * ITEMS_PER_PRODUCER, "took %ld items, pushed %d", taken, PRODUCERS * ITEMS_PER_PRODUCER);
+    CHECK(missing == 0, "%ld items never came out", missing);
+    CHECK(duplicates == 0, "%d items came out twice", duplicates);
+    CHECK(out_of_order == 0, "%d items overtook an earlier one from the same producer", out_of_order);
+    CHECK(mpmc_ring_try_push(ring, 1) != 0, "a closed ring accepted a push");
+
+    free(seen);
+    free(ring);
+}
+
+// * Wake-ups
+// The consumers sleep on the empty ring with no timeout. The producer pushes one item at a time
+// and waits for it to be taken, so every push races a consumer that is just going back to sleep.
+// If the sleepers/futex handshake lost a wake-up, the item would sit there with everyone asleep.
+typedef struct {
+    mpmc_ring_t *ring;
+    long taken;         // Shared by all consumers.
+} wake_arg_t;
+
+static void *sleepy_consumer(void *p)
+{
+    wake_arg_t *a = p;
+    while (mpmc_ring_pop(a->ring, -1) >= 0) {
+        __atomic_add_fetch(&a->taken, 1, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+static void test_wakeups(int shared, int consumers)
+{
+    printf("blocked consumers are always woken (%d consumers, %s futex)\n", consumers, shared ? "shared" : "private");
+    mpmc_ring_t *ring = new_ring(16, shared);
+    wake_arg_t arg = {.ring = ring, .taken = 0};
+    pthread_t ct[CONSUMERS];
+    for (int i = 0; i < consumers; i++) pthread_create(&ct[i], NULL, sleepy_consumer, &arg);
+
+    int lost = 0;
+    for (int round = 0; round < WAKEUP_ROUNDS && !lost; round++) {
+        CHECK(mpmc_ring_try_push(ring, round) == 0, "push %d failed on an empty ring", round);
+        long deadline = now_ms() + WAKEUP_DEADLINE_MS;
+        while (__atomic_load_n(&arg.taken, __ATOMIC_SEQ_CST) <= round) {
+            if (now_ms() > deadline) {
+                CHECK(0, "item %d was never taken: a wake-up got lost", round);
+                lost = 1;
+                break;
+            }
+            sched_yield();
+        }
+        // Now and then I give the consumers time to really fall asleep before the next push.
+        if (round % 64 == 0) {
+            struct timespec pause = {0, 200000};
+            nanosleep(&pause, NULL);
+        }
+    }
+
+    // Closing wakes every sleeper, and they all return.
+    long deadline = now_ms() + WAKEUP_DEADLINE_MS;
+    mpmc_ring_close(ring);
+    for (int i = 0; i < consumers; i++) pthread_join(ct[i], NULL);
+    CHECK(now_ms() <= deadline, "closing the ring took more than %d ms to wake the consumers", WAKEUP_DEADLINE_MS);
+    free(ring);
+}
+
+// * Timeouts
+// A timed pop on an empty ring gives up, and a try_pop on it fails right away.
+static void test_timeout(int shared)
+{
+    printf("timed pop on an empty ring (%s futex)\n", shared ? "shared" : "private");
+    mpmc_ring_t *ring = new_ring(4, shared);
+    int value;
+    CHECK(mpmc_ring_try_pop(ring, &value) != 0, "try_pop succeeded on an empty ring");
+
+    long start = now_ms();
+    int rc = mpmc_ring_pop(ring, 50);
+    long waited = now_ms() - start;
+    CHECK(rc == MPMC_RING_TIMED_OUT, "pop returned %d instead of timing out", rc);
+    CHECK(waited >= 40 && waited < 1000, "a 50ms pop waited %ld ms", waited);
+
+    // The ring holds exactly its (rounded) capacity.
+    int pushed = 0;
+    while (mpmc_ring_try_push(ring, pushed) == 0) pushed++;
+    CHECK(pushed == 4, "a ring of 4 took %d items", pushed);
+    for (int i = 0; i < pushed; i++) {
+        CHECK(mpmc_ring_pop(ring, 0) == i, "item %d came out of order", i);
+    }
+    free(ring);
+}
+
+int main()
+{
+    for (int shared = 0; shared <= 1; shared++) {
+        test_timeout(shared);
+        test_exactly_once(shared, 8);    // A small ring: producers keep finding it full.
+        test_exactly_once(shared, 1024);
+        test_wakeups(shared, 1);
+        test_wakeups(shared, CONSUMERS);
+    }
+
+    if (failures) {
+        printf("mpmc_ring: %d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("mpmc_ring: all checks passed\n");
+    return 0;
+}